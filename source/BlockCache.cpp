@@ -0,0 +1,183 @@
+#include "BlockCache.h"
+#include "BufferPool.h"
+#include <cstring>
+#include <algorithm>
+
+BlockCache::BlockCache(uint64_t budgetBytes, uint32_t block_size, WriteBack write_back)
+    : blockSize(block_size), hand(0), writeBack(write_back), generation(0), invalidated(CACHE_INVALIDATION_SLOTS, 0) {
+    size_t count = block_size ? budgetBytes / block_size : 0;
+    frames.assign(count, Frame{0, false, false, false, 0});
+    memory = count ? BufferPool::allocate(block_size, count * static_cast<size_t>(block_size)) : nullptr;
+    if (!memory) frames.clear();
+    index.reserve(frames.size());
+    std::memset(&counters, 0, sizeof(counters));
+    counters.capacity = frames.size();
+}
+
+BlockCache::~BlockCache() {
+    BufferPool::deallocate(memory);
+}
+
+bool BlockCache::enabled() const {
+    return !frames.empty();
+}
+
+char* BlockCache::slot(size_t frame) {
+    return memory + frame * static_cast<size_t>(blockSize);
+}
+
+// A read of block from the disk that started before this may be stale
+void BlockCache::changed(uint64_t block) {
+    invalidated[block % CACHE_INVALIDATION_SLOTS] = ++generation;
+}
+
+// CLOCK: sweep the frames, clearing reference bits, until an unreferenced
+// unpinned frame comes up. Two full sweeps without one means all are pinned.
+size_t BlockCache::victim() {
+    for (size_t step = 0; step < frames.size() * 2; ++step) {
+        size_t f = hand;
+        hand = (hand + 1) % frames.size();
+        Frame& fr = frames[f];
+        if (!fr.valid) return f;
+        if (fr.pins > 0) continue;
+        if (fr.referenced) { fr.referenced = false; continue; }
+
+        if (fr.dirty) {
+            if (!writeBack({BlockRun{static_cast<uint32_t>(fr.block), 1, slot(f)}})) continue;
+            ++counters.writebacks;
+        }
+        changed(fr.block);
+        index.erase(fr.block);
+        fr.valid = false;
+        ++counters.evictions;
+        return f;
+    }
+    return SIZE_MAX;
+}
+
+size_t BlockCache::frameFor(uint64_t block) {
+    auto it = index.find(block);
+    if (it != index.end()) return it->second;
+
+    size_t f = victim();
+    if (f == SIZE_MAX) return f;
+    frames[f] = Frame{block, true, false, false, 0};
+    index[block] = f;
+    return f;
+}
+
+bool BlockCache::get(uint64_t block, char* out) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(block);
+    if (it == index.end()) {
+        ++counters.misses;
+        return false;
+    }
+    frames[it->second].referenced = true;
+    std::memcpy(out, slot(it->second), blockSize);
+    ++counters.hits;
+    return true;
+}
+
+bool BlockCache::put(uint64_t block, const char* data, bool dirty) {
+    lock_guard<mutex> guard(lock);
+    changed(block);
+    size_t f = enabled() ? frameFor(block) : SIZE_MAX;
+    if (f == SIZE_MAX) {
+        return dirty ? writeBack({BlockRun{static_cast<uint32_t>(block), 1, data}}) : true;
+    }
+
+    std::memcpy(slot(f), data, blockSize);
+    frames[f].referenced = true;
+    frames[f].dirty = frames[f].dirty || dirty;
+    return true;
+}
+
+bool BlockCache::contains(uint64_t block) {
+    lock_guard<mutex> guard(lock);
+    return index.count(block) > 0;
+}
+
+uint64_t BlockCache::stamp() {
+    lock_guard<mutex> guard(lock);
+    return generation;
+}
+
+void BlockCache::fill(uint64_t block, const char* data, uint64_t since) {
+    lock_guard<mutex> guard(lock);
+    if (!enabled() || invalidated[block % CACHE_INVALIDATION_SLOTS] > since || index.count(block)) return;
+    size_t f = frameFor(block);
+    if (f == SIZE_MAX) return;
+    std::memcpy(slot(f), data, blockSize);
+}
+
+void BlockCache::discard(uint32_t start, uint32_t count, const char* data) {
+    lock_guard<mutex> guard(lock);
+    for (uint32_t i = 0; i < count; ++i) {
+        changed(start + i);
+        auto it = index.find(start + i);
+        if (it == index.end()) continue;
+        Frame& fr = frames[it->second];
+        if (fr.pins > 0) {
+            std::memcpy(slot(it->second), data + i * static_cast<size_t>(blockSize), blockSize);
+            fr.dirty = false;
+            continue;
+        }
+        fr.valid = false;
+        index.erase(it);
+    }
+}
+
+bool BlockCache::pin(uint64_t block) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(block);
+    if (it == index.end()) return false;
+    ++frames[it->second].pins;
+    return true;
+}
+
+void BlockCache::unpin(uint64_t block) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(block);
+    if (it != index.end() && frames[it->second].pins > 0)
+        --frames[it->second].pins;
+}
+
+bool BlockCache::flush() {
+    lock_guard<mutex> guard(lock);
+    vector<size_t> dirty;
+    for (size_t f = 0; f < frames.size(); ++f)
+        if (frames[f].valid && frames[f].dirty) dirty.push_back(f);
+    std::sort(dirty.begin(), dirty.end(), [&](size_t a, size_t b) {
+        return frames[a].block < frames[b].block;
+    });
+
+    // Stage the dirty blocks in block order so every run is contiguous
+    if (dirty.empty()) return true;
+    char* staging = BufferPool::allocate(blockSize, dirty.size() * static_cast<size_t>(blockSize));
+    if (!staging) return false;
+    vector<BlockRun> runs;
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        const Frame& fr = frames[dirty[i]];
+        char* dst = staging + i * blockSize;
+        std::memcpy(dst, slot(dirty[i]), blockSize);
+        if (!runs.empty() && runs.back().start + runs.back().count == fr.block)
+            ++runs.back().count;
+        else
+            runs.push_back(BlockRun{static_cast<uint32_t>(fr.block), 1, dst});
+    }
+    bool ok = writeBack(runs);
+    BufferPool::deallocate(staging);
+    if (!ok) return false;
+
+    for (size_t f : dirty) frames[f].dirty = false;
+    counters.writebacks += dirty.size();
+    return true;
+}
+
+BlockCacheStats BlockCache::stats() {
+    lock_guard<mutex> guard(lock);
+    BlockCacheStats s = counters;
+    s.cached = index.size();
+    return s;
+}
@@ -0,0 +1,57 @@
+#include "BufferPool.h"
+#include <cstdlib>
+#include <cstdint>
+
+BufferPool::BufferPool(size_t alignment, size_t buffer_size, size_t keep_idle)
+    : alignment(alignment), bufferSize(buffer_size), keep(keep_idle) {}
+
+BufferPool::~BufferPool() {
+    for (char* buf : idle) deallocate(buf);
+}
+
+char* BufferPool::allocate(size_t alignment, size_t bytes) {
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, bytes ? bytes : alignment) != 0) return nullptr;
+    return static_cast<char*>(p);
+}
+
+void BufferPool::deallocate(char* buf) {
+    free(buf);
+}
+
+char* BufferPool::acquire(size_t bytes) {
+    if (bytes > bufferSize) return allocate(alignment, bytes);
+    {
+        lock_guard<mutex> guard(lock);
+        if (!idle.empty()) {
+            char* buf = idle.back();
+            idle.pop_back();
+            return buf;
+        }
+    }
+    return allocate(alignment, bufferSize);
+}
+
+void BufferPool::release(char* buf, size_t bytes) {
+    if (!buf) return;
+    if (bytes <= bufferSize) {
+        lock_guard<mutex> guard(lock);
+        if (idle.size() < keep) {
+            idle.push_back(buf);
+            return;
+        }
+    }
+    deallocate(buf);
+}
+
+size_t BufferPool::alignmentOf() const {
+    return alignment;
+}
+
+size_t BufferPool::bufferBytes() const {
+    return bufferSize;
+}
+
+bool BufferPool::aligned(const void* p) const {
+    return reinterpret_cast<uintptr_t>(p) % alignment == 0;
+}
@@ -0,0 +1,82 @@
+#include "DedupIndex.h"
+#include <cstring>
+#include <algorithm>
+
+DedupIndex::DedupIndex(uint64_t total_blocks) : refs(total_blocks, 0) {
+    std::memset(&counters, 0, sizeof(counters));
+}
+
+// 64-bit multiply/rotate mix over 8-byte words; fast, not cryptographic
+uint64_t DedupIndex::fingerprint(const char* data, size_t len) {
+    const uint64_t k = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = len * k;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, sizeof(w));
+        h = (h ^ (w * k)) * 0xFF51AFD7ED558CCDULL;
+        h = (h << 31) | (h >> 33);
+    }
+    for (; i < len; ++i)
+        h = (h ^ static_cast<uint8_t>(data[i])) * k;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void DedupIndex::ref(uint32_t block) {
+    if (block >= refs.size()) return;
+    if (refs[block]++ == 0) ++counters.physical;
+    ++counters.logical;
+}
+
+uint32_t DedupIndex::unref(uint32_t block) {
+    if (block >= refs.size() || refs[block] == 0) return 0;
+    --counters.logical;
+    if (--refs[block] == 0) {
+        --counters.physical;
+        forget(block);
+    }
+    return refs[block];
+}
+
+uint32_t DedupIndex::refsOf(uint32_t block) const {
+    return block < refs.size() ? refs[block] : 0;
+}
+
+int64_t DedupIndex::lookup(uint64_t print) const {
+    auto it = byPrint.find(print);
+    return it == byPrint.end() ? -1 : static_cast<int64_t>(it->second);
+}
+
+void DedupIndex::record(uint32_t block, uint64_t print) {
+    forget(block);
+    auto it = byPrint.find(print);
+    if (it != byPrint.end()) printOf.erase(it->second);    // newest block wins
+    byPrint[print] = block;
+    printOf[block] = print;
+}
+
+bool DedupIndex::known(uint32_t block) const {
+    return printOf.count(block) != 0;
+}
+
+void DedupIndex::forget(uint32_t block) {
+    auto it = printOf.find(block);
+    if (it == printOf.end()) return;
+    auto owner = byPrint.find(it->second);
+    if (owner != byPrint.end() && owner->second == block) byPrint.erase(owner);
+    printOf.erase(it);
+}
+
+void DedupIndex::clear() {
+    std::fill(refs.begin(), refs.end(), 0);
+    byPrint.clear();
+    printOf.clear();
+    std::memset(&counters, 0, sizeof(counters));
+}
+
+DedupStats DedupIndex::stats() const {
+    return counters;
+}
@@ -0,0 +1,106 @@
+#include "ExtentMap.h"
+
+size_t ExtentMap::lowerBound(uint32_t logical) const {
+    size_t lo = 0, hi = extents.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (static_cast<uint64_t>(extents[mid].logical) + extents[mid].span() <= logical)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+const Extent* ExtentMap::find(uint32_t logical) const {
+    size_t i = lowerBound(logical);
+    if (i < extents.size() && extents[i].logical <= logical)
+        return &extents[i];
+    return nullptr;
+}
+
+void ExtentMap::insert(const Extent& e) {
+    if (e.length == 0) return;
+    size_t i = lowerBound(e.logical);
+    extents.insert(extents.begin() + i, e);
+
+    // Merge with the following run
+    if (i + 1 < extents.size()) {
+        Extent& cur = extents[i];
+        const Extent& next = extents[i + 1];
+        if (!cur.packed() && !next.packed() &&
+            cur.logical + cur.length == next.logical && cur.start + cur.length == next.start) {
+            cur.length += next.length;
+            extents.erase(extents.begin() + i + 1);
+        }
+    }
+    // Merge with the preceding run
+    if (i > 0) {
+        Extent& prev = extents[i - 1];
+        const Extent& cur = extents[i];
+        if (!prev.packed() && !cur.packed() &&
+            prev.logical + prev.length == cur.logical && prev.start + prev.length == cur.start) {
+            prev.length += cur.length;
+            extents.erase(extents.begin() + i);
+        }
+    }
+}
+
+void ExtentMap::remove(uint32_t logical, uint32_t count) {
+    if (count == 0) return;
+    uint64_t end = static_cast<uint64_t>(logical) + count;
+    size_t i = lowerBound(logical);
+    while (i < extents.size() && extents[i].logical < end) {
+        Extent e = extents[i];
+        extents.erase(extents.begin() + i);
+        if (e.packed()) continue;
+        uint64_t e_end = static_cast<uint64_t>(e.logical) + e.length;
+        if (e.logical < logical)
+            extents.insert(extents.begin() + i++, Extent{e.logical, e.start, logical - e.logical});
+        if (e_end > end)
+            extents.insert(extents.begin() + i++, Extent{static_cast<uint32_t>(end),
+                           static_cast<uint32_t>(e.start + (end - e.logical)), static_cast<uint32_t>(e_end - end)});
+    }
+}
+
+ExtentMap::ExtentMap() : reservation{0, 0, 0} {}
+
+void ExtentMap::clear() {
+    extents.clear();
+    reservation = Extent{0, 0, 0};
+}
+
+const Extent& ExtentMap::reserved() const {
+    return reservation;
+}
+
+void ExtentMap::reserve(const Extent& e) {
+    reservation = e.length ? e : Extent{0, 0, 0};
+}
+
+vector<Extent> ExtentMap::stored() const {
+    vector<Extent> runs = extents;
+    if (reservation.length) runs.push_back(reservation);
+    return runs;
+}
+
+void ExtentMap::restore(const vector<Extent>& runs, bool with_reservation) {
+    clear();
+    size_t mapped = runs.size();
+    if (with_reservation && mapped > 0) reservation = runs[--mapped];
+    for (size_t i = 0; i < mapped; ++i) insert(runs[i]);
+}
+
+const vector<Extent>& ExtentMap::list() const {
+    return extents;
+}
+
+size_t ExtentMap::size() const {
+    return extents.size();
+}
+
+uint64_t ExtentMap::blockCount() const {
+    uint64_t total = 0;
+    for (const Extent& e : extents) total += e.blocks();
+    return total;
+}
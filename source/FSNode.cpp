@@ -1,7 +1,9 @@
 #include "FSNode.h"
 
+uint64_t FSNode::use_clock = 0;
+
 FSNode::FSNode(FileEntry* e, FSNode* p)
-    : entry(e), parent(p) {
+    : entry(e), extents(nullptr), parent(p), meta_index(0), dirty(false), loader(nullptr), last_used(0) {
     if (entry->getType() == EntryType::DIRECTORY)
         children = new LinkedList<FSNode*>();
     else
@@ -17,10 +19,43 @@ FSNode::~FSNode() {
         }
         delete children;
     }
+    delete extents;
     delete entry;
 }
 
+void FSNode::ensureLoaded() const {
+    last_used = ++use_clock;
+    if (!loader) return;
+    // Cleared first: the loader adds the children through addChild
+    FSNodeLoader* from = loader;
+    loader = nullptr;
+    from->loadChildren(const_cast<FSNode*>(this));
+}
+
+// Nodes in memory under node, itself included; never loads anything
+static uint64_t loaded_count(const FSNode* node) {
+    uint64_t count = 1;
+    if (node->children)
+        for (auto* it = node->children->getHead(); it; it = it->next)
+            count += loaded_count(it->data);
+    return count;
+}
+
+uint64_t FSNode::unloadChildren(FSNodeLoader* from) {
+    if (!children || loader) return 0;
+    uint64_t count = 0;
+    for (auto* it = children->getHead(); it; it = it->next) {
+        count += loaded_count(it->data);
+        delete it->data;
+    }
+    delete children;
+    children = new LinkedList<FSNode*>();
+    loader = from;
+    return count;
+}
+
 void FSNode::addChild(FSNode* child) {
+    ensureLoaded();
     if (entry->getType() == EntryType::DIRECTORY && children) {
         children->push_back(child);
         child->parent = this;
@@ -29,6 +64,7 @@ void FSNode::addChild(FSNode* child) {
 
 FSNode* FSNode::getChild(const string& name) {
     if (!children) return nullptr;
+    ensureLoaded();
     LinkedListNode<FSNode*>* curr = children->getHead();
     while (curr) {
         FSNode* child = curr->data;
@@ -67,6 +103,7 @@ void FSNode::print() const {
 vector<FSNode*> FSNode::getChildren() const {
     vector<FSNode*> list;
     if (!children) return list;
+    ensureLoaded();
 
     auto node = children->getHead();
     while (node) {
@@ -104,16 +141,7 @@ FSNode* FSNode::find_node_by_path(const string& path) {
         }
         
         // Find child with this name
-        LinkedListNode<FSNode*>* childNode = current->children->getHead();
-        FSNode* child = nullptr;
-        
-        while (childNode != nullptr) {
-            if (childNode->data->entry->name == part) {
-                child = childNode->data;
-                break;
-            }
-            childNode = childNode->next;
-        }
+        FSNode* child = current->getChild(part);
         
         if (!child) return nullptr; // Path component not found
         
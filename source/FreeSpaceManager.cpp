@@ -1,41 +1,189 @@
 #include "FreeSpaceManager.h"
+#include <algorithm>
 
-FreeSpaceManager::FreeSpaceManager(uint64_t total_blocks) : totalBlocks(total_blocks) {
+FreeSpaceManager::FreeSpaceManager(uint64_t total_blocks)
+    : totalBlocks(total_blocks), freeBlocks(total_blocks), heldBlocks(0), leaves(0) {
     uint64_t bytes_needed = (totalBlocks + 7) / 8;
     bitmap.resize(bytes_needed, 0); 
+    bits = bitmap.data();
+    wordDirty.resize((totalBlocks + 63) / 64, 0);
+    rebuildSummary();
+}
+
+void FreeSpaceManager::touch(uint64_t blockIndex) {
+    uint64_t word = blockIndex / 64;
+    if (!wordDirty[word]) {
+        wordDirty[word] = 1;
+        dirtyWords.push_back(word);
+    }
+}
+
+void FreeSpaceManager::recount() {
+    freeBlocks = 0;
+    for (uint64_t w = 0; w < (totalBlocks + 63) / 64; ++w)
+        freeBlocks += __builtin_popcountll(freeMask(w));
 }
 
 void FreeSpaceManager::markUsed(uint64_t blockIndex) {
     uint64_t byteIndex = blockIndex / 8;
     uint8_t bitIndex = blockIndex % 8;
-    bitmap[byteIndex] |= (1 << bitIndex);
+    if (!(bits[byteIndex] & (1 << bitIndex))) --freeBlocks;
+    bits[byteIndex] |= (1 << bitIndex);
+    touch(blockIndex);
+    markStale(blockIndex);
 }
 
 void FreeSpaceManager::markFree(uint64_t blockIndex) {
     uint64_t byteIndex = blockIndex / 8; 
     uint8_t bitIndex = blockIndex % 8;
-    bitmap[byteIndex] &= ~(1 << bitIndex);
+    if (bits[byteIndex] & (1 << bitIndex)) ++freeBlocks;
+    bits[byteIndex] &= ~(1 << bitIndex);
+    touch(blockIndex);
+    markStale(blockIndex);
 }
 
 bool FreeSpaceManager::isFree(uint64_t blockIndex) const {
     uint64_t byteIndex = blockIndex / 8;
     uint8_t bitIndex = blockIndex % 8;
-    return !(bitmap[byteIndex] & (1 << bitIndex));
+    return !(bits[byteIndex] & (1 << bitIndex));
+}
+
+// ------------------ Summary ------------------
+
+void FreeSpaceManager::markStale(uint64_t blockIndex) {
+    uint64_t group = blockIndex / SUMMARY_GROUP_BLOCKS;
+    if (!groupStale[group]) {
+        groupStale[group] = 1;
+        staleGroups.push_back(group);
+    }
+}
+
+// Blocks past totalBlocks (and bytes past the bitmap) count as used
+uint64_t FreeSpaceManager::freeMask(uint64_t word) const {
+    uint64_t used = 0;
+    for (uint64_t k = 0; k < 8; ++k) {
+        uint64_t byte = word * 8 + k;
+        used |= static_cast<uint64_t>(byte < byteSize() ? bits[byte] : 0xFF) << (8 * k);
+    }
+    uint64_t first = word * 64;
+    if (first + 64 > totalBlocks)
+        used |= first >= totalBlocks ? ~0ULL : ~0ULL << (totalBlocks - first);
+    return ~used;
+}
+
+FreeSpaceManager::RunSummary FreeSpaceManager::combine(const RunSummary& left, const RunSummary& right) {
+    RunSummary s;
+    s.length = left.length + right.length;
+    s.prefix = left.prefix == left.length ? left.length + right.prefix : left.prefix;
+    s.suffix = right.suffix == right.length ? right.length + left.suffix : right.suffix;
+    s.longest = std::max(std::max(left.longest, right.longest), left.suffix + right.prefix);
+    return s;
+}
+
+void FreeSpaceManager::summarizeGroup(uint64_t group) const {
+    const uint64_t words = SUMMARY_GROUP_BLOCKS / 64;
+    RunSummary s{0, 0, 0, SUMMARY_GROUP_BLOCKS};
+    uint64_t has_free = 0, run = 0;
+    bool leading = true;
+    for (uint64_t k = 0; k < words; ++k) {
+        uint64_t f = freeMask(group * words + k);
+        if (f) has_free |= 1ULL << k;
+        if (f == ~0ULL) {
+            run += 64;
+            continue;
+        }
+        uint64_t head = __builtin_ctzll(~f);
+        if (leading) s.prefix = run + head;
+        leading = false;
+        s.longest = std::max(s.longest, run + head);
+        uint64_t inner = 0;
+        for (uint64_t m = f; m; m &= m >> 1) ++inner;
+        s.longest = std::max(s.longest, inner);
+        run = __builtin_clzll(~f);
+    }
+    if (leading) s.prefix = run;
+    s.suffix = run;
+    s.longest = std::max(s.longest, run);
+    wordHasFree[group] = has_free;
+    tree[leaves + group] = s;
+}
+
+void FreeSpaceManager::refreshSummary() const {
+    for (uint64_t group : staleGroups) {
+        summarizeGroup(group);
+        for (uint64_t node = (leaves + group) / 2; node >= 1; node /= 2)
+            tree[node] = combine(tree[2 * node], tree[2 * node + 1]);
+        groupStale[group] = 0;
+    }
+    staleGroups.clear();
+}
+
+// Sized for totalBlocks, every group stale
+void FreeSpaceManager::rebuildSummary() {
+    uint64_t groups = (totalBlocks + SUMMARY_GROUP_BLOCKS - 1) / SUMMARY_GROUP_BLOCKS;
+    leaves = 1;
+    while (leaves < groups) leaves *= 2;
+    tree.assign(2 * leaves, RunSummary{0, 0, 0, SUMMARY_GROUP_BLOCKS});
+    for (uint64_t node = leaves - 1; node >= 1; --node)
+        tree[node] = combine(tree[2 * node], tree[2 * node + 1]);
+    wordHasFree.assign(leaves, 0);
+    groupStale.assign(leaves, 0);
+    staleGroups.clear();
+    for (uint64_t group = 0; group < groups; ++group) {
+        groupStale[group] = 1;
+        staleGroups.push_back(group);
+    }
+}
+
+// First run of N inside group, whose summary says there is one
+int64_t FreeSpaceManager::scanGroup(uint64_t group, uint64_t N) const {
+    const uint64_t words = SUMMARY_GROUP_BLOCKS / 64;
+    uint64_t run = 0, start = 0;
+    for (uint64_t k = 0; k < words; ++k) {
+        if (!(wordHasFree[group] & (1ULL << k))) {
+            run = 0;
+            continue;
+        }
+        uint64_t first = (group * words + k) * 64;
+        uint64_t f = freeMask(group * words + k);
+        if (f == ~0ULL) {
+            if (run == 0) start = first;
+            run += 64;
+            if (run >= N) return static_cast<int64_t>(start);
+            continue;
+        }
+        for (uint64_t j = 0; j < 64; ++j) {
+            if (!(f & (1ULL << j))) {
+                run = 0;
+                continue;
+            }
+            if (run == 0) start = first + j;
+            if (++run >= N) return static_cast<int64_t>(start);
+        }
+    }
+    return -1;
 }
 
 int64_t FreeSpaceManager::findFreeBlocks(uint64_t N) {
-    uint64_t consecutive = 0;
-    uint64_t start = 0;
-    for (uint64_t i = 0; i < totalBlocks; ++i) {
-        if (isFree(i)) {
-            if (consecutive == 0) start = i;
-            ++consecutive;
-            if (consecutive == N) return start;
+    if (N == 0) return -1;
+    refreshSummary();
+    if (tree[1].longest < N) return -1;
+
+    // Leftmost start: in the left half, across the middle, or in the right half
+    uint64_t node = 1, base = 0;
+    while (node < leaves) {
+        const RunSummary& left = tree[2 * node];
+        const RunSummary& right = tree[2 * node + 1];
+        if (left.longest >= N) {
+            node = 2 * node;
+        } else if (left.suffix + right.prefix >= N) {
+            return static_cast<int64_t>(base + left.length - left.suffix);
         } else {
-            consecutive = 0;
+            base += left.length;
+            node = 2 * node + 1;
         }
     }
-    return -1; 
+    return scanGroup(node - leaves, N);
 }
 
 void FreeSpaceManager::printBitmap() const {
@@ -48,6 +196,7 @@ void FreeSpaceManager::printBitmap() const {
 }
 
 int64_t FreeSpaceManager::allocate(uint64_t N) {
+    if (freeBlocks < heldBlocks + N) return -1;
     int64_t start = findFreeBlocks(N);
     if (start == -1) return -1; 
     for (uint64_t i = 0; i < N; ++i) {
@@ -62,12 +211,107 @@ void FreeSpaceManager::free(uint64_t start, uint64_t N) {
     }
 }
 
+bool FreeSpaceManager::hold(uint64_t N) {
+    if (freeBlocks < heldBlocks + N) return false;
+    heldBlocks += N;
+    return true;
+}
+
+void FreeSpaceManager::releaseHold(uint64_t N) {
+    heldBlocks -= std::min(N, heldBlocks);
+}
+
+void FreeSpaceManager::markUsedFrom(const FreeSpaceManager& other) {
+    uint64_t limit = std::min(totalBlocks, other.totalBlocks);
+    for (uint64_t w = 0; w < (limit + 63) / 64; ++w) {
+        uint64_t add = ~other.freeMask(w) & freeMask(w);
+        if (w * 64 + 64 > limit) add &= ~(~0ULL << (limit - w * 64));
+        if (!add) continue;
+        for (uint64_t k = 0; k < 8 && w * 8 + k < byteSize(); ++k)
+            bits[w * 8 + k] |= static_cast<uint8_t>(add >> (8 * k));
+        freeBlocks -= __builtin_popcountll(add);
+        touch(w * 64);
+        markStale(w * 64);
+    }
+}
+
+// A run starts at every free block whose predecessor is used, a word at a time
+uint64_t FreeSpaceManager::freeRuns(uint64_t* largest) const {
+    uint64_t runs = 0, carry = 0;
+    for (uint64_t w = 0; w < (totalBlocks + 63) / 64; ++w) {
+        uint64_t f = freeMask(w);
+        runs += __builtin_popcountll(f & ~((f << 1) | carry));
+        carry = f >> 63;
+    }
+    if (largest) {
+        refreshSummary();
+        *largest = tree[1].longest;
+    }
+    return runs;
+}
+
+uint64_t FreeSpaceManager::freeCount() const {
+    return freeBlocks;
+}
+
+void FreeSpaceManager::grow(uint64_t total_blocks) {
+    if (total_blocks <= totalBlocks) return;
+    if (bits == bitmap.data()) {
+        if (bitmap.size() < (total_blocks + 7) / 8) bitmap.resize((total_blocks + 7) / 8, 0);
+        bits = bitmap.data();
+    }
+    wordDirty.resize((total_blocks + 63) / 64, 0);
+    uint64_t old = totalBlocks;
+    totalBlocks = total_blocks;
+    for (uint64_t i = old; i < totalBlocks; ++i) {
+        bits[i / 8] &= ~(1 << (i % 8));
+        touch(i);
+    }
+    freeBlocks += totalBlocks - old;
+    rebuildSummary();
+}
+
 void FreeSpaceManager:: setBitmap(const std::vector<uint8_t>& b) 
 {
      bitmap = b; 
+     bits = bitmap.data();
+     recount();
+     clearDirty();
+     rebuildSummary();
 }
-const vector<uint8_t>& FreeSpaceManager:: getBitmap() const 
+
+void FreeSpaceManager::attachBitmap(uint8_t* external)
+{
+    bitmap.clear();
+    bitmap.shrink_to_fit();
+    bits = external;
+    recount();
+    rebuildSummary();
+}
+
+const uint8_t* FreeSpaceManager::data() const
 { 
-    
-    return bitmap; 
+    return bits; 
+}
+
+uint64_t FreeSpaceManager::byteSize() const
+{
+    return (totalBlocks + 7) / 8;
+}
+
+const vector<uint64_t>& FreeSpaceManager::getDirtyWords() const
+{
+    return dirtyWords;
+}
+
+void FreeSpaceManager::clearDirty()
+{
+    for (uint64_t w : dirtyWords) wordDirty[w] = 0;
+    dirtyWords.clear();
+}
+
+void FreeSpaceManager::markAllDirty()
+{
+    for (uint64_t i = 0; i < totalBlocks; i += 64)
+        touch(i);
 }
@@ -0,0 +1,106 @@
+#include "LZCodec.h"
+#include <cstring>
+#include <vector>
+
+static const int HASH_BITS = 12;
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Length beyond the 15 that fits in a token nibble
+static bool put_length(uint8_t* out, size_t& op, size_t capacity, size_t n) {
+    while (n >= 255) {
+        if (op >= capacity) return false;
+        out[op++] = 255;
+        n -= 255;
+    }
+    if (op >= capacity) return false;
+    out[op++] = static_cast<uint8_t>(n);
+    return true;
+}
+
+static bool get_length(const uint8_t* in, size_t& ip, size_t in_len, size_t& n) {
+    uint8_t b;
+    do {
+        if (ip >= in_len) return false;
+        b = in[ip++];
+        n += b;
+    } while (b == 255);
+    return true;
+}
+
+// match_len 0 writes the closing literals-only sequence
+static bool put_sequence(uint8_t* out, size_t& op, size_t capacity, const uint8_t* literals,
+                         size_t lit_len, size_t offset, size_t match_len) {
+    if (op >= capacity) return false;
+    size_t extra = match_len ? match_len - LZCodec::MIN_MATCH : 0;
+    out[op++] = static_cast<uint8_t>(((lit_len < 15 ? lit_len : 15) << 4) | (extra < 15 ? extra : 15));
+    if (lit_len >= 15 && !put_length(out, op, capacity, lit_len - 15)) return false;
+    if (op + lit_len > capacity) return false;
+    std::memcpy(out + op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0) return true;
+
+    if (op + 2 > capacity) return false;
+    out[op++] = static_cast<uint8_t>(offset & 0xFF);
+    out[op++] = static_cast<uint8_t>(offset >> 8);
+    return extra < 15 || put_length(out, op, capacity, extra - 15);
+}
+
+size_t LZCodec::compress(const char* in, size_t len, char* out, size_t capacity) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+    std::vector<int64_t> table(static_cast<size_t>(1) << HASH_BITS, -1);     // hash -> last position
+
+    size_t op = 0, anchor = 0, i = 0;
+    while (i + MIN_MATCH <= len) {
+        uint32_t h = hash4(src + i);
+        int64_t cand = table[h];
+        table[h] = static_cast<int64_t>(i);
+        if (cand < 0 || i - cand > MAX_OFFSET || std::memcmp(src + cand, src + i, MIN_MATCH) != 0) {
+            ++i;
+            continue;
+        }
+
+        size_t match = MIN_MATCH;
+        while (i + match < len && src[cand + match] == src[i + match]) ++match;
+        if (!put_sequence(dst, op, capacity, src + anchor, i - anchor, i - cand, match)) return 0;
+        i += match;
+        anchor = i;
+    }
+    if (!put_sequence(dst, op, capacity, src + anchor, len - anchor, 0, 0)) return 0;
+    return op;
+}
+
+bool LZCodec::decompress(const char* in, size_t in_len, char* out, size_t len) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+    size_t ip = 0, op = 0;
+
+    while (ip < in_len) {
+        uint8_t token = src[ip++];
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(src, ip, in_len, lit_len)) return false;
+        if (ip + lit_len > in_len || op + lit_len > len) return false;
+        std::memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == in_len) break;
+
+        if (ip + 2 > in_len) return false;
+        size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+        ip += 2;
+        size_t match = token & 0x0F;
+        if (match == 15 && !get_length(src, ip, in_len, match)) return false;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > op || op + match > len) return false;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t k = 0; k < match; ++k, ++op)
+            dst[op] = dst[op - offset];
+    }
+    return op == len;
+}
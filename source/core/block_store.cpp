@@ -0,0 +1,1311 @@
+#include "block_store.h"
+#include "snapshot_store.h"
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <fcntl.h>
+
+// Upper bound on a single positioned I/O, keeps temporary buffers small
+static const uint32_t MAX_IO_BLOCKS = 256;
+// Pooled MAX_IO_BLOCKS buffers kept around between requests
+static const size_t BUFFER_POOL_IDLE = 4;
+
+block_store::block_store(FSInstance* fs_instance) : fs(fs_instance), delayed_count(0), totals_ready(false) {
+    const uint64_t bs = fs->header.block_size;
+    io = io_backend::open(fs->omni_path, O_RDWR | (fs->direct_io ? O_DIRECT : 0));
+    if (!io && fs->direct_io) {
+        // Some file systems (tmpfs) refuse O_DIRECT
+        std::cerr << "Warning: O_DIRECT not supported for " << fs->omni_path
+                  << ", using buffered I/O\n";
+        fs->direct_io = false;
+        io = io_backend::open(fs->omni_path, O_RDWR);
+    }
+    pool = new BufferPool(bs, MAX_IO_BLOCKS * bs, BUFFER_POOL_IDLE);
+    cache = new BlockCache(fs->cache_bytes, bs,
+                           [this](const vector<BlockRun>& runs) { return write_runs(runs); });
+    prefetch = cache->enabled() && fs->prefetch_workers > 0 ? new read_ahead(fs, cache, pool) : nullptr;
+    dedup = fs->dedup ? new DedupIndex(max_blocks(fs->header)) : nullptr;
+    if (io) rebuild_refs();
+}
+
+block_store::~block_store() {
+    delete prefetch;
+    flush();
+    delete cache;
+    delete dedup;
+    delete pool;
+    delete io;
+}
+
+bool block_store::is_open() const {
+    return io != nullptr;
+}
+
+bool block_store::flush() {
+    return !io || cache->flush();
+}
+
+BlockCacheStats block_store::cache_stats() {
+    return cache->stats();
+}
+
+DedupStats block_store::dedup_stats() {
+    DedupStats none = {0, 0};
+    return dedup ? dedup->stats() : none;
+}
+
+// ------------------ FileEntry::reserved ------------------
+
+ContentRef block_store::content_ref(const FileEntry* entry) {
+    ContentRef ref;
+    std::memcpy(&ref, entry->reserved, sizeof(ref));
+    return ref;
+}
+
+void block_store::set_content_ref(FileEntry* entry, const ContentRef& ref) {
+    std::memcpy(entry->reserved, &ref, sizeof(ref));
+}
+
+bool block_store::is_inline(const FileEntry* entry) {
+    return content_ref(entry).layout == LAYOUT_INLINE;
+}
+
+// ------------------ Raw block I/O ------------------
+
+// With O_DIRECT every buffer must be block aligned: requests that use
+// caller memory go through a pooled bounce buffer.
+bool block_store::submit(vector<IoRequest>& batch) {
+    if (!fs->direct_io) return io->submit(batch);
+
+    vector<pair<size_t, char*>> bounced;     // (request, original buffer)
+    for (size_t i = 0; i < batch.size(); ++i) {
+        IoRequest& req = batch[i];
+        if (req.op == IoOp::SYNC || pool->aligned(req.buf)) continue;
+        char* aligned = pool->acquire(req.len);
+        if (req.op == IoOp::WRITE) std::memcpy(aligned, req.buf, req.len);
+        bounced.push_back({i, static_cast<char*>(req.buf)});
+        req.buf = aligned;
+    }
+
+    bool ok = io->submit(batch);
+    for (auto& b : bounced) {
+        IoRequest& req = batch[b.first];
+        if (ok && req.op == IoOp::READ) std::memcpy(b.second, req.buf, req.len);
+        pool->release(static_cast<char*>(req.buf), req.len);
+        req.buf = b.second;
+    }
+    return ok;
+}
+
+bool block_store::write_disk(uint32_t start, uint32_t count, const char* buf) {
+    const uint64_t bs = fs->header.block_size;
+    vector<IoRequest> batch{IoRequest::write(buf, count * bs, start * bs)};
+    return submit(batch);
+}
+
+// All runs go to the kernel in one batch
+bool block_store::write_runs(const vector<BlockRun>& runs) {
+    const uint64_t bs = fs->header.block_size;
+    vector<IoRequest> batch;
+    batch.reserve(runs.size());
+    for (const BlockRun& r : runs)
+        batch.push_back(IoRequest::write(r.data, r.count * bs, r.start * bs));
+    return submit(batch);
+}
+
+// ------------------ Cached block I/O ------------------
+
+bool block_store::read_blocks(uint32_t start, uint32_t count, char* buf, uint32_t* hits) {
+    return read_runs({{start, count}}, buf, hits);
+}
+
+// Read several (start, count) runs into consecutive parts of buf. Hits are
+// copied from the cache; the misses of all runs go out as one batch.
+bool block_store::read_runs(const vector<pair<uint32_t, uint32_t>>& runs, char* buf, uint32_t* hits) {
+    const uint64_t bs = fs->header.block_size;
+    vector<IoRequest> batch;
+    vector<pair<uint32_t, char*>> missed;
+
+    char* dst = buf;
+    for (const auto& run : runs) {
+        for (uint32_t i = 0; i < run.second;) {
+            if (cache->enabled() && cache->get(run.first + i, dst + i * bs)) {
+                if (hits) ++*hits;
+                ++i;
+                continue;
+            }
+            uint32_t j = i + 1;
+            while (j < run.second && !(cache->enabled() && cache->get(run.first + j, dst + j * bs))) ++j;
+            batch.push_back(IoRequest::read(dst + i * bs, (j - i) * bs, (run.first + i) * static_cast<uint64_t>(bs)));
+            for (uint32_t k = i; k < j; ++k) missed.push_back({run.first + k, dst + k * bs});
+            // The block that ended the run of misses was a hit
+            if (j < run.second && hits) ++*hits;
+            i = j + 1;
+        }
+        dst += run.second * bs;
+    }
+    if (batch.empty()) return true;
+    if (!submit(batch)) return false;
+
+    for (const auto& m : missed) {
+        if (cache->enabled()) cache->put(m.first, m.second, false);
+        // Content read back after a restart becomes shareable again
+        if (dedup && dedup->refsOf(m.first) > 0 && !dedup->known(m.first))
+            dedup->record(m.first, DedupIndex::fingerprint(m.second, bs));
+    }
+    return true;
+}
+
+bool block_store::write_blocks(uint32_t start, uint32_t count, const char* buf) {
+    const uint64_t bs = fs->header.block_size;
+    if (!cache->enabled() || count > WRITE_BACK_MAX_BLOCKS) {
+        if (!write_disk(start, count, buf)) return false;
+        // Older cached copies and read-ahead still in flight are stale now
+        cache->discard(start, count, buf);
+        return true;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        if (!cache->put(start + i, buf + i * bs, true)) return false;
+    return true;
+}
+
+// ------------------ Extent map ------------------
+
+uint32_t block_store::extents_per_block() const {
+    return (fs->header.block_size - sizeof(ExtentBlockHeader)) / sizeof(Extent);
+}
+
+ExtentMap* block_store::extents_of(FSNode* node) {
+    if (node->extents) return node->extents;
+    node->extents = new ExtentMap();
+    load_extents(node->entry, *node->extents, nullptr);
+    return node->extents;
+}
+
+// The runs stored for entry; chain, if given, gets the overflow blocks
+void block_store::load_extents(const FileEntry* entry, ExtentMap& map, std::vector<uint32_t>* chain) {
+    ContentRef ref = content_ref(entry);
+    if (ref.layout != LAYOUT_EXTENTS) return;
+
+    vector<Extent> runs;
+    uint32_t inline_count = std::min<uint32_t>(ref.extent_count, INLINE_EXTENTS);
+    for (uint32_t i = 0; i < inline_count; ++i)
+        runs.push_back(ref.inline_extents[i]);
+
+    std::vector<char> block(fs->header.block_size);
+    uint32_t cur = ref.overflow_block;
+    while (cur != 0 && read_blocks(cur, 1, block.data())) {
+        if (chain) chain->push_back(cur);
+        ExtentBlockHeader hdr;
+        std::memcpy(&hdr, block.data(), sizeof(hdr));
+        const char* p = block.data() + sizeof(hdr);
+        for (uint32_t i = 0; i < hdr.count && i < extents_per_block(); ++i) {
+            Extent e;
+            std::memcpy(&e, p + i * sizeof(Extent), sizeof(Extent));
+            runs.push_back(e);
+        }
+        cur = hdr.next;
+    }
+    map.restore(runs, (ref.flags & CONTENT_RESERVED) != 0);
+}
+
+std::vector<uint32_t> block_store::overflow_chain(const FileEntry* entry) {
+    std::vector<uint32_t> chain;
+    ContentRef ref = content_ref(entry);
+    std::vector<char> block(fs->header.block_size);
+    uint32_t cur = (ref.layout == LAYOUT_EXTENTS) ? ref.overflow_block : 0;
+    while (cur != 0 && read_blocks(cur, 1, block.data())) {
+        chain.push_back(cur);
+        ExtentBlockHeader hdr;
+        std::memcpy(&hdr, block.data(), sizeof(hdr));
+        cur = hdr.next;
+    }
+    return chain;
+}
+
+int block_store::save_extents(FSNode* node) {
+    ExtentMap* map = extents_of(node);
+    const vector<Extent> list = map->stored();
+    if (list.size() > UINT16_MAX) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
+    // The chain is copied on write: the old blocks stay intact until the
+    // change that replaces them is committed to the change log.
+    std::vector<uint32_t> old_chain;
+    ExtentMap old_map;      // what the totals counted for the file
+    if (totals_ready) load_extents(node->entry, old_map, &old_chain);
+    else old_chain = overflow_chain(node->entry);
+    std::vector<uint32_t> chain;
+    std::vector<char> block(fs->header.block_size);
+
+    uint32_t per_block = extents_per_block();
+    size_t spill = list.size() > INLINE_EXTENTS ? list.size() - INLINE_EXTENTS : 0;
+    size_t needed = (spill + per_block - 1) / per_block;
+
+    while (chain.size() < needed) {
+        int64_t b = fs->fsm->allocate(1);
+        if (b < 0) {
+            for (uint32_t c : chain) fs->fsm->markFree(c);
+            return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+        chain.push_back(static_cast<uint32_t>(b));
+    }
+
+    ContentRef ref;
+    std::memset(&ref, 0, sizeof(ref));
+    ref.layout = list.empty() ? LAYOUT_EMPTY : LAYOUT_EXTENTS;
+    ref.flags = map->reserved().length ? CONTENT_RESERVED : 0;
+    ref.extent_count = static_cast<uint16_t>(list.size());
+    ref.overflow_block = chain.empty() ? 0 : chain[0];
+    for (size_t i = 0; i < list.size() && i < INLINE_EXTENTS; ++i)
+        ref.inline_extents[i] = list[i];
+
+    size_t next = INLINE_EXTENTS;
+    for (size_t c = 0; c < chain.size(); ++c) {
+        std::fill(block.begin(), block.end(), 0);
+        ExtentBlockHeader hdr;
+        hdr.next = (c + 1 < chain.size()) ? chain[c + 1] : 0;
+        hdr.count = static_cast<uint32_t>(std::min<size_t>(per_block, list.size() - next));
+        std::memcpy(block.data(), &hdr, sizeof(hdr));
+        std::memcpy(block.data() + sizeof(hdr), &list[next], hdr.count * sizeof(Extent));
+        next += hdr.count;
+        if (!write_blocks(chain[c], 1, block.data()))
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+
+    set_content_ref(node->entry, ref);
+    fs_mark_node_dirty(fs, node);
+    for (uint32_t c : old_chain) fs_free_blocks(fs, c, 1);
+    if (totals_ready) {
+        count_runs(old_map.list(), false);
+        count_runs(map->list(), true);
+    }
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// Make sure file blocks [first, last] are backed by container blocks.
+// Holes are filled with the largest contiguous runs the allocator can find;
+// fresh[i] is set for blocks of the range that were just allocated.
+int block_store::map_range(FSNode* node, uint32_t first, uint32_t last, vector<bool>& fresh) {
+    ExtentMap* map = extents_of(node);
+    fresh.assign(last - first + 1, false);
+
+    uint32_t cur = first;
+    while (cur <= last) {
+        size_t i = map->lowerBound(cur);
+        const vector<Extent>& list = map->list();
+        if (i < list.size() && list[i].logical <= cur) {
+            cur = list[i].logical + list[i].span();    // already mapped
+            continue;
+        }
+
+        uint32_t gap_end = last + 1;
+        if (i < list.size() && list[i].logical < gap_end) gap_end = list[i].logical;
+
+        // Reserved blocks are handed out front to back; the ones a write
+        // skips over go back to the free pool
+        const Extent res = map->reserved();
+        uint64_t res_end = static_cast<uint64_t>(res.logical) + res.length;
+        if (res.length && cur >= res.logical && cur < res_end) {
+            uint32_t skip = cur - res.logical;
+            uint32_t take = static_cast<uint32_t>(std::min<uint64_t>(gap_end, res_end) - cur);
+            if (skip > 0) fs_free_blocks(fs, res.start, skip);
+            map->insert(Extent{cur, res.start + skip, take});
+            if (dedup)
+                for (uint32_t k = 0; k < take; ++k) dedup->ref(res.start + skip + k);
+            for (uint32_t k = 0; k < take; ++k) fresh[cur - first + k] = true;
+            map->reserve(Extent{cur + take, res.start + skip + take, res.length - skip - take});
+            cur += take;
+            continue;
+        }
+        if (res.length && cur < res.logical && gap_end > res.logical) gap_end = res.logical;
+
+        uint32_t want = gap_end - cur;
+        while (want > 0) {
+            int64_t start = fs->fsm->allocate(want);
+            if (start >= 0) {
+                map->insert(Extent{cur, static_cast<uint32_t>(start), want});
+                if (dedup)
+                    for (uint32_t k = 0; k < want; ++k) dedup->ref(static_cast<uint32_t>(start) + k);
+                for (uint32_t k = 0; k < want; ++k) fresh[cur - first + k] = true;
+                cur += want;
+                break;
+            }
+            want /= 2;
+        }
+        if (want == 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// ------------------ Inline content ------------------
+
+uint8_t* block_store::inline_data(const FileEntry* entry) {
+    uint64_t slot = content_ref(entry).overflow_block;
+    return fs->inline_area + slot * layout_of(fs->header)->inline_slot_size;
+}
+
+// Takes a free slot for a file without content, or for a copy of a slot a
+// snapshot froze. NO_SPACE when every slot is in use, the caller then
+// stores the file in blocks.
+int block_store::write_inline(FSNode* node, const char* data, uint64_t len, uint64_t offset) {
+    ContentRef ref = content_ref(node->entry);
+    if (ref.layout != LAYOUT_INLINE) {
+        int64_t slot = fs->inline_slots->allocate(1);
+        if (slot < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        std::memset(&ref, 0, sizeof(ref));
+        ref.layout = LAYOUT_INLINE;
+        ref.overflow_block = static_cast<uint32_t>(slot);
+        set_content_ref(node->entry, ref);
+        std::memset(inline_data(node->entry), 0, layout_of(fs->header)->inline_slot_size);
+    } else if (fs->snapshots && fs->snapshots->holds_slot(ref.overflow_block)) {
+        // A snapshot reads the slot: carry on in a copy
+        int64_t slot = fs->inline_slots->allocate(1);
+        if (slot < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        uint64_t slot_size = layout_of(fs->header)->inline_slot_size;
+        std::memcpy(fs->inline_area + slot * slot_size, inline_data(node->entry), slot_size);
+        ref.overflow_block = static_cast<uint32_t>(slot);
+        set_content_ref(node->entry, ref);
+    }
+
+    // Bytes past the end are zero, so a gap before offset reads as a hole
+    std::memcpy(inline_data(node->entry) + offset, data, len);
+    if (offset + len > node->entry->size)
+        node->entry->size = offset + len;
+    fs_mark_inline_dirty(fs, ref.overflow_block);
+    fs_mark_node_dirty(fs, node);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// Move an inline file into blocks. The slot is freed only once the copy
+// has its extents.
+int block_store::promote(FSNode* node) {
+    ContentRef ref = content_ref(node->entry);
+    uint64_t size = node->entry->size;
+    const uint8_t* src = inline_data(node->entry);
+    std::vector<char> content(src, src + size);
+
+    ContentRef empty;
+    std::memset(&empty, 0, sizeof(empty));
+    set_content_ref(node->entry, empty);
+    delete node->extents;
+    node->extents = nullptr;
+    node->entry->size = 0;
+
+    int res = size > 0 ? write_extents(node, content.data(), size, 0)
+                       : static_cast<int>(OFSErrorCodes::SUCCESS);
+    if (res != 0) {
+        ExtentMap* map = extents_of(node);
+        for (const Extent& e : map->list())
+            release_blocks(e.start, e.blocks());
+        map->clear();
+        save_extents(node);
+        set_content_ref(node->entry, ref);
+        node->entry->size = size;
+        return res;
+    }
+    fs_free_inline(fs, ref.overflow_block);
+    return res;
+}
+
+// ------------------ File content ------------------
+
+int block_store::read(FSNode* node, char* out, uint64_t offset, uint64_t len) {
+    if (!node || !node->entry) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    return read_content(node, out, offset, len, true);
+}
+
+int block_store::read_frozen(FSNode* node, char* out, uint64_t offset, uint64_t len) {
+    if (!node || !node->entry) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    return read_content(node, out, offset, len, false);
+}
+
+// observe feeds the access to read-ahead; internal reads leave it out
+int block_store::read_content(FSNode* node, char* out, uint64_t offset, uint64_t len, bool observe) {
+    if (len == 0) return static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    if (is_inline(node->entry)) {
+        uint64_t slot_size = layout_of(fs->header)->inline_slot_size;
+        std::memset(out, 0, len);
+        if (offset < slot_size)
+            std::memcpy(out, inline_data(node->entry) + offset, std::min(len, slot_size - offset));
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+
+    const uint64_t bs = fs->header.block_size;
+    ExtentMap* map = extents_of(node);
+    std::memset(out, 0, len);
+
+    uint32_t first = offset / bs;
+    uint32_t last = (offset + len - 1) / bs;
+    BufferPool::Lease buf(pool, MAX_IO_BLOCKS * bs);
+    uint32_t hits = 0, loaded = 0;
+
+    // Up to MAX_IO_BLOCKS blocks from any number of extents per batch
+    vector<pair<uint32_t, uint32_t>> runs;      // (container block, count)
+    vector<uint32_t> logical;                   // file block of each run
+    uint32_t batched = 0;
+    auto drain = [&]() -> bool {
+        if (runs.empty()) return true;
+        if (!read_runs(runs, buf.data, &hits)) return false;
+        const char* src = buf.data;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            uint64_t seg_begin = static_cast<uint64_t>(logical[r]) * bs;
+            uint64_t from = std::max(offset, seg_begin);
+            uint64_t to = std::min(offset + len, seg_begin + runs[r].second * bs);
+            std::memcpy(out + (from - offset), src + (from - seg_begin), to - from);
+            src += runs[r].second * bs;
+        }
+        loaded += batched;
+        runs.clear();
+        logical.clear();
+        batched = 0;
+        return true;
+    };
+
+    const vector<Extent>& list = map->list();
+    for (size_t i = map->lowerBound(first); i < list.size() && list[i].logical <= last; ++i) {
+        const Extent& e = list[i];
+        if (e.packed()) {
+            if (!read_packed(e, out, offset, len, &hits, &loaded))
+                return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+            continue;
+        }
+        uint32_t seg = std::max(first, e.logical);
+        uint32_t seg_end = std::min<uint64_t>(last, static_cast<uint64_t>(e.logical) + e.length - 1);
+
+        while (seg <= seg_end) {
+            uint32_t n = std::min(seg_end - seg + 1, MAX_IO_BLOCKS - batched);
+            runs.push_back({e.start + (seg - e.logical), n});
+            logical.push_back(seg);
+            batched += n;
+            seg += n;
+            if (batched == MAX_IO_BLOCKS && !drain())
+                return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+    }
+    if (!drain()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    // Delayed blocks are unmapped, so they read as zeros above
+    auto d = delayed.find(node);
+    if (d != delayed.end()) {
+        for (auto it = d->second.lower_bound(first); it != d->second.end() && it->first <= last; ++it) {
+            uint64_t block_begin = static_cast<uint64_t>(it->first) * bs;
+            uint64_t from = std::max(offset, block_begin);
+            uint64_t to = std::min(offset + len, block_begin + bs);
+            std::memcpy(out + (from - offset), it->second.data() + (from - block_begin), to - from);
+        }
+    }
+    if (prefetch && observe) prefetch->observe(node, map, first, last, hits, loaded);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+bool block_store::in_range(uint64_t offset, uint64_t len) const {
+    if (len == 0) return true;
+    if (offset + len < offset) return false;
+    // File blocks are 32-bit below here
+    uint64_t last = (offset + len - 1) / fs->header.block_size;
+    return last <= UINT32_MAX && last < max_blocks(fs->header);
+}
+
+int block_store::write(FSNode* node, const char* data, uint64_t len, uint64_t offset) {
+    if (!node || !node->entry) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (len == 0) return static_cast<int>(OFSErrorCodes::SUCCESS);
+    if (!in_range(offset, len)) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    uint8_t layout = content_ref(node->entry).layout;
+    if (fs->inline_area && offset + len <= layout_of(fs->header)->inline_slot_size &&
+        (layout == LAYOUT_INLINE || (layout == LAYOUT_EMPTY && !has_delayed(node)))) {
+        if (write_inline(node, data, len, offset) == 0)
+            return static_cast<int>(OFSErrorCodes::SUCCESS);
+    }
+    // Too large for its slot, or no slot left for a copy
+    if (content_ref(node->entry).layout == LAYOUT_INLINE) {
+        int res = promote(node);
+        if (res != 0) return res;
+    }
+    return fs->compression ? write_packed(node, data, len, offset) : write_extents(node, data, len, offset);
+}
+
+int block_store::write_extents(FSNode* node, const char* data, uint64_t len, uint64_t offset) {
+    // Writing past the end leaves a hole between the old end and offset:
+    // only the blocks the data touches are allocated
+    // The part past the file's last mapped block can wait for its placement
+    len = write_delayed(node, data, len, offset);
+    if (len == 0) return static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    const uint64_t bs = fs->header.block_size;
+    uint32_t first = offset / bs;
+    uint32_t last = (offset + len - 1) / bs;
+
+    // map_range would take delayed blocks in the range for holes
+    int res = has_delayed(node, first, last) ? allocate_delayed(node) : 0;
+    if (res != 0) return res;
+
+    // Packed clusters in the range go back to plain blocks first
+    res = unpack_range(node, first, last);
+    if (res != 0) return res;
+
+    // Shared and frozen blocks are copied on write: the file gets fresh
+    // blocks for them, and a partially overwritten one still supplies its
+    // old bytes
+    unordered_map<uint32_t, uint32_t> cow;      // file block -> shared block
+    vector<uint32_t> orphaned;
+    bool unshared = (dedup || fs->snapshots) && unshare(node, first, last, offset % bs != 0, (offset + len) % bs != 0,
+                                     cow, orphaned);
+
+    vector<bool> fresh;
+    res = map_range(node, first, last, fresh);
+    if (res != 0) {
+        save_extents(node);
+        return res;
+    }
+
+    ExtentMap* map = extents_of(node);
+    const vector<Extent>& list = map->list();
+
+    // Blocks this write has not filled yet must not be shared with
+    unordered_set<uint32_t> unwritten;
+    vector<DedupRemap> remaps;
+    if (dedup) {
+        for (size_t i = map->lowerBound(first); i < list.size() && list[i].logical <= last; ++i)
+            for (uint32_t k = 0; k < list[i].length; ++k)
+                if (list[i].logical + k >= first && list[i].logical + k <= last)
+                    unwritten.insert(list[i].start + k);
+    }
+
+    // Where a partially overwritten block's old bytes are, -1 if it had none
+    auto old_bytes = [&](uint32_t file_block, uint32_t block) -> int64_t {
+        auto c = cow.find(file_block);
+        if (c != cow.end()) return c->second;
+        return fresh[file_block - first] ? -1 : static_cast<int64_t>(block);
+    };
+
+    BufferPool::Lease buf(pool, MAX_IO_BLOCKS * bs);
+    for (size_t i = map->lowerBound(first); i < list.size() && list[i].logical <= last; ++i) {
+        const Extent& e = list[i];
+        uint32_t seg = std::max(first, e.logical);
+        uint32_t seg_end = std::min<uint64_t>(last, static_cast<uint64_t>(e.logical) + e.length - 1);
+
+        while (seg <= seg_end) {
+            uint32_t n = std::min(seg_end - seg + 1, MAX_IO_BLOCKS);
+            uint32_t phys = e.start + (seg - e.logical);
+            std::memset(buf.data, 0, n * bs);
+
+            uint64_t seg_begin = static_cast<uint64_t>(seg) * bs;
+            uint64_t from = std::max(offset, seg_begin);
+            uint64_t to = std::min(offset + len, seg_begin + n * bs);
+
+            // Partially overwritten edge blocks keep their old bytes
+            int64_t head_src = from > seg_begin ? old_bytes(seg, phys) : -1;
+            int64_t tail_src = to < seg_begin + n * bs ? old_bytes(seg + n - 1, phys + n - 1) : -1;
+            if (head_src >= 0 && !read_blocks(head_src, 1, buf.data))
+                return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+            if (tail_src >= 0 && (n > 1 || head_src < 0) &&
+                !read_blocks(tail_src, 1, buf.data + (n - 1) * bs))
+                return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+            std::memcpy(buf.data + (from - seg_begin), data + (from - offset), to - from);
+            bool written = dedup ? write_deduped(seg, phys, n, buf.data, unwritten, remaps)
+                                 : write_blocks(phys, n, buf.data);
+            if (!written) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+            seg += n;
+        }
+    }
+
+    for (const DedupRemap& r : remaps) {
+        map->remove(r.logical, 1);
+        map->insert(Extent{r.logical, r.target, 1});
+        release_blocks(r.old, 1);
+    }
+    for (uint32_t b : orphaned) fs_free_blocks(fs, b, 1);
+
+    // Pure overwrites leave the map (and its overflow chain) untouched
+    if (unshared || !remaps.empty() || std::find(fresh.begin(), fresh.end(), true) != fresh.end()) {
+        res = save_extents(node);
+        if (res != 0) return res;
+    }
+
+    if (offset + len > node->entry->size)
+        node->entry->size = offset + len;
+    fs_mark_node_dirty(fs, node);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// ------------------ Delayed allocation ------------------
+
+bool block_store::has_delayed(FSNode* node) const {
+    return delayed.count(node) != 0;
+}
+
+bool block_store::has_delayed(FSNode* node, uint32_t first, uint32_t last) const {
+    auto it = delayed.find(node);
+    if (it == delayed.end()) return false;
+    auto b = it->second.lower_bound(first);
+    return b != it->second.end() && b->first <= last;
+}
+
+// Keep the part of a write that lies past the last mapped file block of
+// its range in memory. Returns the length of the leading part left for
+// write_extents, len if nothing was delayed.
+uint64_t block_store::write_delayed(FSNode* node, const char* data, uint64_t len, uint64_t offset) {
+    if (!fs->delayed_alloc || fs->compression) return len;
+    const uint64_t bs = fs->header.block_size;
+    uint32_t first = offset / bs;
+    uint32_t last = (offset + len - 1) / bs;
+
+    ExtentMap* map = extents_of(node);
+    if (map->reserved().length) return len;     // placement is already chosen
+    const vector<Extent>& list = map->list();
+    size_t i = map->lowerBound(last);
+    if (i < list.size() && list[i].logical <= last) return len;
+    uint32_t split = first;
+    if (i > 0) {
+        uint64_t end = static_cast<uint64_t>(list[i - 1].logical) + list[i - 1].span();
+        if (end > first) split = static_cast<uint32_t>(end);
+    }
+
+    auto it = delayed.find(node);
+    uint64_t added = last - split + 1;
+    if (it != delayed.end())
+        for (auto b = it->second.lower_bound(split); b != it->second.end() && b->first <= last; ++b) --added;
+    if (delayed_count + added > DELAYED_MAX_BLOCKS) {
+        allocate_delayed();
+        return len;
+    }
+    // Held from now on, so placement cannot run out of space later
+    if (!fs->fsm->hold(added)) return len;
+
+    uint64_t from_offset = std::max<uint64_t>(offset, static_cast<uint64_t>(split) * bs);
+    std::map<uint32_t, vector<char>>& blocks = delayed[node];
+    for (uint32_t b = split; b <= last; ++b) {
+        vector<char>& block = blocks[b];
+        if (block.empty()) {
+            block.assign(bs, 0);
+            ++delayed_count;
+        }
+        uint64_t block_begin = static_cast<uint64_t>(b) * bs;
+        uint64_t from = std::max(from_offset, block_begin);
+        uint64_t to = std::min(offset + len, block_begin + bs);
+        std::memcpy(block.data() + (from - block_begin), data + (from - offset), to - from);
+    }
+    if (offset + len > node->entry->size)
+        node->entry->size = offset + len;
+    fs_mark_node_dirty(fs, node);
+    return from_offset - offset;
+}
+
+// Give the file's delayed blocks container blocks, in file order: one run
+// when the allocator has it, the largest runs it can find otherwise. The
+// blocks stay delayed, and held, if there is not enough space.
+int block_store::allocate_delayed(FSNode* node) {
+    auto it = delayed.find(node);
+    if (it == delayed.end()) return static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    uint32_t need = static_cast<uint32_t>(it->second.size());
+    fs->fsm->releaseHold(need);     // the hold becomes the allocation
+    vector<pair<uint32_t, uint32_t>> runs;      // (block, count)
+    for (uint32_t want = need; need > 0 && want > 0;) {
+        want = std::min(want, need);
+        int64_t start = fs->fsm->allocate(want);
+        if (start < 0) {
+            want /= 2;
+            continue;
+        }
+        runs.push_back({static_cast<uint32_t>(start), want});
+        need -= want;
+    }
+    if (need > 0) {
+        for (const auto& r : runs) fs->fsm->free(r.first, r.second);
+        fs->fsm->hold(it->second.size());
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+
+    std::map<uint32_t, vector<char>> blocks = std::move(it->second);
+    delayed.erase(it);
+    delayed_count -= blocks.size();
+
+    ExtentMap* map = extents_of(node);
+    vector<pair<uint32_t, uint32_t>> placed;    // (file block, block)
+    unordered_set<uint32_t> unwritten;
+    size_t r = 0;
+    uint32_t used = 0;
+    for (const auto& b : blocks) {
+        uint32_t phys = runs[r].first + used;
+        if (++used == runs[r].second) {
+            ++r;
+            used = 0;
+        }
+        placed.push_back({b.first, phys});
+        map->insert(Extent{b.first, phys, 1});
+        if (dedup) {
+            dedup->ref(phys);
+            unwritten.insert(phys);
+        }
+    }
+
+    // One write per stretch that is consecutive in the file and on disk
+    const uint64_t bs = fs->header.block_size;
+    BufferPool::Lease buf(pool, MAX_IO_BLOCKS * bs);
+    vector<DedupRemap> remaps;
+    auto src = blocks.begin();
+    for (size_t k = 0; k < placed.size();) {
+        size_t j = k;
+        while (j < placed.size() && j - k < MAX_IO_BLOCKS &&
+               (j == k || (placed[j].first == placed[j - 1].first + 1 && placed[j].second == placed[j - 1].second + 1))) {
+            std::memcpy(buf.data + (j - k) * bs, src->second.data(), bs);
+            ++src;
+            ++j;
+        }
+        uint32_t n = static_cast<uint32_t>(j - k);
+        bool written = dedup ? write_deduped(placed[k].first, placed[k].second, n, buf.data, unwritten, remaps)
+                             : write_blocks(placed[k].second, n, buf.data);
+        if (!written) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        k = j;
+    }
+
+    for (const DedupRemap& m : remaps) {
+        map->remove(m.logical, 1);
+        map->insert(Extent{m.logical, m.target, 1});
+        release_blocks(m.old, 1);
+    }
+    return save_extents(node);
+}
+
+int block_store::allocate_delayed() {
+    int result = static_cast<int>(OFSErrorCodes::SUCCESS);
+    vector<FSNode*> nodes;
+    for (const auto& d : delayed) nodes.push_back(d.first);
+    for (FSNode* node : nodes) {
+        // Logging may commit, which places the rest first
+        if (!has_delayed(node)) continue;
+        int res = allocate_delayed(node);
+        if (res == 0) fs_log_entry(fs, node);
+        else result = res;
+    }
+    return result;
+}
+
+// ------------------ Compression ------------------
+
+// Cache key of block index of the decoded cluster whose packed run starts
+// at start. Kept above every 32-bit container block number, and distinct
+// for every (start, index) since index < CLUSTER_BLOCKS.
+uint64_t block_store::decoded_key(uint32_t start, uint32_t index) {
+    return (1ULL << 63) | (static_cast<uint64_t>(start) * CLUSTER_BLOCKS + index);
+}
+
+bool block_store::decode_cluster(const char* stored, size_t stored_len, char* cluster) {
+    const uint64_t cluster_bytes = CLUSTER_BLOCKS * static_cast<uint64_t>(fs->header.block_size);
+    PackedHeader hdr;
+    std::memcpy(&hdr, stored, sizeof(hdr));
+    if (hdr.magic != PACKED_MAGIC || hdr.raw_length > cluster_bytes ||
+        sizeof(hdr) + static_cast<uint64_t>(hdr.packed_length) > stored_len)
+        return false;
+    std::memset(cluster, 0, cluster_bytes);
+    return LZCodec::decompress(stored + sizeof(hdr), hdr.packed_length, cluster, hdr.raw_length);
+}
+
+// Copy the part of a packed cluster that overlaps [offset, offset + len)
+bool block_store::read_packed(const Extent& e, char* out, uint64_t offset, uint64_t len,
+                              uint32_t* hits, uint32_t* loaded) {
+    const uint64_t bs = fs->header.block_size;
+    uint64_t begin = static_cast<uint64_t>(e.logical) * bs;
+    uint64_t from = std::max(offset, begin);
+    uint64_t to = std::min(offset + len, begin + CLUSTER_BLOCKS * bs);
+    uint32_t b_first = (from - begin) / bs, b_last = (to - 1 - begin) / bs;
+
+    BufferPool::Lease cluster(pool, CLUSTER_BLOCKS * bs);
+    bool cached = cache->enabled();
+    for (uint32_t b = b_first; cached && b <= b_last; ++b)
+        cached = cache->get(decoded_key(e.start, b), cluster.data + b * bs);
+
+    if (cached) {
+        *hits += e.blocks();
+    } else {
+        BufferPool::Lease stored(pool, e.blocks() * bs);
+        if (!read_runs({{e.start, e.blocks()}}, stored.data, hits)) return false;
+        if (!decode_cluster(stored.data, e.blocks() * bs, cluster.data)) {
+            std::cerr << "Error: corrupt compressed cluster at block " << e.start << "\n";
+            return false;
+        }
+        if (cache->enabled())
+            for (uint32_t b = 0; b < CLUSTER_BLOCKS; ++b)
+                cache->put(decoded_key(e.start, b), cluster.data + b * bs, false);
+    }
+    *loaded += e.blocks();
+    std::memcpy(out + (from - offset), cluster.data + (from - begin), to - from);
+    return true;
+}
+
+// Unmap every block of the cluster starting at file block first
+void block_store::drop_cluster(FSNode* node, uint32_t first) {
+    ExtentMap* map = extents_of(node);
+    const vector<Extent>& list = map->list();
+    uint64_t end = static_cast<uint64_t>(first) + CLUSTER_BLOCKS;
+    for (size_t i = map->lowerBound(first); i < list.size() && list[i].logical < end; ++i) {
+        const Extent& e = list[i];
+        if (e.packed()) {
+            release_blocks(e.start, e.blocks());
+            continue;
+        }
+        uint32_t lo = std::max(first, e.logical);
+        uint64_t hi = std::min<uint64_t>(end, static_cast<uint64_t>(e.logical) + e.length);
+        release_blocks(e.start + (lo - e.logical), static_cast<uint32_t>(hi - lo));
+    }
+    map->remove(first, CLUSTER_BLOCKS);
+}
+
+// Rewrite packed clusters overlapping file blocks [first, last] as plain blocks
+int block_store::unpack_range(FSNode* node, uint32_t first, uint32_t last) {
+    const uint64_t bs = fs->header.block_size;
+    ExtentMap* map = extents_of(node);
+    while (true) {
+        const vector<Extent>& list = map->list();
+        size_t i = map->lowerBound(first);
+        while (i < list.size() && list[i].logical <= last && !list[i].packed()) ++i;
+        if (i >= list.size() || list[i].logical > last) break;
+
+        Extent e = list[i];
+        uint64_t begin = static_cast<uint64_t>(e.logical) * bs;
+        uint64_t used = node->entry->size > begin ? std::min<uint64_t>(CLUSTER_BLOCKS * bs, node->entry->size - begin) : 0;
+        BufferPool::Lease cluster(pool, CLUSTER_BLOCKS * bs);
+        int res = read_content(node, cluster.data, begin, used, false);
+        if (res != 0) return res;
+        drop_cluster(node, e.logical);
+        res = used > 0 ? write_extents(node, cluster.data, used, begin) : save_extents(node);
+        if (res != 0) return res;
+    }
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// Write cluster by cluster. Each touched cluster is rebuilt in memory and
+// compressed; it is stored packed if that saves at least one block and
+// goes through write_extents as plain blocks otherwise.
+int block_store::write_packed(FSNode* node, const char* data, uint64_t len, uint64_t offset) {
+    const uint64_t bs = fs->header.block_size;
+    const uint64_t cluster_bytes = CLUSTER_BLOCKS * bs;
+    uint64_t old_size = node->entry->size;
+    uint64_t end = offset + len;
+    uint64_t new_size = std::max(old_size, end);
+
+    ExtentMap* map = extents_of(node);
+    BufferPool::Lease cluster(pool, cluster_bytes);
+    BufferPool::Lease packed(pool, cluster_bytes);
+    bool changed = false;
+
+    for (uint64_t c = offset / cluster_bytes; c <= (end - 1) / cluster_bytes; ++c) {
+        uint64_t begin = c * cluster_bytes;
+        uint64_t from = std::max(offset, begin);
+        uint64_t to = std::min(end, begin + cluster_bytes);
+        uint64_t used = std::min(begin + cluster_bytes, new_size) - begin;
+        uint32_t first = static_cast<uint32_t>(c * CLUSTER_BLOCKS);
+
+        // Bytes of the cluster this write leaves alone come from the file
+        std::memset(cluster.data, 0, cluster_bytes);
+        if (begin < old_size && (from > begin || to < begin + used)) {
+            int res = read_content(node, cluster.data, begin, std::min(old_size - begin, cluster_bytes), false);
+            if (res != 0) return res;
+        }
+        std::memcpy(cluster.data + (from - begin), data + (from - offset), to - from);
+
+        // Packing has to save at least one block over plain storage
+        uint64_t plain = (used + bs - 1) / bs;
+        uint64_t room = plain > 1 ? (plain - 1) * bs - sizeof(PackedHeader) : 0;
+        size_t n = room ? LZCodec::compress(cluster.data, used, packed.data + sizeof(PackedHeader), room) : 0;
+        uint32_t k = static_cast<uint32_t>((sizeof(PackedHeader) + n + bs - 1) / bs);
+        int64_t start = n > 0 ? fs->fsm->allocate(k) : -1;
+
+        if (start < 0) {
+            const Extent* e = map->find(first);
+            bool was_packed = e && e->packed();
+            if (was_packed) drop_cluster(node, first);
+            int res = was_packed ? write_extents(node, cluster.data, used, begin)
+                                 : write_extents(node, data + (from - offset), to - from, from);
+            if (res != 0) return res;
+            continue;
+        }
+
+        PackedHeader hdr = {PACKED_MAGIC, static_cast<uint32_t>(used), static_cast<uint32_t>(n), 0};
+        std::memcpy(packed.data, &hdr, sizeof(hdr));
+        std::memset(packed.data + sizeof(hdr) + n, 0, k * bs - sizeof(hdr) - n);
+        if (!write_blocks(static_cast<uint32_t>(start), k, packed.data)) {
+            fs->fsm->free(start, k);
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+        if (cache->enabled())
+            for (uint32_t b = 0; b < CLUSTER_BLOCKS; ++b)
+                cache->put(decoded_key(static_cast<uint32_t>(start), b), cluster.data + b * bs, false);
+
+        drop_cluster(node, first);
+        map->insert(Extent{first, static_cast<uint32_t>(start), k | EXTENT_PACKED});
+        if (dedup)
+            for (uint32_t b = 0; b < k; ++b) dedup->ref(static_cast<uint32_t>(start) + b);
+        changed = true;
+    }
+
+    if (changed) {
+        int res = save_extents(node);
+        if (res != 0) return res;
+    }
+    node->entry->size = new_size;
+    fs_mark_node_dirty(fs, node);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// ------------------ Fragmentation ------------------
+
+uint32_t block_store::fragments(FSNode* node) {
+    if (node->entry->getType() != EntryType::FILE || is_inline(node->entry)) return 0;
+    return pieces(extents_of(node)->list());
+}
+
+uint32_t block_store::pieces(const vector<Extent>& list) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < list.size(); ++i)
+        if (i == 0 || list[i].start != list[i - 1].start + list[i - 1].blocks()) ++count;
+    return count;
+}
+
+// ------------------ Totals ------------------
+
+// Add what one file's runs contribute to the totals, or take it away
+void block_store::count_runs(const vector<Extent>& list, bool add) {
+    CompressionStats packed = {0, 0};
+    for (const Extent& e : list) {
+        if (!e.packed()) continue;
+        packed.logical += e.span();
+        packed.stored += e.blocks();
+    }
+    FragmentationStats frag = {0, pieces(list)};
+    frag.files = frag.fragments > 0;
+    if (add) {
+        packed_total.logical += packed.logical;
+        packed_total.stored += packed.stored;
+        fragment_total.files += frag.files;
+        fragment_total.fragments += frag.fragments;
+    } else {
+        packed_total.logical -= packed.logical;
+        packed_total.stored -= packed.stored;
+        fragment_total.files -= frag.files;
+        fragment_total.fragments -= frag.fragments;
+    }
+}
+
+// One walk over every stored file, without loading the tree; save_extents
+// keeps the totals current from then on
+void block_store::count_totals() {
+    packed_total = {0, 0};
+    fragment_total = {0, 0};
+    auto count = [this](const FileEntry* entry) {
+        if (entry->getType() != EntryType::FILE || content_ref(entry).layout != LAYOUT_EXTENTS) return;
+        ExtentMap map;
+        load_extents(entry, map, nullptr);
+        count_runs(map.list(), true);
+    };
+    fs_walk(fs, [&](FSNode* node) { count(node->entry); },
+            [&](uint32_t, const MetaSlot& slot) { count(&slot.entry); });
+    totals_ready = true;
+}
+
+CompressionStats block_store::compression_stats() {
+    if (!totals_ready) count_totals();
+    return packed_total;
+}
+
+FragmentationStats block_store::fragmentation_stats() {
+    if (!totals_ready) count_totals();
+    return fragment_total;
+}
+
+// A run can be moved if it is plain and no other file or snapshot uses it.
+// Packed runs stay: their decoded clusters are cached under the start block.
+bool block_store::movable(const Extent& e) {
+    if (e.packed()) return false;
+    for (uint32_t k = 0; k < e.blocks(); ++k) {
+        uint32_t block = e.start + k;
+        if ((dedup && dedup->refsOf(block) > 1) || (fs->snapshots && fs->snapshots->holds_block(block)))
+            return false;
+    }
+    return true;
+}
+
+int block_store::defragment(FSNode* node, bool* moved) {
+    *moved = false;
+    if (fragments(node) < 2) return static_cast<int>(OFSErrorCodes::SUCCESS);
+    ExtentMap* map = extents_of(node);
+    const vector<Extent> list = map->list();
+
+    // Windows of consecutive movable runs that fit in one step; the first
+    // one that is not already contiguous gets merged
+    size_t first = 0, last = 0;
+    uint64_t total = 0;
+    bool split = false;
+    for (size_t i = 0; i < list.size() && !split;) {
+        if (!movable(list[i])) {
+            ++i;
+            continue;
+        }
+        first = i;
+        total = list[i].blocks();
+        for (last = i + 1; last < list.size() && movable(list[last]) &&
+                           total + list[last].blocks() <= DEFRAG_STEP_BLOCKS; ++last) {
+            if (list[last].start != list[last - 1].start + list[last - 1].blocks()) split = true;
+            total += list[last].blocks();
+        }
+        i = last;
+    }
+    if (!split) return static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    int64_t target = fs->fsm->allocate(total);
+    if (target < 0) return static_cast<int>(OFSErrorCodes::SUCCESS);   // no run that large is free
+
+    const uint64_t bs = fs->header.block_size;
+    BufferPool::Lease buf(pool, total * bs);
+    vector<pair<uint32_t, uint32_t>> runs;
+    for (size_t i = first; i < last; ++i) runs.push_back({list[i].start, list[i].blocks()});
+    if (!read_runs(runs, buf.data, nullptr) ||
+        !write_blocks(static_cast<uint32_t>(target), static_cast<uint32_t>(total), buf.data)) {
+        fs->fsm->free(target, total);
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+
+    uint32_t at = static_cast<uint32_t>(target);
+    for (size_t i = first; i < last; ++i) {
+        const Extent& e = list[i];
+        map->remove(e.logical, e.span());
+        map->insert(Extent{e.logical, at, e.length});
+        for (uint32_t k = 0; dedup && k < e.blocks(); ++k) {
+            dedup->ref(at + k);
+            dedup->record(at + k, DedupIndex::fingerprint(buf.data + (at - target + k) * bs, bs));
+        }
+        release_blocks(e.start, e.blocks());
+        at += e.blocks();
+    }
+    *moved = true;
+    return save_extents(node);
+}
+
+// ------------------ Deduplication ------------------
+
+// Drop one file reference from each block of the run; without dedup every
+// block has exactly one
+void block_store::release_blocks(uint32_t start, uint32_t count) {
+    if (!dedup) {
+        fs_free_blocks(fs, start, count);
+        return;
+    }
+    uint32_t run = 0;
+    for (uint32_t k = 0; k < count; ++k) {
+        if (dedup->unref(start + k) == 0) {
+            ++run;
+            continue;
+        }
+        if (run > 0) fs_free_blocks(fs, start + k - run, run);
+        run = 0;
+    }
+    if (run > 0) fs_free_blocks(fs, start + count - run, run);
+}
+
+// Unmap the shared blocks of file blocks [first, last]: those other files
+// reference, and those a snapshot froze. Partially overwritten edge blocks
+// are remembered in cow; blocks left with no reference (shared only within
+// this range) go to orphaned, to be freed once their bytes are no longer
+// needed.
+bool block_store::unshare(FSNode* node, uint32_t first, uint32_t last, bool head_partial, bool tail_partial,
+                          unordered_map<uint32_t, uint32_t>& cow, vector<uint32_t>& orphaned) {
+    ExtentMap* map = extents_of(node);
+    const vector<Extent>& list = map->list();
+    vector<pair<uint32_t, uint32_t>> shared;    // (file block, block)
+    for (size_t i = map->lowerBound(first); i < list.size() && list[i].logical <= last; ++i) {
+        const Extent& e = list[i];
+        uint32_t from = std::max(first, e.logical);
+        uint32_t to = std::min<uint64_t>(last, static_cast<uint64_t>(e.logical) + e.length - 1);
+        for (uint32_t b = from; b <= to; ++b) {
+            uint32_t block = e.start + (b - e.logical);
+            if ((dedup && dedup->refsOf(block) > 1) || (fs->snapshots && fs->snapshots->holds_block(block)))
+                shared.push_back({b, block});
+        }
+    }
+
+    for (const auto& s : shared) {
+        map->remove(s.first, 1);
+        if (!dedup || dedup->unref(s.second) == 0) orphaned.push_back(s.second);
+        if ((s.first == first && head_partial) || (s.first == last && tail_partial))
+            cow[s.first] = s.second;
+    }
+    return !shared.empty();
+}
+
+// A block elsewhere in the container holding exactly these bytes, -1 if none
+int64_t block_store::find_duplicate(const char* block, uint64_t print, uint32_t self,
+                                    const unordered_set<uint32_t>& unwritten) {
+    int64_t cand = dedup->lookup(print);
+    if (cand < 0 || cand == self || dedup->refsOf(cand) == 0 || unwritten.count(cand)) return -1;
+
+    const uint64_t bs = fs->header.block_size;
+    vector<char> existing(bs);
+    if (!read_blocks(static_cast<uint32_t>(cand), 1, existing.data())) return -1;
+    return std::memcmp(existing.data(), block, bs) == 0 ? cand : -1;
+}
+
+// Write count blocks of buf meant for blocks [start, start + count) (file
+// blocks from logical). Blocks that duplicate existing content, or an
+// earlier block of the same batch, are not written; they become remaps.
+bool block_store::write_deduped(uint32_t logical, uint32_t start, uint32_t count, const char* buf,
+                                unordered_set<uint32_t>& unwritten, vector<DedupRemap>& remaps) {
+    const uint64_t bs = fs->header.block_size;
+    vector<uint64_t> prints(count);
+    vector<bool> skip(count, false);
+    unordered_map<uint64_t, uint32_t> batch;    // fingerprint -> index in buf
+
+    for (uint32_t k = 0; k < count; ++k) {
+        const char* block = buf + k * bs;
+        prints[k] = DedupIndex::fingerprint(block, bs);
+
+        int64_t target = -1;
+        auto same = batch.find(prints[k]);
+        if (same != batch.end() && std::memcmp(buf + same->second * bs, block, bs) == 0)
+            target = start + same->second;
+        else
+            target = find_duplicate(block, prints[k], start + k, unwritten);
+
+        if (target < 0) {
+            batch.emplace(prints[k], k);
+            continue;
+        }
+        skip[k] = true;
+        dedup->ref(static_cast<uint32_t>(target));
+        remaps.push_back(DedupRemap{logical + k, static_cast<uint32_t>(target), start + k});
+    }
+
+    for (uint32_t k = 0; k < count;) {
+        if (skip[k]) { ++k; continue; }
+        uint32_t j = k;
+        while (j < count && !skip[j]) ++j;
+        if (!write_blocks(start + k, j - k, buf + k * bs)) return false;
+        k = j;
+    }
+
+    for (uint32_t k = 0; k < count; ++k) {
+        unwritten.erase(start + k);
+        if (!skip[k]) dedup->record(start + k, prints[k]);
+    }
+    return true;
+}
+
+void block_store::rebuild_refs() {
+    if (!dedup) return;
+    dedup->clear();
+    auto ref_runs = [this](const vector<Extent>& list) {
+        for (const Extent& e : list)
+            for (uint32_t k = 0; k < e.blocks(); ++k)
+                dedup->ref(e.start + k);
+    };
+    fs_walk(fs,
+            [&](FSNode* node) {
+                if (node->entry->getType() == EntryType::FILE) ref_runs(extents_of(node)->list());
+            },
+            [&](uint32_t, const MetaSlot& slot) {
+                if (slot.entry.getType() != EntryType::FILE) return;
+                ExtentMap map;
+                load_extents(&slot.entry, map, nullptr);
+                ref_runs(map.list());
+            });
+}
+
+void block_store::release(FSNode* node) {
+    if (!node || !node->entry) return;
+
+    ContentRef ref = content_ref(node->entry);
+    if (ref.layout == LAYOUT_INLINE) fs_free_inline(fs, ref.overflow_block);
+
+    auto d = delayed.find(node);
+    if (d != delayed.end()) {
+        delayed_count -= d->second.size();
+        fs->fsm->releaseHold(d->second.size());
+        delayed.erase(d);
+    }
+
+    ExtentMap* map = extents_of(node);
+    for (const Extent& e : map->list())
+        release_blocks(e.start, e.blocks());
+    if (map->reserved().length) fs_free_blocks(fs, map->reserved().start, map->reserved().length);
+    map->clear();
+    save_extents(node);     // drops the overflow chain and the inline slot
+    node->entry->size = 0;
+    if (prefetch) prefetch->forget(node->entry->inode);
+}
+
+uint64_t block_store::blocks_used(FSNode* node) {
+    if (!node || !node->entry) return 0;
+    ExtentMap* map = extents_of(node);
+    auto d = delayed.find(node);
+    uint64_t pending = d != delayed.end() ? d->second.size() : 0;
+    return map->blockCount() + map->reserved().length + pending + overflow_chain(node->entry).size();
+}
+
+void block_store::claim(FSNode* node) {
+    if (!node || !node->entry) return;
+    claim(node->entry, extents_of(node), fs->fsm, fs->inline_slots, true);
+}
+
+int block_store::reserve(FSNode* node, uint64_t size) {
+    if (!node || !node->entry) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    // Small enough for the inline area: there is nothing to set aside
+    uint8_t layout = content_ref(node->entry).layout;
+    if (fs->inline_area && size <= layout_of(fs->header)->inline_slot_size &&
+        (layout == LAYOUT_INLINE || (layout == LAYOUT_EMPTY && !has_delayed(node))))
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    if (layout == LAYOUT_INLINE) {
+        int res = promote(node);
+        if (res != 0) return res;
+    }
+    int placed = allocate_delayed(node);
+    if (placed != 0) return placed;
+
+    const uint64_t bs = fs->header.block_size;
+    ExtentMap* map = extents_of(node);
+    const vector<Extent>& list = map->list();
+    uint64_t from = list.empty() ? 0 : static_cast<uint64_t>(list.back().logical) + list.back().span();
+    uint64_t to = size / bs + (size % bs != 0);
+    const Extent old = map->reserved();
+    if (to <= from || (old.length && old.logical == from && old.logical + old.length >= to))
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+    if (to > UINT32_MAX) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
+    int64_t start = fs->fsm->allocate(to - from);
+    if (start < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    if (old.length) fs_free_blocks(fs, old.start, old.length);
+    map->reserve(Extent{static_cast<uint32_t>(from), static_cast<uint32_t>(start), static_cast<uint32_t>(to - from)});
+    return save_extents(node);
+}
+
+void block_store::claim(FSNode* node, FreeSpaceManager* blocks, FreeSpaceManager* slots) {
+    if (!node || !node->entry) return;
+    claim(node->entry, extents_of(node), blocks, slots, false);
+}
+
+void block_store::claim(const FileEntry* entry, FreeSpaceManager* blocks, FreeSpaceManager* slots,
+                        bool reservation) {
+    ExtentMap map;
+    load_extents(entry, map, nullptr);
+    claim(entry, &map, blocks, slots, reservation);
+}
+
+void block_store::claim(const FileEntry* entry, const ExtentMap* map, FreeSpaceManager* blocks,
+                        FreeSpaceManager* slots, bool reservation) {
+    ContentRef ref = content_ref(entry);
+    if (ref.layout == LAYOUT_INLINE) {
+        if (slots) slots->markUsed(ref.overflow_block);
+        return;
+    }
+    for (const Extent& e : map->list())
+        for (uint32_t k = 0; k < e.blocks(); ++k)
+            blocks->markUsed(e.start + k);
+    if (reservation)
+        for (uint32_t k = 0; k < map->reserved().length; ++k)
+            blocks->markUsed(map->reserved().start + k);
+    for (uint32_t b : overflow_chain(entry))
+        blocks->markUsed(b);
+}
@@ -0,0 +1,536 @@
+#include "change_log.h"
+#include "block_store.h"
+#include "snapshot_store.h"
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define NO_PARENT 0xFFFFFFFFu
+
+// ------------------ CRC-32 ------------------
+
+static uint32_t crc32(const char* data, size_t len) {
+    static uint32_t table[256];
+    static bool ready = false;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        ready = true;
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i)
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+static void put(std::vector<char>& out, const T& value) {
+    const char* raw = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), raw, raw + sizeof(T));
+}
+
+// ------------------ Setup ------------------
+
+change_log::change_log(FSInstance* fs_instance)
+    : fs(fs_instance), io(nullptr), head(0), cursor(0), wrap_at(SIZE_MAX), used(0),
+      snapshot_lost(false), stopping(false), requested(false) {
+    OMNILayout* layout = layout_of(fs->header);
+    epoch = layout->log_epoch;
+    next_lsn = layout->checkpoint_lsn + 1;
+    durable_lsn = layout->checkpoint_lsn;
+    tail = layout->log_tail < layout->log_size ? layout->log_tail : 0;
+    head = cursor = tail;
+    io = io_backend::open(fs->omni_path, O_RDWR);
+}
+
+change_log::~change_log() {
+    stop_checkpointer();
+    delete io;
+}
+
+bool change_log::is_open() const {
+    return io != nullptr;
+}
+
+uint64_t change_log::region_offset() const {
+    return fs->header.change_log_offset;
+}
+
+uint64_t change_log::region_size() const {
+    return layout_of(fs->header)->log_size;
+}
+
+bool change_log::pending() const {
+    return !batch.empty();
+}
+
+// ------------------ Appending ------------------
+
+void change_log::append(LogRecordType type, const std::vector<char>& payload) {
+    uint64_t size = region_size();
+    uint64_t record_size = sizeof(LogRecordHeader) + payload.size();
+
+    // Records never straddle the end of the region
+    uint64_t pad = (cursor + record_size > size) ? size - cursor : 0;
+    bool fits;
+    {
+        std::lock_guard<std::mutex> lock(space_mutex);
+        fits = used + pad + record_size < size;
+    }
+    if (!fits) {
+        // Log full: the change is already applied in memory, so a checkpoint
+        // covers it along with everything still in the batch.
+        if (checkpoint() != 0)
+            std::cerr << "Error: change log full and checkpoint failed\n";
+        return;
+    }
+
+    LogRecordHeader hdr;
+    hdr.magic = LOG_RECORD_MAGIC;
+    hdr.epoch = epoch;
+    hdr.reserved = 0;
+
+    if (pad > 0) {
+        if (pad >= sizeof(LogRecordHeader)) {
+            hdr.crc = crc32(nullptr, 0);
+            hdr.lsn = next_lsn++;
+            hdr.length = 0;
+            hdr.type = static_cast<uint16_t>(LogRecordType::WRAP);
+            put(batch, hdr);
+        }
+        wrap_at = batch.size();
+        cursor = 0;
+    }
+
+    hdr.crc = crc32(payload.data(), payload.size());
+    hdr.lsn = next_lsn++;
+    hdr.length = static_cast<uint32_t>(payload.size());
+    hdr.type = static_cast<uint16_t>(type);
+    put(batch, hdr);
+    batch.insert(batch.end(), payload.begin(), payload.end());
+    cursor += record_size;
+
+    bool half_full;
+    {
+        std::lock_guard<std::mutex> lock(space_mutex);
+        used += pad + record_size;
+        half_full = used * 100 >= size * CHECKPOINT_LOG_PERCENT;
+    }
+    if (batch.size() >= LOG_BATCH_BYTES) commit();
+    if (half_full) request_checkpoint();
+}
+
+void change_log::log_entry(FSNode* node) {
+    if (!node || !node->entry) return;
+
+    std::vector<char> payload;
+    put(payload, node->parent ? node->parent->entry->inode : NO_PARENT);
+    put(payload, *node->entry);
+
+    // Overflow extents go along with the entry; the chain blocks they were
+    // written to are not trusted during replay.
+    ContentRef ref = block_store::content_ref(node->entry);
+    std::vector<Extent> runs;
+    if (node->extents && ref.layout == LAYOUT_EXTENTS && ref.extent_count > INLINE_EXTENTS)
+        runs = node->extents->stored();
+    uint32_t count = static_cast<uint32_t>(runs.size());
+    put(payload, count);
+    if (count > 0) {
+        const char* raw = reinterpret_cast<const char*>(runs.data());
+        payload.insert(payload.end(), raw, raw + count * sizeof(Extent));
+    }
+
+    // Inline content is only written back at checkpoints, so it is logged
+    // in full
+    if (ref.layout == LAYOUT_INLINE && fs->inline_area) {
+        uint64_t slot_size = layout_of(fs->header)->inline_slot_size;
+        const uint8_t* data = fs->inline_area + ref.overflow_block * slot_size;
+        payload.insert(payload.end(), data, data + std::min<uint64_t>(node->entry->size, slot_size));
+    }
+    append(LogRecordType::ENTRY_PUT, payload);
+}
+
+void change_log::log_remove(FSNode* node) {
+    if (!node || !node->entry) return;
+    std::vector<char> payload;
+    put(payload, node->entry->inode);
+    append(LogRecordType::ENTRY_REMOVE, payload);
+}
+
+void change_log::log_user(const UserInfo* user) {
+    if (!user) return;
+    std::vector<char> payload;
+    put(payload, static_cast<uint32_t>(user - fs->user_slots));
+    put(payload, *user);
+    append(LogRecordType::USER_PUT, payload);
+}
+
+// ------------------ Commit / checkpoint ------------------
+
+void change_log::hold_free(uint64_t start, uint64_t count) {
+    held_frees.push_back({start, count});
+}
+
+void change_log::hold_inline_free(uint32_t slot) {
+    held_slots.push_back(slot);
+}
+
+void change_log::release_held() {
+    for (auto& run : held_frees)
+        fs->fsm->free(run.first, run.second);
+    held_frees.clear();
+    for (uint32_t slot : held_slots)
+        fs->inline_slots->markFree(slot);
+    held_slots.clear();
+}
+
+int change_log::commit() {
+    // Delayed blocks get their place now; the records for it join the
+    // batch. A file that cannot be placed keeps its data in memory for the
+    // next commit, and the records of everything else still go out.
+    if (fs->store->allocate_delayed() != 0)
+        std::cerr << "Error: delayed blocks could not be placed, retrying at the next commit\n";
+    if (!batch.empty()) {
+        if (!fs->store->flush())
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        // Both segments (before and after a wrap) and the sync in one submission
+        size_t first = std::min(wrap_at, batch.size());
+        std::vector<IoRequest> requests{IoRequest::write(batch.data(), first, region_offset() + head)};
+        if (first < batch.size())
+            requests.push_back(IoRequest::write(batch.data() + first, batch.size() - first, region_offset()));
+        requests.push_back(IoRequest::sync());
+        if (!io->submit(requests))
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        head = cursor;
+        wrap_at = SIZE_MAX;
+        batch.clear();
+    }
+    // Freed blocks become reusable only once the free itself is durable
+    release_held();
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+int change_log::checkpoint(bool background) {
+    std::unique_lock<std::mutex> state(fs->state_mutex, std::defer_lock);
+    if (background) state.lock();
+    // Placing delayed blocks appends records, which can start a checkpoint
+    // of its own when the log is full: do it before taking checkpoint_mutex
+    fs->store->allocate_delayed();
+    std::lock_guard<std::mutex> one(checkpoint_mutex);
+
+    uint64_t covered;
+    {
+        std::lock_guard<std::mutex> lock(space_mutex);
+        covered = used;
+    }
+    if (background && covered == 0 && batch.empty() && !snapshot_lost)
+        return static_cast<int>(OFSErrorCodes::SUCCESS);
+
+    // Everything in memory is logged and durable from here on
+    int res = commit();
+    if (res != 0) return res;
+
+    if (snapshot_lost) fs_mark_all_dirty(fs);
+    FlushImage image;
+    int snap = fs_snapshot(fs, image);
+    uint64_t new_tail = cursor;
+    uint64_t new_lsn = next_lsn - 1;
+    if (background) state.unlock();
+
+    // The tail only moves if the snapshot is complete
+    OMNILayout* layout = layout_of(image.header);
+    layout->log_epoch = epoch;
+    layout->checkpoint_lsn = snap == 0 ? new_lsn : durable_lsn;
+    {
+        std::lock_guard<std::mutex> lock(space_mutex);
+        layout->log_tail = snap == 0 ? new_tail : tail;
+    }
+
+    res = fs_write_image(fs, image);
+    snapshot_lost = res != 0;
+    if (res != 0) return res;
+    if (snap != 0) return snap;
+
+    std::lock_guard<std::mutex> lock(space_mutex);
+    durable_lsn = new_lsn;
+    tail = new_tail;
+    used -= covered;
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// ------------------ Checkpointer thread ------------------
+
+void change_log::start_checkpointer() {
+    if (checkpointer.joinable()) return;
+    stopping = false;
+    checkpointer = std::thread(&change_log::checkpointer_loop, this);
+}
+
+void change_log::stop_checkpointer() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (checkpointer.joinable()) checkpointer.join();
+}
+
+void change_log::request_checkpoint() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        if (requested) return;
+        requested = true;
+    }
+    wake.notify_one();
+}
+
+void change_log::checkpointer_loop() {
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (!stopping) {
+        wake.wait_for(lock, std::chrono::seconds(fs->checkpoint_interval),
+                      [this] { return stopping || requested; });
+        if (stopping) break;
+        requested = false;
+
+        lock.unlock();
+        if (checkpoint(true) != 0) {
+            std::cerr << "Error: background checkpoint failed" << std::endl;
+        } else {
+            // Clean entries now match the container, so cold ones can go
+            std::lock_guard<std::mutex> state(fs->state_mutex);
+            if (!snapshot_lost) fs_evict_cold(fs);
+        }
+        lock.lock();
+    }
+}
+
+// ------------------ Recovery ------------------
+
+// Nodes by inode, starting from the loaded tree. In lazy mode an inode
+// that is not loaded is looked up in the stored index and the directories
+// on its path are loaded: replay reads only what the records touch.
+class InodeIndex {
+private:
+    FSInstance* fs;
+    std::unordered_map<uint32_t, FSNode*> nodes;
+    std::unordered_map<uint32_t, uint32_t> slots;     // inode -> stored slot, read on the first miss
+    bool indexed;
+    bool scanned;
+
+public:
+    explicit InodeIndex(FSInstance* fs_instance) : fs(fs_instance), indexed(false), scanned(false) {}
+
+    FSNode* find(uint32_t inode) {
+        if (!indexed) {
+            fs_walk(fs, [this](FSNode* node) { nodes.emplace(node->entry->inode, node); }, nullptr);
+            indexed = true;
+        }
+        auto found = nodes.find(inode);
+        if (found != nodes.end()) return found->second;
+        if (!fs->loader) return nullptr;
+
+        if (!scanned) {
+            fs_walk(fs, nullptr, [this](uint32_t index, const MetaSlot& slot) { slots.emplace(slot.entry.inode, index); });
+            scanned = true;
+        }
+        auto slot = slots.find(inode);
+        FSNode* node = slot != slots.end() ? fs_load_slot(fs, slot->second) : nullptr;
+        if (!node || node->entry->inode != inode) return nullptr;
+        nodes[inode] = node;
+        return node;
+    }
+
+    void put(FSNode* node) { nodes[node->entry->inode] = node; }
+    void erase(uint32_t inode) {
+        nodes.erase(inode);
+        slots.erase(inode);
+    }
+};
+
+static void apply_entry(FSInstance* fs, InodeIndex& index, std::set<FSNode*>& rechain,
+                        const char* p, uint32_t len) {
+    if (len < sizeof(uint32_t) + sizeof(FileEntry) + sizeof(uint32_t)) return;
+    uint32_t parent_inode, count;
+    FileEntry entry;
+    std::memcpy(&parent_inode, p, sizeof(uint32_t));
+    std::memcpy(&entry, p + sizeof(uint32_t), sizeof(FileEntry));
+    std::memcpy(&count, p + sizeof(uint32_t) + sizeof(FileEntry), sizeof(uint32_t));
+    const char* extents = p + 2 * sizeof(uint32_t) + sizeof(FileEntry);
+    uint64_t fixed = 2 * sizeof(uint32_t) + sizeof(FileEntry) + static_cast<uint64_t>(count) * sizeof(Extent);
+    if (len < fixed) return;
+
+    FSNode* node = index.find(entry.inode);
+    FSNode* parent = nullptr;
+    if (parent_inode != NO_PARENT) {
+        parent = index.find(parent_inode);
+        if (!parent) return;
+    }
+
+    if (!node) {
+        if (!parent) return;
+        node = new FSNode(new FileEntry(entry), parent);
+        parent->addChild(node);
+        index.put(node);
+    } else if (node->parent != parent || std::strcmp(node->entry->name, entry.name) != 0) {
+        // Renamed or moved
+        if (!parent || !node->parent) return;
+        node->parent->detachChild(node->entry->name);
+        *node->entry = entry;
+        node->parent = parent;
+        parent->addChild(node);
+    } else {
+        *node->entry = entry;
+    }
+
+    delete node->extents;
+    node->extents = nullptr;
+    rechain.erase(node);
+    if (count > 0) {
+        std::vector<Extent> runs(count);
+        std::memcpy(runs.data(), extents, count * sizeof(Extent));
+        ContentRef ref = block_store::content_ref(node->entry);
+        node->extents = new ExtentMap();
+        node->extents->restore(runs, (ref.flags & CONTENT_RESERVED) != 0);
+        ref.overflow_block = 0;
+        block_store::set_content_ref(node->entry, ref);
+        rechain.insert(node);
+    }
+
+    ContentRef ref = block_store::content_ref(node->entry);
+    OMNILayout* layout = layout_of(fs->header);
+    if (ref.layout == LAYOUT_INLINE && fs->inline_area && ref.overflow_block < layout->max_files) {
+        uint8_t* slot = fs->inline_area + static_cast<uint64_t>(ref.overflow_block) * layout->inline_slot_size;
+        uint64_t bytes = std::min<uint64_t>(len - fixed, layout->inline_slot_size);
+        std::memset(slot, 0, layout->inline_slot_size);
+        std::memcpy(slot, extents + count * sizeof(Extent), bytes);
+        fs_mark_inline_dirty(fs, ref.overflow_block);
+    }
+    if (fs->next_file_index <= entry.inode)
+        fs->next_file_index = entry.inode + 1;
+}
+
+// Entries below a directory that is not loaded were never indexed
+static void forget(FSNode* node, InodeIndex& index, std::set<FSNode*>& rechain) {
+    if (node->children && node->childrenLoaded())
+        for (auto* it = node->children->getHead(); it; it = it->next)
+            forget(it->data, index, rechain);
+    index.erase(node->entry->inode);
+    rechain.erase(node);
+}
+
+static void apply_remove(InodeIndex& index, std::set<FSNode*>& rechain, const char* p, uint32_t len) {
+    if (len < sizeof(uint32_t)) return;
+    uint32_t inode;
+    std::memcpy(&inode, p, sizeof(uint32_t));
+    FSNode* node = index.find(inode);
+    if (!node || !node->parent) return;
+
+    forget(node, index, rechain);
+    node->parent->removeChild(node->entry->name);
+}
+
+static void apply_user(FSInstance* fs, const char* p, uint32_t len) {
+    if (len < sizeof(uint32_t) + sizeof(UserInfo)) return;
+    uint32_t slot;
+    std::memcpy(&slot, p, sizeof(uint32_t));
+    if (slot >= fs->header.max_users) return;
+
+    UserInfo* user = &fs->user_slots[slot];
+    if (user->is_active) fs->users->remove(user->username);
+    std::memcpy(user, p + sizeof(uint32_t), sizeof(UserInfo));
+    if (user->is_active) fs->users->insert(user->username, user);
+    fs_mark_user_dirty(fs, user);
+}
+
+static void claim_tree(FSInstance* fs) {
+    fs_walk(fs,
+            [fs](FSNode* node) {
+                if (node->entry->getType() == EntryType::FILE) fs->store->claim(node);
+            },
+            [fs](uint32_t, const MetaSlot& slot) {
+                if (slot.entry.getType() == EntryType::FILE)
+                    fs->store->claim(&slot.entry, fs->fsm, fs->inline_slots, true);
+            });
+}
+
+int change_log::recover() {
+    OMNILayout* layout = layout_of(fs->header);
+    std::vector<char> region(region_size(), 0);
+    // A fresh container may end before the region does: short reads are fine
+    std::vector<IoRequest> scan{IoRequest::read(region.data(), region.size(), region_offset())};
+    io->submit(scan);
+    if (scan[0].result < 0)
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    InodeIndex index(fs);
+    std::set<FSNode*> rechain;
+
+    uint64_t size = region.size();
+    uint64_t pos = tail;
+    uint64_t replayed = 0;
+    while (true) {
+        if (pos + sizeof(LogRecordHeader) > size) {     // too short for a record: wrapped
+            used += size - pos;
+            pos = 0;
+        }
+        LogRecordHeader hdr;
+        std::memcpy(&hdr, region.data() + pos, sizeof(hdr));
+        if (hdr.magic != LOG_RECORD_MAGIC || hdr.epoch != epoch || hdr.lsn != next_lsn) break;
+        if (pos + sizeof(hdr) + hdr.length > size) break;
+        const char* payload = region.data() + pos + sizeof(hdr);
+        if (crc32(payload, hdr.length) != hdr.crc) break;
+
+        switch (static_cast<LogRecordType>(hdr.type)) {
+            case LogRecordType::ENTRY_PUT:    apply_entry(fs, index, rechain, payload, hdr.length); break;
+            case LogRecordType::ENTRY_REMOVE: apply_remove(index, rechain, payload, hdr.length); break;
+            case LogRecordType::USER_PUT:     apply_user(fs, payload, hdr.length); break;
+            case LogRecordType::WRAP:         break;
+        }
+        ++next_lsn;
+        ++replayed;
+        if (static_cast<LogRecordType>(hdr.type) == LogRecordType::WRAP) {
+            used += size - pos;
+            pos = 0;
+        } else {
+            used += sizeof(hdr) + hdr.length;
+            pos += sizeof(hdr) + hdr.length;
+        }
+    }
+    head = cursor = pos;
+
+    // Records from this run get a new epoch, so whatever a crash left
+    // behind the last valid record can never be mistaken for them
+    ++epoch;
+
+    if (replayed == 0) return checkpoint();
+
+    // The on-disk bitmap may be ahead of or behind the replayed tree;
+    // rebuild it from what the files actually reference.
+    uint64_t total_blocks = fs->header.total_size / fs->header.block_size;
+    uint64_t reserved = (region_offset() + layout->log_size + fs->header.block_size - 1) / fs->header.block_size;
+    for (uint64_t i = 0; i < total_blocks; ++i) {
+        if (i < reserved) fs->fsm->markUsed(i);
+        else fs->fsm->markFree(i);
+    }
+    if (fs->inline_slots)
+        for (uint32_t i = 0; i < layout->max_files; ++i)
+            fs->inline_slots->markFree(i);
+    claim_tree(fs);
+    if (fs->snapshots) fs->snapshots->claim();
+    fs->store->rebuild_refs();
+    for (FSNode* node : rechain)
+        fs->store->save_extents(node);
+
+    fs_mark_tree_dirty(fs);
+    std::cout << "[RECOVERY] Replayed " << replayed << " change log records" << std::endl;
+    return checkpoint();
+}
@@ -0,0 +1,144 @@
+#include "config.h"
+#include "odf_types.hpp"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <unordered_map>
+#include <cstdio>
+#include <openssl/sha.h>
+
+// ------------------ Parsing ------------------
+
+static std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) return "";
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+// Value part of a line: up to the closing quote of a quoted string,
+// otherwise up to a '#' comment
+static std::string value_of(const std::string& rest) {
+    std::string v = trim(rest);
+    if (!v.empty() && v[0] == '"') {
+        size_t end = v.find('"', 1);
+        return v.substr(1, end == std::string::npos ? std::string::npos : end - 1);
+    }
+    return trim(v.substr(0, v.find('#')));
+}
+
+static bool parse_number(const std::string& text, uint64_t& out) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    try {
+        out = std::stoull(text);
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_bool(const std::string& text, bool& out) {
+    if (text == "1" || text == "true" || text == "yes") out = true;
+    else if (text == "0" || text == "false" || text == "no") out = false;
+    else return false;
+    return true;
+}
+
+static std::string hex_sha256(const std::string& data) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash);
+    char buf[CONFIG_HASH_LEN + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+        std::snprintf(buf + i * 2, 3, "%02x", hash[i]);
+    return std::string(buf, CONFIG_HASH_LEN);
+}
+
+// ------------------ Loading ------------------
+
+int config_load(const char* path, OFSConfig* config) {
+    std::ifstream in(path ? path : "", std::ios::binary);
+    if (!in.is_open()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    std::stringstream raw;
+    raw << in.rdbuf();
+    std::string text = raw.str();
+    config->hash = hex_sha256(text);
+
+    OFSConfig& c = *config;
+    auto number = [](uint64_t& field, uint64_t lo, uint64_t hi) {
+        return [&field, lo, hi](const std::string& v) {
+            uint64_t n;
+            if (!parse_number(v, n) || n < lo || n > hi) return false;
+            field = n;
+            return true;
+        };
+    };
+    auto number32 = [](uint32_t& field, uint64_t lo, uint64_t hi) {
+        return [&field, lo, hi](const std::string& v) {
+            uint64_t n;
+            if (!parse_number(v, n) || n < lo || n > hi) return false;
+            field = static_cast<uint32_t>(n);
+            return true;
+        };
+    };
+    auto flag = [](bool& field) {
+        return [&field](const std::string& v) { return parse_bool(v, field); };
+    };
+    auto name = [](std::string& field, size_t max_len) {
+        return [&field, max_len](const std::string& v) {
+            if (v.empty() || v.size() > max_len) return false;
+            field = v;
+            return true;
+        };
+    };
+
+    const std::unordered_map<std::string, std::function<bool(const std::string&)>> keys = {
+        {"total_size",          number(c.total_size, 1, UINT64_MAX)},
+        {"max_size",            number(c.max_size, 0, UINT64_MAX)},
+        {"preallocate",         flag(c.preallocate)},
+        {"block_size",          number(c.block_size, 512, 1 << 20)},
+        {"max_files",           number32(c.max_files, 1, 1 << 24)},
+        {"cache_size",          number(c.cache_size, 0, UINT64_MAX)},
+        {"prefetch_workers",    number32(c.prefetch_workers, 0, 64)},
+        {"checkpoint_interval", number32(c.checkpoint_interval, 1, 86400)},
+        {"direct_io",           flag(c.direct_io)},
+        {"dedup",               flag(c.dedup)},
+        {"compression",         flag(c.compression)},
+        {"defrag",              flag(c.defrag)},
+        {"delayed_alloc",       flag(c.delayed_alloc)},
+        {"lazy_load",           flag(c.lazy_load)},
+        {"max_loaded_entries",  number(c.max_loaded_entries, 0, UINT64_MAX)},
+        {"max_users",           number32(c.max_users, 1, 65536)},
+        {"admin_username",      name(c.admin_username, sizeof(UserInfo::username) - 1)},
+        {"admin_password",      name(c.admin_password, 256)},
+        {"port",                number32(c.port, 1, 65535)},
+        {"max_connections",     number32(c.max_connections, 1, 65536)},
+        {"queue_timeout",       number32(c.queue_timeout, 0, 86400)},
+        {"buffer_size",         number32(c.buffer_size, 1024, 16 << 20)},
+    };
+
+    std::istringstream lines(text);
+    std::string line;
+    uint32_t line_no = 0;
+    while (std::getline(lines, line)) {
+        ++line_no;
+        std::string t = trim(line);
+        if (t.empty() || t[0] == '#' || t[0] == '[') continue;
+        size_t eq = t.find('=');
+        if (eq == std::string::npos) continue;
+        auto key = keys.find(trim(t.substr(0, eq)));
+        if (key == keys.end()) continue;
+        if (!key->second(value_of(t.substr(eq + 1)))) {
+            std::cerr << "Error: " << path << ":" << line_no << ": invalid value for " << key->first << "\n";
+            return static_cast<int>(OFSErrorCodes::ERROR_INVALID_CONFIG);
+        }
+    }
+
+    // Content blocks are addressed as i * block_size and O_DIRECT needs
+    // sector-aligned blocks
+    if ((c.block_size & (c.block_size - 1)) != 0) {
+        std::cerr << "Error: " << path << ": block_size must be a power of two\n";
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_CONFIG);
+    }
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
@@ -0,0 +1,80 @@
+#include "defragmenter.h"
+#include "block_store.h"
+#include "change_log.h"
+#include <chrono>
+#include <iostream>
+
+defragmenter::defragmenter(FSInstance* fs_instance) : fs(fs_instance), stopping(false) {}
+
+defragmenter::~defragmenter() {
+    stop();
+}
+
+void defragmenter::start() {
+    if (worker.joinable()) return;
+    stopping = false;
+    worker = std::thread(&defragmenter::worker_loop, this);
+}
+
+void defragmenter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+// File under node split into the most pieces, skipping stuck ones
+FSNode* defragmenter::pick(FSNode* node, uint32_t& most) {
+    FSNode* best = nullptr;
+    if (node->entry->getType() == EntryType::FILE && !stuck.count(node->entry->inode)) {
+        uint32_t pieces = fs->store->fragments(node);
+        if (pieces > 1 && pieces > most) {
+            most = pieces;
+            best = node;
+        }
+    }
+    if (!node->childrenLoaded()) return best;     // cold directories stay on disk
+    for (FSNode* child : node->getChildren()) {
+        FSNode* found = pick(child, most);
+        if (found) best = found;
+    }
+    return best;
+}
+
+// One merge. False when there is nothing left to do.
+bool defragmenter::step() {
+    std::unique_lock<std::mutex> state(fs->state_mutex, std::try_to_lock);
+    if (!state.owns_lock()) return true;    // busy serving, try again after the pause
+
+    uint32_t most = 0;
+    FSNode* node = fs->root ? pick(fs->root, most) : nullptr;
+    if (!node) return false;
+
+    bool moved = false;
+    int res = fs->store->defragment(node, &moved);
+    if (res != 0)
+        std::cerr << "Error: defragmenting inode " << node->entry->inode << " failed" << std::endl;
+    if (!moved) {
+        stuck.insert(node->entry->inode);
+        return true;
+    }
+    fs_log_entry(fs, node);
+    if (fs->log && fs->log->commit() != 0)
+        std::cerr << "Error: change log commit failed" << std::endl;
+    return true;
+}
+
+void defragmenter::worker_loop() {
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (!stopping) {
+        lock.unlock();
+        bool busy = step();
+        lock.lock();
+        if (!busy) stuck.clear();
+        auto pause = busy ? std::chrono::milliseconds(DEFRAG_PAUSE_MS)
+                          : std::chrono::milliseconds(DEFRAG_IDLE_SEC * 1000);
+        wake.wait_for(lock, pause, [this] { return stopping; });
+    }
+}
@@ -1,8 +1,9 @@
 #include "dir_manager.h"
 #include <iostream>
+#include <ctime>
 
-dir_manager::dir_manager(FSNode* root_node, user_manager* user_mgr)
-    : root(root_node), um(user_mgr) {}
+dir_manager::dir_manager(FSInstance* fs_instance, user_manager* user_mgr)
+    : fs(fs_instance), root(fs_instance->root), um(user_mgr) {}
 
 FSNode* dir_manager::resolve_path(const string& path) {
     if (path.empty() || path[0] != '/') return nullptr;
@@ -96,9 +97,16 @@ int dir_manager::dir_create(void* session, const char* path) {
     um->get_session_info(session, &info);
 
     FileEntry* entry = new FileEntry(dirname, EntryType::DIRECTORY, 0, 0755,
-                                     info.user.username, 0);
+                                     info.user.username, fs->next_file_index++);
+    entry->created_time = entry->modified_time = std::time(nullptr);
     FSNode* new_node = new FSNode(entry, parent);
     parent->addChild(new_node);
+    int linked = fs_link_node(fs, new_node);
+    if (linked != 0) {
+        parent->removeChild(dirname);
+        return linked;
+    }
+    fs_log_entry(fs, new_node);
 
     cout << "[DEBUG] Directory created: " << path << endl;
     return static_cast<int>(OFSErrorCodes::SUCCESS);
@@ -165,6 +173,8 @@ int dir_manager::dir_delete(void* session, const char* path) {
     if (!node->getChildren().empty())
         return static_cast<int>(OFSErrorCodes::ERROR_DIRECTORY_NOT_EMPTY);
 
+    fs_log_remove(fs, node);
+    fs_unlink_node(fs, node, true);
     parent->removeChild(node->entry->name);
 
     cout << "[DEBUG] Directory deleted: " << path << endl;
@@ -1,5 +1,7 @@
 #include "file_manager.h"
+#include "block_store.h"
 #include <cstring>
+#include <ctime>
 #include <iostream>
 
 using namespace std;
@@ -54,7 +56,7 @@ bool file_manager::check_permissions(void* session, FSNode* node) {
 
 // ------------------ File Operations ------------------
 
-int file_manager::file_create(void* session, const char* path, const char* data, size_t size) {
+int file_manager::file_create(void* session, const char* path, const char* data, size_t size, uint64_t size_hint) {
     if (!session || !path) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
     
     SessionInfo info;
@@ -82,20 +84,37 @@ int file_manager::file_create(void* session, const char* path, const char* data,
     if (parent->getChild(filename)) 
         return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
     
-    // Get uid from username (or use a default if not available)
-    uint32_t uid = 0;  // You may need to look up uid from username
-    
     FileEntry* entry = new FileEntry(filename, EntryType::FILE, 
-                                     uid,
+                                     0,
                                      0644,
                                      info.user.username, 
                                      fs_instance->next_file_index++);
     
+    entry->created_time = entry->modified_time = std::time(nullptr);
+
     FSNode* new_node = new FSNode(entry, parent);
     parent->addChild(new_node);
+    int linked = fs_link_node(fs_instance, new_node);
+    if (linked != 0) {
+        parent->removeChild(filename);
+        return linked;
+    }
+
+    // The hint is advisory: without a long enough free run the upload is
+    // allocated as it arrives
+    if (size_hint > size)
+        fs_instance->store->reserve(new_node, size_hint);
     
-    if (data && size > 0)
-        new_node->data.assign(data, data + size);
+    if (data && size > 0) {
+        int res = fs_instance->store->write(new_node, data, size, 0);
+        if (res != 0) {
+            fs_instance->store->release(new_node);
+            fs_unlink_node(fs_instance, new_node, true);
+            parent->removeChild(filename);
+            return res;
+        }
+    }
+    fs_log_entry(fs_instance, new_node);
     
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
@@ -105,26 +124,49 @@ int file_manager::file_read(void* session, const char* path, char** buffer, size
     if (!node || node->entry->getType() != EntryType::FILE) 
         return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
 
-    *size = node->data.size();
+    *size = node->entry->size;
     *buffer = new char[*size];
-    memcpy(*buffer, node->data.data(), *size);
+    int res = fs_instance->store->read(node, *buffer, 0, *size);
+    if (res != 0) {
+        delete[] *buffer;
+        *buffer = nullptr;
+        *size = 0;
+    }
+    return res;
+}
 
-    return static_cast<int>(OFSErrorCodes::SUCCESS);
+int file_manager::file_read_at(void* session, const char* path, uint64_t offset, char* buffer, size_t len, size_t* read) {
+    FSNode* node = resolve_path(path);
+    if (!node || node->entry->getType() != EntryType::FILE) 
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    if (offset > node->entry->size)
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    *read = std::min<uint64_t>(len, node->entry->size - offset);
+    int res = fs_instance->store->read(node, buffer, offset, *read);
+    if (res != 0) *read = 0;
+    return res;
 }
 
-int file_manager::file_edit(void* session, const char* path, const char* data, size_t size, uint index) {
+int file_manager::file_edit(void* session, const char* path, const char* data, size_t size, uint64_t index) {
     FSNode* node = resolve_path(path);
     if (!node || !check_permissions(session, node)) 
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
 
-    if (index > node->data.size()) 
+    if (node->entry->getType() != EntryType::FILE)
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
 
-    if (index + size > node->data.size())
-        node->data.resize(index + size);
+    if (!fs_instance->store->in_range(index, size))
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
 
-    memcpy(node->data.data() + index, data, size);
-    return static_cast<int>(OFSErrorCodes::SUCCESS);
+    // An index past the end makes the file sparse
+    int res = fs_instance->store->write(node, data, size, index);
+    if (res == 0) {
+        node->entry->modified_time = std::time(nullptr);
+        fs_mark_node_dirty(fs_instance, node);
+        fs_log_entry(fs_instance, node);
+    }
+    return res;
 }
 
 int file_manager::file_delete(void* session, const char* path) {
@@ -135,6 +177,11 @@ int file_manager::file_delete(void* session, const char* path) {
     FSNode* parent = node->parent;
     if (!parent) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
 
+    if (node->entry->getType() == EntryType::FILE)
+        fs_instance->store->release(node);
+
+    fs_log_remove(fs_instance, node);
+    fs_unlink_node(fs_instance, node, true);
     // removeChild deletes the node internally
     parent->removeChild(std::string(node->entry->name));
 
@@ -148,10 +195,32 @@ int file_manager::file_truncate(void* session, const char* path) {
     if (!node || !check_permissions(session, node)) 
         return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
 
-    node->data.clear();
+    if (node->entry->getType() != EntryType::FILE)
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    fs_instance->store->release(node);
+    node->entry->modified_time = std::time(nullptr);
+    fs_mark_node_dirty(fs_instance, node);
+    fs_log_entry(fs_instance, node);
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
+int file_manager::file_fallocate(void* session, const char* path, uint64_t size) {
+    FSNode* node = resolve_path(path);
+    if (!node || !check_permissions(session, node)) 
+        return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
+
+    if (node->entry->getType() != EntryType::FILE)
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    int res = fs_instance->store->reserve(node, size);
+    if (res == 0) {
+        fs_mark_node_dirty(fs_instance, node);
+        fs_log_entry(fs_instance, node);
+    }
+    return res;
+}
+
 int file_manager::file_exists(void* session, const char* path) {
     FSNode* node = resolve_path(path);
     return node ? static_cast<int>(OFSErrorCodes::SUCCESS) : static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
@@ -177,6 +246,7 @@ int file_manager::file_rename(void* session, const char* old_path, const char* n
     FSNode* old_parent = node->parent;
     
     // Detach from old parent BEFORE changing name
+    fs_unlink_node(fs_instance, node, false);
     old_parent->detachChild(node->entry->name);
     
     // Update the name
@@ -186,6 +256,8 @@ int file_manager::file_rename(void* session, const char* old_path, const char* n
     // Attach to new parent with new name
     node->parent = new_parent;
     new_parent->addChild(node);
+    fs_link_node(fs_instance, node);
+    fs_log_entry(fs_instance, node);
 
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
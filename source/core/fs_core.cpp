@@ -4,60 +4,225 @@
 #include <ctime>
 #include <iostream>
 #include "core/user_manager.h"
+#include "block_store.h"
+#include "change_log.h"
+#include "snapshot_store.h"
+#include "defragmenter.h"
+#include "io_backend.h"
 #include <cstring>
 #include <vector>
 #include <openssl/sha.h>
 #include <cstdio>  // for sprintf
+#include <algorithm>
+#include <unordered_map>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
-int serialize_fs_tree(FSNode* node, std::ofstream& ofs) {
-    if (!node || !node->entry) return 0;
+static uint64_t meta_slot_offset(const OMNILayout* layout, uint32_t index) {
+    return layout->meta_offset + static_cast<uint64_t>(index - 1) * sizeof(MetaSlot);
+}
 
-    
-    ofs.write(reinterpret_cast<const char*>(node->entry), sizeof(FileEntry));
+// Tree of the metadata index area, parsed from memory. Each directory's
+// children come in list order. An image cut short by a crash can leave
+// lists that disagree with the entries' parent fields; the parent field
+// wins, and entries no list reached are appended to their parent. Replaying
+// the change log then fixes whatever changed since the checkpoint.
+static FSNode* load_meta_index(const char* area, uint64_t size, uint64_t* loaded) {
+    const MetaSlot* slots = reinterpret_cast<const MetaSlot*>(area);
+    uint32_t count = static_cast<uint32_t>(size / sizeof(MetaSlot));
+    if (count < META_ROOT_INDEX || !(slots[META_ROOT_INDEX - 1].flags & META_SLOT_USED)) return nullptr;
 
+    std::vector<FSNode*> nodes(count + 1, nullptr);
+    for (uint32_t i = 1; i <= count; ++i) {
+        if (!(slots[i - 1].flags & META_SLOT_USED)) continue;
+        nodes[i] = new FSNode(new FileEntry(slots[i - 1].entry));
+        nodes[i]->meta_index = i;
+    }
 
-    uint32_t count = 0;
-    if (node->entry->getType() == EntryType::DIRECTORY && node->children) {
-        auto child_node = node->children->getHead();
-        while (child_node) {
-            ++count;
-            child_node = child_node->next;
+    std::vector<uint8_t> attached(count + 1, 0);
+    auto is_dir = [&](uint32_t i) { return nodes[i]->entry->getType() == EntryType::DIRECTORY; };
+    auto attach = [&](uint32_t i, uint32_t parent) {
+        nodes[parent]->addChild(nodes[i]);
+        attached[i] = 1;
+        ++*loaded;
+    };
+    std::vector<uint32_t> dirs{META_ROOT_INDEX};
+    attached[META_ROOT_INDEX] = 1;
+    *loaded = 1;
+    while (!dirs.empty()) {
+        uint32_t dir = dirs.back();
+        dirs.pop_back();
+        for (uint32_t i = slots[dir - 1].first_child;
+             i != 0 && i <= count && nodes[i] && !attached[i] && slots[i - 1].parent == dir;
+             i = slots[i - 1].next_sibling) {
+            attach(i, dir);
+            if (is_dir(i)) dirs.push_back(i);
         }
     }
-    ofs.write(reinterpret_cast<const char*>(&count), sizeof(uint32_t));
+    for (bool adopted = true; adopted;) {
+        adopted = false;
+        for (uint32_t i = 1; i <= count; ++i) {
+            uint32_t parent = nodes[i] ? slots[i - 1].parent : 0;
+            if (attached[i] || parent == 0 || parent > count || !attached[parent] || !is_dir(parent)) continue;
+            attach(i, parent);
+            adopted = true;
+        }
+    }
+    for (uint32_t i = 1; i <= count; ++i)
+        if (nodes[i] && !attached[i]) delete nodes[i];
+    return nodes[META_ROOT_INDEX];
+}
+
+// Slots read at once by whole-index scans
+static const uint32_t SCAN_CHUNK = 1024;
+
+// Lazy mode: reads a directory's children when it is first used, one slot
+// per read or straight from the mapping. The entries' parent fields are
+// checked as in load_meta_index, but a list that leaves the directory
+// simply ends there.
+class meta_loader : public FSNodeLoader {
+private:
+    FSInstance* fs;
+    io_backend* io;
+
+public:
+    explicit meta_loader(FSInstance* fs_instance) : fs(fs_instance), io(nullptr) {
+        if (!fs->map_base) io = io_backend::open(fs->omni_path, O_RDONLY);
+    }
+    ~meta_loader() override { delete io; }
 
+    bool is_open() const { return fs->map_base || io; }
 
-    if (count > 0) {
-        auto child_node = node->children->getHead();
-        while (child_node) {
-            serialize_fs_tree(child_node->data, ofs);
-            child_node = child_node->next;
+    bool read_slots(uint32_t first, uint32_t n, MetaSlot* out) {
+        OMNILayout* layout = layout_of(fs->header);
+        if (first == 0 || first + n - 1 > layout->meta_size / sizeof(MetaSlot)) return false;
+        uint64_t offset = meta_slot_offset(layout, first);
+        if (fs->map_base) {
+            std::memcpy(out, fs->map_base + offset, n * sizeof(MetaSlot));
+            return true;
         }
+        return io->read(out, n * sizeof(MetaSlot), offset);
     }
 
-    return 0;
-}
+    FSNode* load_root() {
+        MetaSlot slot;
+        if (!read_slots(META_ROOT_INDEX, 1, &slot) || !(slot.flags & META_SLOT_USED)) return nullptr;
+        FSNode* root = new FSNode(new FileEntry(slot.entry));
+        root->meta_index = META_ROOT_INDEX;
+        root->loader = this;
+        fs->loaded_entries = 1;
+        return root;
+    }
 
+    void loadChildren(FSNode* dir) override {
+        MetaSlot slot;
+        if (!read_slots(dir->meta_index, 1, &slot)) return;
+        uint32_t limit = static_cast<uint32_t>(layout_of(fs->header)->meta_size / sizeof(MetaSlot));
+        for (uint32_t i = slot.first_child, n = 0; i != 0 && n < limit; i = slot.next_sibling, ++n) {
+            if (!read_slots(i, 1, &slot) || !(slot.flags & META_SLOT_USED) || slot.parent != dir->meta_index) break;
+            FSNode* child = new FSNode(new FileEntry(slot.entry));
+            child->meta_index = i;
+            if (child->children) child->loader = this;
+            dir->addChild(child);
+            ++fs->loaded_entries;
+        }
+    }
 
-FSNode* load_fs_tree(std::ifstream& ifs, uint64_t& offset, uint64_t end_offset) {
-    if (offset + sizeof(FileEntry) > end_offset) return nullptr;
+    // Every used slot, a chunk at a time
+    void scan(const SlotVisitor& visit) {
+        uint32_t count = static_cast<uint32_t>(layout_of(fs->header)->meta_size / sizeof(MetaSlot));
+        std::vector<MetaSlot> slots(SCAN_CHUNK);
+        for (uint32_t first = 1; first <= count; first += SCAN_CHUNK) {
+            uint32_t n = std::min(SCAN_CHUNK, count - first + 1);
+            if (!read_slots(first, n, slots.data())) return;
+            for (uint32_t k = 0; k < n; ++k)
+                if (slots[k].flags & META_SLOT_USED) visit(first + k, slots[k]);
+        }
+    }
+
+    // Slot allocators from the index itself, since the tree is not in
+    // memory to walk
+    void claim() {
+        scan([this](uint32_t index, const MetaSlot& slot) {
+            fs->meta_slots->markUsed(index);
+            if (!fs->inline_slots || slot.entry.getType() != EntryType::FILE) return;
+            ContentRef ref = block_store::content_ref(&slot.entry);
+            if (ref.layout == LAYOUT_INLINE && ref.overflow_block < layout_of(fs->header)->max_files)
+                fs->inline_slots->markUsed(ref.overflow_block);
+        });
+    }
+
+    uint32_t first_child(uint32_t dir) {
+        MetaSlot slot;
+        return read_slots(dir, 1, &slot) ? slot.first_child : 0;
+    }
+
+    // The stored subtree below dir, in pre-order, each directory's children
+    // in list order as loadChildren would read them. Slots come through a
+    // window of SCAN_CHUNK: siblings usually got neighbouring slots.
+    void walk(uint32_t dir, const SlotVisitor& visit) {
+        std::vector<MetaSlot> window;
+        uint32_t window_first = 0;
+        uint32_t visited = 0;
+        walk(dir, visit, window, window_first, visited);
+    }
+
+private:
+    bool slot_at(uint32_t i, MetaSlot& out, std::vector<MetaSlot>& window, uint32_t& window_first) {
+        if (window.empty() || i < window_first || i - window_first >= window.size()) {
+            uint32_t count = static_cast<uint32_t>(layout_of(fs->header)->meta_size / sizeof(MetaSlot));
+            if (i == 0 || i > count) return false;
+            window.resize(std::min(SCAN_CHUNK, count - i + 1));
+            window_first = i;
+            if (!read_slots(i, static_cast<uint32_t>(window.size()), window.data())) {
+                window.clear();
+                return false;
+            }
+        }
+        out = window[i - window_first];
+        return true;
+    }
+
+    // visited bounds the walk when a damaged index links in a cycle
+    void walk(uint32_t dir, const SlotVisitor& visit, std::vector<MetaSlot>& window, uint32_t& window_first,
+              uint32_t& visited) {
+        uint32_t limit = static_cast<uint32_t>(layout_of(fs->header)->meta_size / sizeof(MetaSlot));
+        MetaSlot slot;
+        if (!slot_at(dir, slot, window, window_first)) return;
+        std::vector<std::pair<uint32_t, MetaSlot>> children;
+        for (uint32_t i = slot.first_child; i != 0 && visited < limit; i = slot.next_sibling, ++visited) {
+            if (!slot_at(i, slot, window, window_first) || !(slot.flags & META_SLOT_USED) || slot.parent != dir) break;
+            children.push_back({i, slot});
+        }
+        for (const auto& child : children) {
+            visit(child.first, child.second);
+            if (child.second.entry.getType() == EntryType::DIRECTORY)
+                walk(child.first, visit, window, window_first, visited);
+        }
+    }
+};
+
+// Snapshot tree images: pre-order FileEntry stream, a child count after each
+FSNode* load_fs_tree(const char* buf, uint64_t& offset, uint64_t end_offset) {
+    if (offset + sizeof(FileEntry) + sizeof(uint32_t) > end_offset) return nullptr;
 
     FileEntry entry;
-    ifs.seekg(offset, std::ios::beg);
-    ifs.read(reinterpret_cast<char*>(&entry), sizeof(FileEntry));
+    std::memcpy(&entry, buf + offset, sizeof(FileEntry));
     offset += sizeof(FileEntry);
 
+    uint32_t child_count;
+    std::memcpy(&child_count, buf + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
     FSNode* node = new FSNode(new FileEntry(entry));
 
     if (entry.getType() == EntryType::DIRECTORY) {
-        if (offset + sizeof(uint32_t) > end_offset) return node;
-        uint32_t child_count;
-        ifs.read(reinterpret_cast<char*>(&child_count), sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-
         for (uint32_t i = 0; i < child_count; ++i) {
-            FSNode* child = load_fs_tree(ifs, offset, end_offset);
+            FSNode* child = load_fs_tree(buf, offset, end_offset);
             if (!child) break;
             node->addChild(child);
         }
@@ -78,132 +243,809 @@ std::string sha256(const std::string &password) {
     return std::string(buf);
 }
 
+// A missing config file leaves the defaults; a malformed one is an error
+static int read_config(const char* config_path, OFSConfig* config) {
+    int res = config_load(config_path, config);
+    return res == static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR) ? static_cast<int>(OFSErrorCodes::SUCCESS) : res;
+}
+
+// pwrite all of buf, retrying short writes
+static bool write_at(int fd, const void* buf, size_t len, uint64_t offset) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
 // ----------------- fs_format -----------------
+// The container is sized with ftruncate, so everything left zero is a hole:
+// only the header, the admin user, the root slot, the used prefix of the
+// bitmap and the snapshot area header are written. Formatting costs the
+// same for any total_size.
 int fs_format(const char* omni_path, const char* config_path) {
-    std::ofstream ofs(omni_path, std::ios::binary | std::ios::trunc);
-    if (!ofs.is_open()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    OFSConfig config;
+    int res = read_config(config_path, &config);
+    if (res != 0) return res;
 
     // Create OMNIHeader
-    OMNIHeader header(0x00010000, 1024ULL * 1024 * 50, sizeof(OMNIHeader), 4096);
-    std::strncpy(header.magic, "OMNIFS01", sizeof(header.magic) - 1);
+    uint64_t total_size = config.total_size / config.block_size * config.block_size;
+    OMNIHeader header(OMNI_FORMAT_VERSION, total_size, sizeof(OMNIHeader), config.block_size);
+    std::memcpy(header.magic, "OMNIFS01", sizeof(header.magic));
+    std::memcpy(header.config_hash, config.hash.data(), std::min<size_t>(config.hash.size(), CONFIG_HASH_LEN));
     header.config_timestamp = std::time(nullptr);
     header.user_table_offset = sizeof(OMNIHeader);
-    header.max_users = 1024;
-    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    header.max_users = config.max_users;
 
-    // ----------------- Default Admin -----------------
-    std::string hashed_admin = sha256("admin123");
-    UserInfo admin_user("admin", hashed_admin, UserRole::ADMIN, std::time(nullptr));
-    ofs.write(reinterpret_cast<const char*>(&admin_user), sizeof(UserInfo));
+    // ----------------- Layout -----------------
+    uint64_t total_blocks = header.total_size / header.block_size;
+    // The bitmap and frozen bitmap are sized for max_size so fs_grow never
+    // has to move the regions behind them
+    uint64_t capacity = std::max(total_blocks, config.max_size / header.block_size);
+    OMNILayout* layout = layout_of(header);
+    layout->max_files = config.max_files;
+    layout->next_inode = 1;
+    layout->meta_offset = header.user_table_offset + header.max_users * sizeof(UserInfo);
+    layout->meta_size = (layout->max_files + 1) * sizeof(MetaSlot);
+    layout->bitmap_offset = layout->meta_offset + layout->meta_size;
+    layout->bitmap_size = (capacity + 7) / 8;
+    layout->inline_offset = layout->bitmap_offset + layout->bitmap_size;
+    layout->inline_slot_size = INLINE_SLOT_SIZE;
+    uint64_t inline_end = layout->inline_offset + static_cast<uint64_t>(layout->max_files) * layout->inline_slot_size;
+    header.file_state_storage_offset = static_cast<uint32_t>(inline_end);
+    uint64_t state_end = inline_end + snapshot_store::area_size(capacity, layout->max_files);
+    header.change_log_offset = (state_end + header.block_size - 1) / header.block_size * header.block_size;
+    layout->log_size = DEFAULT_LOG_SIZE;
+    layout->checkpoint_lsn = 0;
+
+    // Block numbers are 32-bit in extents, and the metadata regions must
+    // leave room for content
+    uint64_t used_blocks = (header.change_log_offset + layout->log_size + header.block_size - 1) / header.block_size;
+    if (capacity > UINT32_MAX || state_end > UINT32_MAX || used_blocks >= total_blocks) {
+        std::cerr << "Error: total_size " << total_size << " does not fit the container layout\n";
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_CONFIG);
+    }
+
+    int fd = open(omni_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    bool ok = ftruncate(fd, header.total_size) == 0;
+    // preallocate = 1 reserves the disk space up front, still without
+    // writing it (extent-based filesystems only record the allocation)
+    if (ok && config.preallocate)
+        ok = posix_fallocate(fd, 0, header.total_size) == 0;
+    ok = ok && write_at(fd, &header, sizeof(header), 0);
 
-    // ----------------- Empty Users -----------------
-    UserInfo empty_user;
-    for (uint32_t i = 1; i < header.max_users; ++i)
-        ofs.write(reinterpret_cast<const char*>(&empty_user), sizeof(UserInfo));
+    // ----------------- Default Admin -----------------
+    // The other user slots stay zero: inactive
+    std::string hashed_admin = sha256(config.admin_password);
+    UserInfo admin_user(config.admin_username, hashed_admin, UserRole::ADMIN, std::time(nullptr));
+    ok = ok && write_at(fd, &admin_user, sizeof(UserInfo), header.user_table_offset);
 
     // ----------------- Root Directory -----------------
-    FileEntry root_entry("root", EntryType::DIRECTORY, 0, 0755, "admin", 0);
-    ofs.write(reinterpret_cast<const char*>(&root_entry), sizeof(FileEntry));
+    // The other slots stay zero: unused
+    MetaSlot root_slot;
+    std::memset(&root_slot, 0, sizeof(root_slot));
+    root_slot.entry = FileEntry("root", EntryType::DIRECTORY, 0, 0755, config.admin_username, 0);
+    root_slot.flags = META_SLOT_USED;
+    ok = ok && write_at(fd, &root_slot, sizeof(MetaSlot), layout->meta_offset);
 
     // ----------------- Free Space Bitmap -----------------
-    uint64_t total_blocks = header.total_size / header.block_size;
-    FreeSpaceManager fsm(total_blocks);
-
-    uint64_t used_blocks = (sizeof(OMNIHeader) + header.max_users * sizeof(UserInfo) + sizeof(FileEntry) + header.block_size - 1) / header.block_size;
+    // Only the metadata regions are used; the rest of the bitmap is free
+    FreeSpaceManager fsm(used_blocks);
     for (uint64_t i = 0; i < used_blocks; ++i)
         fsm.markUsed(i);
+    ok = ok && write_at(fd, fsm.data(), fsm.byteSize(), layout->bitmap_offset);
+
+    // ----------------- Snapshot Area -----------------
+    // Inline slots are all zero already. No snapshots: only the area header.
+    std::vector<char> state = snapshot_store::empty_area(0, 0);
+    ok = ok && write_at(fd, state.data(), sizeof(SnapshotAreaHeader), header.file_state_storage_offset);
+
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    return ok ? static_cast<int>(OFSErrorCodes::SUCCESS) : static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+}
+
+static bool valid_header(const OMNIHeader& header) {
+    return std::strncmp(header.magic, "OMNIFS01", 8) == 0 &&
+           header.format_version == OMNI_FORMAT_VERSION;
+}
+
+// Hash active user slots by name; the table points into fs->user_slots
+static void index_users(FSInstance* fs) {
+    fs->users = new HashTable<UserInfo>(fs->header.max_users);
+    for (uint32_t i = 0; i < fs->header.max_users; ++i) {
+        UserInfo* u = &fs->user_slots[i];
+        if (u->is_active)
+            fs->users->insert(u->username, u);
+    }
+}
+
+static uint64_t inline_area_size(const OMNILayout* layout) {
+    return static_cast<uint64_t>(layout->max_files) * layout->inline_slot_size;
+}
+
+// ----------------- Tree walks -----------------
+static void walk_node(FSInstance* fs, FSNode* node, const NodeVisitor& on_node, const SlotVisitor& on_slot) {
+    if (on_node) on_node(node);
+    if (!node->children) return;
+    if (!node->childrenLoaded()) {
+        if (on_slot) static_cast<meta_loader*>(node->loader)->walk(node->meta_index, on_slot);
+        return;
+    }
+    for (auto* it = node->children->getHead(); it; it = it->next)
+        walk_node(fs, it->data, on_node, on_slot);
+}
+
+void fs_walk(FSInstance* fs, const NodeVisitor& on_node, const SlotVisitor& on_slot) {
+    if (fs && fs->root) walk_node(fs, fs->root, on_node, on_slot);
+}
 
-    const std::vector<uint8_t>& bitmap = fsm.getBitmap();
-    ofs.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+FSNode* fs_load_slot(FSInstance* fs, uint32_t index) {
+    meta_loader* loader = static_cast<meta_loader*>(fs->loader);
+    if (!loader || !fs->root) return nullptr;
 
-    ofs.close();
+    // Slots from index up to the root, as stored
+    uint32_t limit = static_cast<uint32_t>(layout_of(fs->header)->meta_size / sizeof(MetaSlot));
+    std::vector<uint32_t> path;
+    for (uint32_t i = index; i != META_ROOT_INDEX;) {
+        MetaSlot slot;
+        if (i == 0 || path.size() >= limit || !loader->read_slots(i, 1, &slot) || !(slot.flags & META_SLOT_USED))
+            return nullptr;
+        path.push_back(i);
+        i = slot.parent;
+    }
+
+    FSNode* node = fs->root;
+    for (auto it = path.rbegin(); it != path.rend() && node; ++it) {
+        FSNode* next = nullptr;
+        for (FSNode* child : node->getChildren())
+            if (child->meta_index == *it) next = child;
+        node = next;
+    }
+    return node;
+}
+
+// Slots are not tracked on disk: whichever slot an inline file points at is in use
+static void claim_inline(FSInstance* fs) {
+    auto claim = [fs](const FileEntry* entry) {
+        if (entry->getType() != EntryType::FILE) return;
+        ContentRef ref = block_store::content_ref(entry);
+        if (ref.layout == LAYOUT_INLINE) fs->inline_slots->markUsed(ref.overflow_block);
+    };
+    fs_walk(fs, [&](FSNode* node) { claim(node->entry); },
+            [&](uint32_t, const MetaSlot& slot) { claim(&slot.entry); });
+}
+
+static void claim_meta(FSInstance* fs) {
+    fs_walk(fs, [fs](FSNode* node) { if (node->meta_index != 0) fs->meta_slots->markUsed(node->meta_index); },
+            [fs](uint32_t index, const MetaSlot&) { fs->meta_slots->markUsed(index); });
+}
+
+// Tuning keys apply on every open; the layout keys were fixed by fs_format
+static void apply_config(FSInstance* fs, const OFSConfig& config) {
+    fs->cache_bytes = config.cache_size;
+    fs->direct_io = config.direct_io;
+    fs->dedup = config.dedup;
+    fs->compression = config.compression;
+    fs->defrag = config.defrag;
+    fs->delayed_alloc = config.delayed_alloc;
+    fs->lazy_load = config.lazy_load;
+    fs->max_loaded = config.max_loaded_entries;
+    fs->prefetch_workers = config.prefetch_workers;
+    fs->checkpoint_interval = config.checkpoint_interval;
+
+    // The flag reaches the disk with the checkpoint that ends recovery,
+    // before any block can be shared
+    OMNILayout* layout = layout_of(fs->header);
+    if (fs->dedup) {
+        layout->features |= CONTAINER_DEDUP;
+    } else if (layout->features & CONTAINER_DEDUP) {
+        fs->dedup = true;
+        std::cout << "[CONFIG] Container holds deduplicated blocks: dedup stays on" << std::endl;
+    }
+
+    if (!config.hash.empty() && fs->header.config_hash[0] != 0 &&
+        std::memcmp(fs->header.config_hash, config.hash.data(), CONFIG_HASH_LEN) != 0)
+        std::cout << "[CONFIG] Config changed since format: total_size, block_size, max_files and "
+                     "max_users keep their formatted values" << std::endl;
+}
+
+static void destroy_instance(FSInstance* fs) {
+    delete fs->defrag_worker;
+    delete fs->log;
+    delete fs->snapshots;
+    delete fs->store;
+    delete fs->fsm;
+    delete fs->inline_slots;
+    delete fs->meta_slots;
+    delete fs->root;
+    delete fs->loader;
+    delete fs->users;
+    if (fs->map_base) {
+        munmap(fs->map_base, fs->map_length);
+    } else {
+        delete[] fs->user_slots;
+        delete[] fs->inline_area;
+    }
+    for (auto session : fs->sessions) 
+      delete static_cast<SessionInfo*>(session);
+    delete fs;
+}
+
+// Lazy mode starts from the root alone
+static void load_lazy_root(FSInstance* fs) {
+    meta_loader* loader = new meta_loader(fs);
+    fs->loader = loader;
+    if (loader->is_open()) fs->root = loader->load_root();
+}
+
+// Content blocks are read and written on demand; the change log is
+// replayed before the instance is handed out
+static int open_store(FSInstance* fs, void** instance) {
+    // Slot 0 means "none" and is never handed out
+    fs->meta_slots = new FreeSpaceManager(layout_of(fs->header)->max_files + 2);
+    fs->meta_slots->markUsed(0);
+    if (fs->inline_area)
+        fs->inline_slots = new FreeSpaceManager(layout_of(fs->header)->max_files);
+    if (fs->loader) {
+        static_cast<meta_loader*>(fs->loader)->claim();
+    } else if (fs->root) {
+        claim_meta(fs);
+        if (fs->inline_slots) claim_inline(fs);
+    }
+    fs->store = new block_store(fs);
+    if (!fs->store->is_open()) {
+        destroy_instance(fs);
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+    if (fs->header.file_state_storage_offset != 0) {
+        fs->snapshots = new snapshot_store(fs);
+        if (!fs->snapshots->is_open()) {
+            destroy_instance(fs);
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+        fs->snapshots->claim();
+    }
+    if (fs->header.change_log_offset != 0 && layout_of(fs->header)->log_size != 0) {
+        fs->log = new change_log(fs);
+        if (!fs->log->is_open() || fs->log->recover() != 0) {
+            destroy_instance(fs);
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+    }
+    // Started by the server, like the checkpointer
+    if (fs->defrag) fs->defrag_worker = new defragmenter(fs);
+    *instance = fs;
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
 int fs_init(void** instance, const char* omni_path, const char* config_path) {
-    
-    std::ifstream ifs(omni_path, std::ios::binary);
-    if (!ifs.is_open()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    OFSConfig config;
+    int res = read_config(config_path, &config);
+    if (res != 0) return res;
+
+    io_backend* io = io_backend::open(omni_path, O_RDONLY);
+    if (!io) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    OMNIHeader header;
+    if (!io->read(&header, sizeof(OMNIHeader), 0) || !valid_header(header)) {
+        delete io;
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
     
     FSInstance* fs = new FSInstance();
     fs->omni_path = omni_path;
+    fs->header = header;
+    OMNILayout* layout = layout_of(fs->header);
+    fs->next_file_index = layout->next_inode;
+    apply_config(fs, config);
 
-    // Load header
-    ifs.read(reinterpret_cast<char*>(&fs->header), sizeof(OMNIHeader));
+    // Each section is one positioned read into its final buffer, all in a
+    // single batch; records are then parsed from memory. A container
+    // shorter than a section leaves the rest zeroed.
+    fs->user_slots = new UserInfo[fs->header.max_users]();
+    std::vector<char> index(fs->lazy_load ? 0 : layout->meta_size);
+    std::vector<uint8_t> bitmap(layout->bitmap_size);
+    if (layout->inline_slot_size != 0)
+        fs->inline_area = new uint8_t[inline_area_size(layout)]();
 
-    // Load users
-    fs->users = new HashTable<UserInfo>(fs->header.max_users);
-    ifs.seekg(fs->header.user_table_offset, std::ios::beg);
-    for (uint32_t i = 0; i < fs->header.max_users; ++i) {
-        UserInfo u;
-        ifs.read(reinterpret_cast<char*>(&u), sizeof(UserInfo));
-        if (u.is_active)
-            fs->users->insert(u.username, new UserInfo(u));
+    std::vector<IoRequest> batch{
+        IoRequest::read(fs->user_slots, fs->header.max_users * sizeof(UserInfo), fs->header.user_table_offset),
+        IoRequest::read(bitmap.data(), bitmap.size(), layout->bitmap_offset)};
+    size_t index_req = batch.size();
+    if (!index.empty()) batch.push_back(IoRequest::read(index.data(), index.size(), layout->meta_offset));
+    if (fs->inline_area) batch.push_back(IoRequest::read(fs->inline_area, inline_area_size(layout), layout->inline_offset));
+    io->submit(batch);
+    delete io;
+    for (const IoRequest& req : batch) {
+        if (req.result < 0) {
+            destroy_instance(fs);
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
     }
 
-    // Load FS tree
-    uint64_t fs_tree_start = fs->header.user_table_offset + fs->header.max_users * sizeof(UserInfo);
-    ifs.seekg(0, std::ios::end);
-    uint64_t fs_end = ifs.tellg();
-    uint64_t bitmap_size = (fs->header.total_size / fs->header.block_size + 7) / 8;
-    uint64_t fs_tree_end = fs_end - bitmap_size;
-    uint64_t offset = fs_tree_start;
-    fs->root = load_fs_tree(ifs, offset, fs_tree_end);
+    // Load users
+    index_users(fs);
+
+    // Load FS tree: the root alone, or the whole index area
+    if (fs->lazy_load) {
+        load_lazy_root(fs);
+    } else {
+        bool whole = batch[index_req].result == static_cast<ssize_t>(index.size());
+        fs->root = load_meta_index(index.data(), whole ? index.size() : 0, &fs->loaded_entries);
+    }
 
     // Load bitmap
     fs->fsm = new FreeSpaceManager(fs->header.total_size / fs->header.block_size);
-    ifs.seekg(fs_tree_end, std::ios::beg);
-    std::vector<uint8_t> bitmap(bitmap_size);
-    ifs.read(reinterpret_cast<char*>(bitmap.data()), bitmap_size);
     fs->fsm->setBitmap(bitmap);
 
-    *instance = fs;
-    ifs.close();
+    return open_store(fs, instance);
+}
+
+int fs_init_mapped(void** instance, const char* omni_path, const char* config_path) {
+    OFSConfig config;
+    int res = read_config(config_path, &config);
+    if (res != 0) return res;
+
+    int fd = open(omni_path, O_RDWR);
+    if (fd < 0) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    OMNIHeader header;
+    if (pread(fd, &header, sizeof(OMNIHeader), 0) != sizeof(OMNIHeader) || !valid_header(header)) {
+        close(fd);
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+
+    // Map everything in front of the change log: header, users, metadata,
+    // bitmap and inline area
+    OMNILayout* layout = layout_of(header);
+    size_t length = layout->bitmap_offset + layout->bitmap_size;
+    if (layout->inline_slot_size != 0)
+        length = layout->inline_offset + inline_area_size(layout);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (static_cast<uint64_t>(st.st_size) < length && ftruncate(fd, length) != 0)) {
+        close(fd);
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    FSInstance* fs = new FSInstance();
+    fs->omni_path = omni_path;
+    fs->map_base = static_cast<uint8_t*>(base);
+    fs->map_length = length;
+    fs->header = header;      // working copy, written back into the mapping on shutdown
+    fs->next_file_index = layout->next_inode;
+    apply_config(fs, config);
+
+    // Users and bitmap are not copied: page faults bring in what is touched
+    fs->user_slots = reinterpret_cast<UserInfo*>(fs->map_base + header.user_table_offset);
+    index_users(fs);
+
+    if (fs->lazy_load)
+        load_lazy_root(fs);
+    else
+        fs->root = load_meta_index(reinterpret_cast<const char*>(fs->map_base) + layout->meta_offset,
+                                   layout->meta_size, &fs->loaded_entries);
+
+    fs->fsm = new FreeSpaceManager(header.total_size / header.block_size);
+    fs->fsm->attachBitmap(fs->map_base + layout->bitmap_offset);
+    if (layout->inline_slot_size != 0)
+        fs->inline_area = fs->map_base + layout->inline_offset;
+
+    return open_store(fs, instance);
+}
+
+// ----------------- Dirty tracking -----------------
+void fs_mark_node_dirty(FSInstance* fs, FSNode* node) {
+    if (!fs || !node || node->dirty) return;
+    node->dirty = true;
+    fs->dirty_nodes.push_back(node);
+}
+
+void fs_mark_tree_dirty(FSInstance* fs) {
+    if (fs) fs->tree_dirty = true;
+}
+
+// Sibling before node in its parent's child list, null for the first child
+static FSNode* prev_sibling(FSNode* node) {
+    FSNode* prev = nullptr;
+    for (auto* it = node->parent->children->getHead(); it && it->data != node; it = it->next)
+        prev = it->data;
+    return prev;
+}
+
+// The one slot whose link points at node: its predecessor's next_sibling,
+// or the parent's first_child
+static void mark_link_dirty(FSInstance* fs, FSNode* node) {
+    FSNode* prev = prev_sibling(node);
+    fs_mark_node_dirty(fs, prev ? prev : node->parent);
+}
+
+int fs_link_node(FSInstance* fs, FSNode* node) {
+    if (!fs || !node || !node->parent) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (node->meta_index == 0) {
+        int64_t slot = fs->meta_slots->allocate(1);
+        if (slot < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        node->meta_index = static_cast<uint32_t>(slot);
+        ++fs->loaded_entries;
+    }
+    mark_link_dirty(fs, node);
+    fs_mark_node_dirty(fs, node);
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
-void fs_shutdown(void* instance) {
-    if (!instance) return;
-    FSInstance* fs = static_cast<FSInstance*>(instance);
+static void release_meta(FSInstance* fs, FSNode* node) {
+    for (FSNode* child : node->getChildren())
+        release_meta(fs, child);
+    if (node->dirty) {
+        fs->dirty_nodes.erase(std::find(fs->dirty_nodes.begin(), fs->dirty_nodes.end(), node));
+        node->dirty = false;
+    }
+    if (node->meta_index == 0) return;
+    fs->meta_slots->markFree(node->meta_index);
+    fs->freed_meta.push_back(node->meta_index);
+    node->meta_index = 0;
+    --fs->loaded_entries;
+}
 
-    std::ofstream ofs(fs->omni_path, std::ios::binary | std::ios::trunc);
-    if (!ofs.is_open()) {
-        std::cerr << "Error: cannot write FS to disk during shutdown\n";
+void fs_unlink_node(FSInstance* fs, FSNode* node, bool release) {
+    if (!fs || !node || !node->parent) return;
+    mark_link_dirty(fs, node);
+    if (release) release_meta(fs, node);
+}
+
+// Loaded directories holding only clean files and unloaded directories.
+// Their parents qualify once they have been dropped.
+static void collect_cold(FSInstance* fs, FSNode* node, std::vector<FSNode*>& cold) {
+    if (!node->children || !node->childrenLoaded() || !node->children->getHead()) return;
+    bool leaf = node != fs->root;
+    for (auto* it = node->children->getHead(); it; it = it->next) {
+        FSNode* child = it->data;
+        if (child->dirty || fs->store->has_delayed(child) || (child->children && child->childrenLoaded()))
+            leaf = false;
+        collect_cold(fs, child, cold);
+    }
+    if (leaf) cold.push_back(node);
+}
+
+void fs_evict_cold(FSInstance* fs) {
+    if (!fs || !fs->loader || fs->max_loaded == 0 || fs->tree_dirty) return;
+    if (fs->loaded_entries <= fs->max_loaded) return;
+    // Down to 3/4 of the budget, so the next pass is not right behind
+    uint64_t target = fs->max_loaded / 4 * 3;
+    while (fs->loaded_entries > target) {
+        std::vector<FSNode*> cold;
+        collect_cold(fs, fs->root, cold);
+        std::sort(cold.begin(), cold.end(), [](FSNode* a, FSNode* b) { return a->last_used < b->last_used; });
+        uint64_t freed = 0;
+        for (FSNode* dir : cold) {
+            if (fs->loaded_entries <= target) break;
+            uint64_t count = dir->unloadChildren(fs->loader);
+            fs->loaded_entries -= std::min(count, fs->loaded_entries);
+            freed += count;
+        }
+        if (freed == 0) return;
+    }
+}
+
+void fs_mark_user_dirty(FSInstance* fs, const UserInfo* user) {
+    if (!fs || !user) return;
+    uint32_t slot = static_cast<uint32_t>(user - fs->user_slots);
+    if (slot >= fs->header.max_users) return;
+    if (std::find(fs->dirty_users.begin(), fs->dirty_users.end(), slot) == fs->dirty_users.end())
+        fs->dirty_users.push_back(slot);
+}
+
+void fs_mark_inline_dirty(FSInstance* fs, uint32_t slot) {
+    if (!fs || !fs->inline_area) return;
+    if (std::find(fs->dirty_inline.begin(), fs->dirty_inline.end(), slot) == fs->dirty_inline.end())
+        fs->dirty_inline.push_back(slot);
+}
+
+void fs_log_entry(FSInstance* fs, FSNode* node) {
+    if (fs && fs->log) fs->log->log_entry(node);
+}
+
+void fs_log_remove(FSInstance* fs, FSNode* node) {
+    if (fs && fs->log) fs->log->log_remove(node);
+}
+
+void fs_log_user(FSInstance* fs, const UserInfo* user) {
+    if (fs && fs->log) fs->log->log_user(user);
+}
+
+void fs_free_blocks(FSInstance* fs, uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end) {
+        // Blocks a snapshot references stay allocated
+        if (fs->snapshots && fs->snapshots->holds_block(start)) {
+            ++start;
+            continue;
+        }
+        uint64_t run = start + 1;
+        while (run < end && !(fs->snapshots && fs->snapshots->holds_block(run))) ++run;
+        if (fs->log) fs->log->hold_free(start, run - start);
+        else fs->fsm->free(start, run - start);
+        start = run;
+    }
+}
+
+void fs_free_inline(FSInstance* fs, uint32_t slot) {
+    if (fs->snapshots && fs->snapshots->holds_slot(slot)) return;
+    if (fs->log) fs->log->hold_inline_free(slot);
+    else fs->inline_slots->markFree(slot);
+}
+
+void fs_mark_all_dirty(FSInstance* fs) {
+    fs->tree_dirty = true;
+    for (uint32_t i = 0; i < fs->header.max_users; ++i)
+        fs_mark_user_dirty(fs, &fs->user_slots[i]);
+    if (fs->inline_area)
+        for (uint32_t i = 0; i < layout_of(fs->header)->max_files; ++i)
+            fs_mark_inline_dirty(fs, i);
+    fs->fsm->markAllDirty();
+}
+
+// ----------------- Metadata index -----------------
+static MetaSlot slot_of(FSNode* node, uint32_t next_sibling) {
+    MetaSlot slot;
+    std::memset(&slot, 0, sizeof(slot));
+    slot.entry = *node->entry;
+    slot.parent = node->parent ? node->parent->meta_index : 0;
+    // An unloaded directory has an empty list, not an empty directory: its
+    // stored list is unchanged
+    if (!node->childrenLoaded()) {
+        slot.first_child = static_cast<meta_loader*>(node->loader)->first_child(node->meta_index);
+    } else {
+        auto* head = node->children ? node->children->getHead() : nullptr;
+        slot.first_child = head ? head->data->meta_index : 0;
+    }
+    slot.next_sibling = next_sibling;
+    slot.flags = META_SLOT_USED;
+    return slot;
+}
+
+static bool assign_meta(FSInstance* fs, FSNode* node) {
+    node->dirty = false;
+    ++fs->loaded_entries;
+    if (node->meta_index == 0) {
+        int64_t slot = fs->meta_slots->allocate(1);
+        if (slot < 0) return false;
+        node->meta_index = static_cast<uint32_t>(slot);
+    }
+    if (!node->children || !node->childrenLoaded()) return true;
+    for (auto* it = node->children->getHead(); it; it = it->next)
+        if (!assign_meta(fs, it->data)) return false;
+    return true;
+}
+
+static void put_slot(std::vector<char>& area, uint32_t index, const MetaSlot& slot) {
+    std::memcpy(area.data() + static_cast<uint64_t>(index - 1) * sizeof(MetaSlot), &slot, sizeof(slot));
+}
+
+// Unloaded directories keep their stored subtrees as they are
+static void fill_meta(FSNode* node, uint32_t next_sibling, std::vector<char>& area) {
+    put_slot(area, node->meta_index, slot_of(node, next_sibling));
+    if (node->children && !node->childrenLoaded()) {
+        static_cast<meta_loader*>(node->loader)->walk(node->meta_index, [&](uint32_t index, const MetaSlot& slot) {
+            put_slot(area, index, slot);
+        });
         return;
     }
+    for (auto* it = node->children ? node->children->getHead() : nullptr; it; it = it->next)
+        fill_meta(it->data, it->next ? it->next->data->meta_index : 0, area);
+}
 
-    
-    ofs.write(reinterpret_cast<const char*>(&fs->header), sizeof(OMNIHeader));
+// The whole index area from the tree. Nodes replayed from the change log
+// get a slot here; slots no node holds come out cleared.
+static bool write_meta_index(FSInstance* fs, std::vector<char>& area) {
+    OMNILayout* layout = layout_of(fs->header);
+    fs->root->meta_index = META_ROOT_INDEX;
+    fs->meta_slots->setBitmap(std::vector<uint8_t>(fs->meta_slots->byteSize(), 0));
+    fs->meta_slots->markUsed(0);
+    claim_meta(fs);
+    fs->loaded_entries = 0;
+    if (!assign_meta(fs, fs->root)) return false;
+
+    area.assign(layout->meta_size, 0);
+    fill_meta(fs->root, 0, area);
+    return true;
+}
+
+// ----------------- fs_flush -----------------
+// Copy what changed since the last snapshot. In mapped mode the user table,
+// bitmap and inline area already live in the mapping and metadata slots are
+// copied into it here, under the caller's lock: the image only names the
+// ranges to sync.
+int fs_snapshot(FSInstance* fs, FlushImage& image) {
+    if (!fs) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    int res = static_cast<int>(OFSErrorCodes::SUCCESS);
+    if (fs->store && !fs->store->flush())
+        res = static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
 
+    OMNILayout* layout = layout_of(fs->header);
+    layout->next_inode = fs->next_file_index;
+    image.header = fs->header;
+    image.pieces.clear();
+    image.mapped.clear();
 
-    uint32_t users_written = 0;
-    for (auto head : fs->users->getBuckets()) {
-        auto node = head;
-        while (node) {
-            ofs.write(reinterpret_cast<const char*>(node->value), sizeof(UserInfo));
-            ++users_written;
-            node = node->next;
+    auto put = [&](uint64_t offset, const void* src, size_t len) {
+        if (fs->map_base) {
+            if (fs->map_base + offset != src) std::memcpy(fs->map_base + offset, src, len);
+            image.mapped.push_back({offset, len});
+            return;
+        }
+        const char* raw = static_cast<const char*>(src);
+        image.pieces.push_back({offset, std::vector<char>(raw, raw + len)});
+    };
+
+    for (uint32_t slot : fs->dirty_users)
+        put(fs->header.user_table_offset + static_cast<uint64_t>(slot) * sizeof(UserInfo),
+            &fs->user_slots[slot], sizeof(UserInfo));
+    uint64_t slot_size = layout->inline_slot_size;
+    for (uint32_t slot : fs->dirty_inline)
+        put(layout->inline_offset + slot * slot_size, fs->inline_area + slot * slot_size, slot_size);
+
+    if (fs->tree_dirty) {
+        std::vector<char> area;
+        if (!write_meta_index(fs, area)) {
+            std::cerr << "Error: FS tree does not fit in the metadata index ("
+                      << layout->max_files + 1 << " entries)\n";
+            res = static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        } else {
+            put(layout->meta_offset, area.data(), area.size());
+            fs->tree_dirty = false;
+        }
+    } else {
+        MetaSlot empty;
+        std::memset(&empty, 0, sizeof(empty));
+        for (uint32_t index : fs->freed_meta)
+            if (fs->meta_slots->isFree(index)) put(meta_slot_offset(layout, index), &empty, sizeof(empty));
+
+        // Next siblings come from one walk of each parent's child list
+        std::unordered_map<FSNode*, uint32_t> next;
+        for (FSNode* node : fs->dirty_nodes) {
+            if (!node->parent || next.count(node)) continue;
+            FSNode* prev = nullptr;
+            for (auto* it = node->parent->children->getHead(); it; it = it->next) {
+                if (prev) next[prev] = it->data->meta_index;
+                prev = it->data;
+            }
+            if (prev) next[prev] = 0;
+        }
+        for (FSNode* node : fs->dirty_nodes) {
+            if (node->meta_index != 0) {
+                MetaSlot slot = slot_of(node, next.count(node) ? next[node] : 0);
+                put(meta_slot_offset(layout, node->meta_index), &slot, sizeof(slot));
+            }
+            node->dirty = false;
         }
     }
+    fs->freed_meta.clear();
 
-    UserInfo empty_user;
-    for (; users_written < fs->header.max_users; ++users_written)
-        ofs.write(reinterpret_cast<const char*>(&empty_user), sizeof(UserInfo));
+    // Coalesce dirty bitmap words into runs
+    std::vector<uint64_t> words = fs->fsm->getDirtyWords();
+    std::sort(words.begin(), words.end());
+    for (size_t i = 0; i < words.size();) {
+        size_t j = i;
+        while (j + 1 < words.size() && words[j + 1] == words[j] + 1) ++j;
+        uint64_t from = words[i] * 8;
+        uint64_t to = std::min<uint64_t>((words[j] + 1) * 8, fs->fsm->byteSize());
+        put(layout->bitmap_offset + from, fs->fsm->data() + from, to - from);
+        i = j + 1;
+    }
 
+    fs->dirty_nodes.clear();
+    fs->dirty_users.clear();
+    fs->dirty_inline.clear();
+    fs->fsm->clearDirty();
+    return res;
+}
 
-    serialize_fs_tree(fs->root, ofs);
+// msync the pages under the given mapping ranges, merging neighbours
+static bool sync_mapped(FSInstance* fs, std::vector<std::pair<uint64_t, uint64_t>> ranges) {
+    const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 0; i < ranges.size();) {
+        uint64_t from = ranges[i].first / page * page;
+        uint64_t to = ranges[i].first + ranges[i].second;
+        while (++i < ranges.size() && ranges[i].first / page * page <= (to + page - 1) / page * page)
+            to = std::max(to, ranges[i].first + ranges[i].second);
+        to = std::min<uint64_t>((to + page - 1) / page * page, fs->map_length);
+        if (msync(fs->map_base + from, to - from, MS_SYNC) != 0) return false;
+    }
+    return true;
+}
 
+// Write a snapshot, sync it, then write and sync the header. Safe to run
+// while the instance keeps changing: it touches only the image and the
+// metadata regions, which nothing else writes. In mapped mode only the
+// captured ranges are synced; the kernel may still write back a page
+// changed since, as it may at any time for a shared mapping.
+int fs_write_image(FSInstance* fs, const FlushImage& image) {
+    io_backend* io = io_backend::open(fs->omni_path, O_RDWR);
+    if (!io) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
 
-    const std::vector<uint8_t>& bitmap = fs->fsm->getBitmap();
-    ofs.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+    bool ok = true;
+    std::vector<IoRequest> batch;
+    for (const auto& piece : image.pieces)
+        batch.push_back(IoRequest::write(piece.second.data(), piece.second.size(), piece.first));
+    if (fs->map_base) ok = sync_mapped(fs, image.mapped);
 
-    ofs.close();
+    // The header goes last so it never points at metadata that is not on
+    // disk: the first sync is a barrier between the two
+    batch.push_back(IoRequest::sync());
+    batch.push_back(IoRequest::write(&image.header, sizeof(OMNIHeader), 0));
+    batch.push_back(IoRequest::sync());
+    ok = ok && io->submit(batch);
+    delete io;
+    return ok ? static_cast<int>(OFSErrorCodes::SUCCESS) : static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+}
 
-    delete fs->fsm;
-    delete fs->root;
-    delete fs->users;
-    for (auto session : fs->sessions) 
-      delete static_cast<SessionInfo*>(session);
+int fs_flush(FSInstance* fs) {
+    int placed = fs->store ? fs->store->allocate_delayed() : 0;
+    FlushImage image;
+    int res = fs_snapshot(fs, image);
+    int io = fs_write_image(fs, image);
+    if (io != 0) fs_mark_all_dirty(fs);
+    return io != 0 ? io : res != 0 ? res : placed;
+}
 
-    delete fs;
+// ----------------- fs_grow -----------------
+// The file is extended and synced first, then the header with the new size
+// goes out through a checkpoint. Only after that are the new blocks handed
+// to the allocator, so a crash at any point leaves either the old size or
+// the new one, never blocks in use past the size the header records.
+int fs_grow(FSInstance* fs, uint64_t new_size) {
+    if (!fs) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    const uint64_t bs = fs->header.block_size;
+    uint64_t old_size = fs->header.total_size;
+    uint64_t blocks = new_size / bs;
+    if (blocks <= old_size / bs) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (blocks > max_blocks(fs->header)) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
+    int fd = open(fs->omni_path.c_str(), O_RDWR);
+    if (fd < 0) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 &&
+              (static_cast<uint64_t>(st.st_size) >= blocks * bs || ftruncate(fd, blocks * bs) == 0) &&
+              fsync(fd) == 0;
+    close(fd);
+    if (!ok) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    fs->header.total_size = blocks * bs;
+    int res = fs->log ? fs->log->checkpoint() : fs_flush(fs);
+    if (res != 0) {
+        fs->header.total_size = old_size;
+        return res;
+    }
+    fs->fsm->grow(blocks);
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+void fs_shutdown(void* instance) {
+    if (!instance) return;
+    FSInstance* fs = static_cast<FSInstance*>(instance);
+
+    if (fs->defrag_worker) fs->defrag_worker->stop();
+
+    int res;
+    if (fs->log) {
+        fs->log->stop_checkpointer();
+        res = fs->log->checkpoint();
+    } else {
+        res = fs_flush(fs);
+    }
+    if (res != 0)
+        std::cerr << "Error: cannot write FS to disk during shutdown\n";
+
+    destroy_instance(fs);
 }
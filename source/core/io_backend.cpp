@@ -0,0 +1,277 @@
+#include "io_backend.h"
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <mutex>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// ------------------ Common ------------------
+
+io_backend::io_backend(int file) : fd(file) {}
+
+io_backend::~io_backend() {
+    if (fd >= 0) close(fd);
+}
+
+bool io_backend::finish(int file, IoRequest& req) {
+    if (req.op == IoOp::SYNC) {
+        req.result = fdatasync(file) == 0 ? 0 : -errno;
+        return req.result == 0;
+    }
+    size_t done = req.result > 0 ? static_cast<size_t>(req.result) : 0;
+    char* p = static_cast<char*>(req.buf);
+    while (done < req.len) {
+        ssize_t n = req.op == IoOp::READ
+            ? pread(file, p + done, req.len - done, req.offset + done)
+            : pwrite(file, p + done, req.len - done, req.offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            req.result = n < 0 ? -errno : static_cast<ssize_t>(done);
+            return false;
+        }
+        done += n;
+    }
+    req.result = static_cast<ssize_t>(done);
+    return true;
+}
+
+bool io_backend::read(void* buf, size_t len, uint64_t offset) {
+    std::vector<IoRequest> batch{IoRequest::read(buf, len, offset)};
+    return submit(batch);
+}
+
+bool io_backend::write(const void* buf, size_t len, uint64_t offset) {
+    std::vector<IoRequest> batch{IoRequest::write(buf, len, offset)};
+    return submit(batch);
+}
+
+bool io_backend::sync() {
+    std::vector<IoRequest> batch{IoRequest::sync()};
+    return submit(batch);
+}
+
+// ------------------ pread/pwrite fallback ------------------
+
+class sync_backend : public io_backend {
+public:
+    explicit sync_backend(int file) : io_backend(file) {}
+
+    const char* name() const override { return "pread"; }
+
+    bool submit(std::vector<IoRequest>& batch) override {
+        bool ok = true;
+        for (IoRequest& req : batch) {
+            req.result = 0;
+            ok = finish(fd, req) && ok;
+        }
+        return ok;
+    }
+};
+
+// ------------------ io_uring ------------------
+
+// Raw syscalls, no liburing: the rings are mapped and driven by hand.
+class uring_backend : public io_backend {
+private:
+    int ring_fd;
+    std::mutex lock;        // one batch in the ring at a time
+    bool broken;            // requests may still be in flight: the ring is not used again
+
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    static int enter(int ring, unsigned to_submit, unsigned min_complete) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ring, to_submit, min_complete,
+                                        IORING_ENTER_GETEVENTS, nullptr, 0));
+    }
+
+    // Submit batch[from, from + count) and wait for all of it
+    bool run(std::vector<IoRequest>& batch, size_t from, size_t count, bool drain_first) {
+        unsigned tail = *sq_tail;
+        bool after_sync = drain_first;
+        for (size_t i = from; i < from + count; ++i) {
+            IoRequest& req = batch[i];
+            unsigned idx = tail & sq_mask;
+            io_uring_sqe* sqe = &sqes[idx];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = fd;
+            sqe->user_data = i;
+            if (req.op == IoOp::SYNC) {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            } else {
+                sqe->opcode = req.op == IoOp::READ ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe->addr = reinterpret_cast<uint64_t>(req.buf);
+                sqe->len = static_cast<uint32_t>(req.len);
+                sqe->off = req.offset;
+            }
+            // A SYNC waits for what came before it, and the request after
+            // a SYNC waits for the SYNC
+            if (req.op == IoOp::SYNC || after_sync) sqe->flags |= IOSQE_IO_DRAIN;
+            after_sync = req.op == IoOp::SYNC;
+            sq_array[idx] = idx;
+            ++tail;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0, completed = 0;
+        while (completed < count) {
+            // EBUSY means the completion queue is full: reap before entering again
+            completed += reap(batch);
+            if (completed == count) break;
+            int n = enter(ring_fd, static_cast<unsigned>(count - submitted), 1);
+            if (n >= 0) {
+                submitted += n;
+                continue;
+            }
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+
+            // The kernel must not be left writing into buffers the caller
+            // gets back: take back what it has not consumed, and wait for
+            // the rest
+            __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            submitted = count - (tail - *sq_tail);
+            while (completed < submitted) {
+                completed += reap(batch);
+                if (completed == submitted) break;
+                if (enter(ring_fd, 0, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    broken = true;
+                    break;
+                }
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Record the results waiting in the completion queue, return how many
+    unsigned reap(std::vector<IoRequest>& batch) {
+        unsigned head = *cq_head;
+        unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != ready; ++head, ++n) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            batch[cqe.user_data].result = cqe.res;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+public:
+    uring_backend(int file, int ring, const io_uring_params& p)
+        : io_backend(file), ring_fd(ring), broken(false), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr) {
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        cq_ptr = single ? sq_ptr
+                        : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQES);
+        sqes = s == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(s);
+        if (!ready()) return;
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sq_entries = p.sq_entries;
+
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~uring_backend() override {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        close(ring_fd);
+    }
+
+    bool ready() const {
+        return sq_ptr != MAP_FAILED && cq_ptr != MAP_FAILED && sqes != nullptr;
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    bool submit(std::vector<IoRequest>& batch) override {
+        std::lock_guard<std::mutex> guard(lock);
+        bool ok = true;
+        if (broken) {
+            for (IoRequest& req : batch) {
+                req.result = 0;
+                ok = finish(fd, req) && ok;
+            }
+            return ok;
+        }
+        for (IoRequest& req : batch) req.result = -ECANCELED;
+
+        for (size_t from = 0; from < batch.size(); from += sq_entries) {
+            size_t count = std::min<size_t>(sq_entries, batch.size() - from);
+            bool drain = from > 0 && batch[from - 1].op == IoOp::SYNC;
+            if (!run(batch, from, count, drain)) return false;
+        }
+
+        // Short transfers are rare (signals, end of file); finish them inline
+        for (IoRequest& req : batch) {
+            if (req.result < 0) { ok = false; continue; }
+            if (req.op != IoOp::SYNC && static_cast<size_t>(req.result) < req.len)
+                ok = finish(fd, req) && ok;
+        }
+        return ok;
+    }
+};
+
+// ------------------ Factory ------------------
+
+io_backend* io_backend::open(const std::string& path, int flags) {
+    int file = ::open(path.c_str(), flags);
+    if (file < 0) return nullptr;
+
+    // OFS_IO_BACKEND=pread forces the fallback
+    const char* forced = getenv("OFS_IO_BACKEND");
+    if (forced && std::strcmp(forced, "pread") == 0) return new sync_backend(file);
+
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int ring = static_cast<int>(syscall(__NR_io_uring_setup, IO_URING_DEPTH, &p));
+    // IORING_OP_READ/WRITE arrived together with this feature bit
+    if (ring >= 0 && (p.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_backend* uring = new uring_backend(file, ring, p);
+        if (uring->ready()) return uring;
+        uring->fd = -1;     // keep the file for the fallback
+        delete uring;
+    } else if (ring >= 0) {
+        close(ring);
+    }
+    return new sync_backend(file);
+}
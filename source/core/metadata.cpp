@@ -1,18 +1,18 @@
 #include "metadata.h"
+#include "block_store.h"
 #include <cstring>
 #include <iostream>
 
 metadata::metadata(FSInstance* fs_instance) : fs(fs_instance) {}
 
 // -------------------------- Helper --------------------------
-void metadata::count_nodes(FSNode* node, uint32_t& files, uint32_t& dirs) {
-    if (!node) return;
-    if (node->entry->getType() == EntryType::FILE) files++;
-    else if (node->entry->getType() == EntryType::DIRECTORY) dirs++;
-
-
-    for (FSNode* child : node->getChildren())
-        count_nodes(child, files, dirs);
+void metadata::count_nodes(uint32_t& files, uint32_t& dirs) {
+    auto count = [&](const FileEntry* entry) {
+        if (entry->getType() == EntryType::FILE) files++;
+        else if (entry->getType() == EntryType::DIRECTORY) dirs++;
+    };
+    fs_walk(fs, [&](FSNode* node) { count(node->entry); },
+            [&](uint32_t, const MetaSlot& slot) { count(&slot.entry); });
 }
 
 // -------------------------- get_metadata --------------------------
@@ -35,6 +35,13 @@ int metadata::get_metadata(void* session, const char* path, FileMetadata* meta)
     }
 
     *meta = FileMetadata(path, *(node->entry));
+    if (node->entry->getType() == EntryType::FILE) {
+        // Holes take no blocks, so this can be less than the logical size
+        meta->blocks_used = fs->store->blocks_used(node);
+        meta->actual_size = meta->blocks_used * fs->header.block_size;
+        if (block_store::is_inline(node->entry))
+            meta->actual_size = node->entry->size;      // held in the inline area
+    }
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
@@ -57,6 +64,8 @@ int metadata::set_permissions(void* session, const char* path, uint32_t permissi
     }
 
     node->entry->permissions = permissions;
+    fs_mark_node_dirty(fs, node);
+    fs_log_entry(fs, node);
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
@@ -69,7 +78,7 @@ int metadata::get_stats(void* session, FSStats* stats) {
     stats->free_space = fs->header.total_size;
 
     uint32_t files = 0, dirs = 0;
-    count_nodes(fs->root, files, dirs);
+    count_nodes(files, dirs);
     stats->total_files = files;
     stats->total_directories = dirs;
 
@@ -94,8 +103,13 @@ int metadata::get_stats(void* session, FSStats* stats) {
     // Active sessions
     stats->active_sessions = fs->sessions.size();
 
-    // Fragmentation placeholder (not implemented)
-    stats->fragmentation = 0.0;
+    // Fragmentation: share of pieces beyond the ideal one per file and one
+    // free run, over all file pieces and free runs
+    FragmentationStats frag = fs->store->fragmentation_stats();
+    uint64_t free_runs = fs->fsm->freeRuns();
+    uint64_t pieces = frag.fragments + free_runs;
+    uint64_t excess = (frag.fragments - frag.files) + (free_runs > 0 ? free_runs - 1 : 0);
+    stats->fragmentation = pieces ? 100.0 * excess / pieces : 0.0;
 
     // Calculate used/free space (sum of file sizes)
     for (FSNode* child : fs->root->getChildren()) {
@@ -105,6 +119,26 @@ int metadata::get_stats(void* session, FSStats* stats) {
     stats->free_space = fs->header.total_size > stats->used_space ? 
                         fs->header.total_size - stats->used_space : 0;
 
+    // Block cache counters
+    BlockCacheStats cache = fs->store->cache_stats();
+    stats->cache_hits = cache.hits;
+    stats->cache_misses = cache.misses;
+    stats->cache_evictions = cache.evictions;
+    stats->cache_blocks = static_cast<uint32_t>(cache.cached);
+    stats->cache_capacity = static_cast<uint32_t>(cache.capacity);
+
+    // Deduplication savings
+    DedupStats dedup = fs->store->dedup_stats();
+    stats->dedup_logical = dedup.logical;
+    stats->dedup_physical = dedup.physical;
+    stats->dedup_ratio = dedup.physical ? static_cast<double>(dedup.logical) / dedup.physical : 1.0;
+
+    // Compression savings
+    CompressionStats packed = fs->store->compression_stats();
+    stats->compressed_logical = packed.logical;
+    stats->compressed_stored = packed.stored;
+    stats->compression_ratio = packed.stored ? static_cast<double>(packed.logical) / packed.stored : 1.0;
+
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
@@ -0,0 +1,134 @@
+#include "read_ahead.h"
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+
+// ------------------ Setup ------------------
+
+read_ahead::read_ahead(FSInstance* fs_instance, BlockCache* block_cache, BufferPool* buffers)
+    : fs(fs_instance), cache(block_cache), pool(buffers), stopping(false) {
+    for (uint32_t i = 0; i < fs->prefetch_workers; ++i) {
+        io_backend* io = io_backend::open(fs->omni_path, O_RDONLY | (fs->direct_io ? O_DIRECT : 0));
+        if (!io) break;
+        ios.push_back(io);
+        workers.emplace_back(&read_ahead::worker_loop, this, io);
+    }
+}
+
+read_ahead::~read_ahead() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+    for (io_backend* io : ios) delete io;
+}
+
+bool read_ahead::is_open() const {
+    return !ios.empty();
+}
+
+// ------------------ Detection ------------------
+
+void read_ahead::observe(FSNode* node, const ExtentMap* map, uint32_t first, uint32_t last,
+                         uint32_t hits, uint32_t loaded) {
+    if (ios.empty() || !node || !node->entry) return;
+
+    auto it = streams.find(node->entry->inode);
+    if (it == streams.end()) {
+        if (streams.size() >= READ_AHEAD_MAX_STREAMS) streams.clear();
+        Stream fresh{0, READ_AHEAD_MIN_BLOCKS, 0};
+        it = streams.emplace(node->entry->inode, fresh).first;
+    }
+    Stream& s = it->second;
+
+    if (first != s.next) {
+        // Random access: start over with a small window at the new position
+        s.next = s.fetched = last + 1;
+        s.window = READ_AHEAD_MIN_BLOCKS;
+        return;
+    }
+
+    // Blocks queued earlier either came from the cache, or were evicted
+    // (or not read yet) before the reader caught up with them
+    if (first < s.fetched && loaded > 0) {
+        if (hits == loaded)
+            s.window = std::min<uint32_t>(s.window * 2, READ_AHEAD_MAX_BLOCKS);
+        else if (hits == 0)
+            s.window = std::max<uint32_t>(s.window / 2, READ_AHEAD_MIN_BLOCKS);
+    }
+    s.next = last + 1;
+    // Stay at least two reads ahead
+    s.window = std::min<uint32_t>(std::max(s.window, 2 * (last - first + 1)), READ_AHEAD_MAX_BLOCKS);
+
+    const uint64_t bs = fs->header.block_size;
+    uint64_t file_blocks = (node->entry->size + bs - 1) / bs;
+    uint32_t from = std::max(s.fetched, last + 1);
+    uint64_t to = std::min<uint64_t>(static_cast<uint64_t>(last) + s.window, file_blocks);
+    if (from >= to) return;
+    s.fetched = static_cast<uint32_t>(to);
+
+    // Map the window to container runs while the caller still holds the map
+    std::vector<Run> runs;
+    const vector<Extent>& list = map->list();
+    for (size_t i = map->lowerBound(from); i < list.size() && list[i].logical < to; ++i) {
+        const Extent& e = list[i];
+        // A compressed cluster is fetched whole
+        if (e.packed()) {
+            runs.push_back(Run{e.start, e.blocks()});
+            continue;
+        }
+        uint32_t seg = std::max(from, e.logical);
+        uint64_t seg_end = std::min<uint64_t>(to, static_cast<uint64_t>(e.logical) + e.length);
+        runs.push_back(Run{e.start + (seg - e.logical), static_cast<uint32_t>(seg_end - seg)});
+    }
+    if (runs.empty()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        for (const Run& r : runs) {
+            if (queue.size() >= READ_AHEAD_MAX_QUEUED) queue.pop_front();
+            queue.push_back(r);
+        }
+    }
+    wake.notify_all();
+}
+
+void read_ahead::forget(uint32_t inode) {
+    streams.erase(inode);
+}
+
+// ------------------ Prefetch threads ------------------
+
+void read_ahead::worker_loop(io_backend* io) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping) break;
+        Run run = queue.front();
+        queue.pop_front();
+
+        lock.unlock();
+        prefetch(io, run);
+        lock.lock();
+    }
+}
+
+// Read a run past the cache and add the blocks that are still missing.
+// The stamp check drops a block that was written or evicted after the
+// stamp, since the disk may have had an older copy when it was read.
+void read_ahead::prefetch(io_backend* io, const Run& run) {
+    const uint64_t bs = fs->header.block_size;
+    uint32_t first = run.start, end = run.start + run.count;
+    while (first < end && cache->contains(first)) ++first;
+    while (end > first && cache->contains(end - 1)) --end;
+    if (first >= end) return;
+
+    uint64_t stamp = cache->stamp();
+    BufferPool::Lease buf(pool, (end - first) * bs);
+    if (!io->read(buf.data, (end - first) * bs, first * bs)) return;
+
+    for (uint32_t b = first; b < end; ++b)
+        cache->fill(b, buf.data + (b - first) * bs, stamp);
+}
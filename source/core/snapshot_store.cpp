@@ -0,0 +1,331 @@
+#include "snapshot_store.h"
+#include "block_store.h"
+#include "change_log.h"
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <ctime>
+#include <fcntl.h>
+
+static_assert(sizeof(SnapshotRecord) == 64, "snapshot records are packed into the area");
+
+// ------------------ Tree image ------------------
+
+// Pre-order stream of entries, each followed by its child count; read back
+// by load_fs_tree. Written right after a checkpoint, when every entry has
+// its slot: a directory's count goes up as its children come by.
+static void write_tree(FSInstance* fs, std::vector<char>& out, uint32_t& entries) {
+    std::vector<std::pair<uint32_t, size_t>> path;     // (slot, offset of its count) per open directory
+    auto put = [&](const FileEntry* entry, uint32_t index, uint32_t parent) {
+        while (!path.empty() && path.back().first != parent) path.pop_back();
+        if (path.empty() && entries > 0) return;
+        if (!path.empty()) {
+            uint32_t count;
+            std::memcpy(&count, out.data() + path.back().second, sizeof(count));
+            ++count;
+            std::memcpy(out.data() + path.back().second, &count, sizeof(count));
+        }
+        const char* raw = reinterpret_cast<const char*>(entry);
+        out.insert(out.end(), raw, raw + sizeof(FileEntry));
+        out.insert(out.end(), sizeof(uint32_t), 0);
+        ++entries;
+        if (entry->getType() == EntryType::DIRECTORY) path.push_back({index, out.size() - sizeof(uint32_t)});
+    };
+    fs_walk(fs, [&](FSNode* node) { put(node->entry, node->meta_index, node->parent ? node->parent->meta_index : 0); },
+            [&](uint32_t index, const MetaSlot& slot) { put(&slot.entry, index, slot.parent); });
+}
+
+static void claim_tree(FSInstance* fs, FreeSpaceManager* blocks, FreeSpaceManager* slots) {
+    fs_walk(fs,
+            [&](FSNode* node) {
+                if (node->entry->getType() == EntryType::FILE) fs->store->claim(node, blocks, slots);
+            },
+            [&](uint32_t, const MetaSlot& slot) {
+                if (slot.entry.getType() == EntryType::FILE) fs->store->claim(&slot.entry, blocks, slots, false);
+            });
+}
+
+// Blocks and slots a loaded snapshot tree references
+static void claim_frozen(block_store* store, FSNode* node, FreeSpaceManager* blocks, FreeSpaceManager* slots) {
+    if (node->entry->getType() == EntryType::FILE)
+        store->claim(node, blocks, slots);
+    for (FSNode* child : node->getChildren())
+        claim_frozen(store, child, blocks, slots);
+}
+
+// Free in target what was frozen but is neither kept nor live, skipping
+// the bitmap bytes with nothing frozen
+static void release(const FreeSpaceManager& frozen, const FreeSpaceManager& kept, const FreeSpaceManager& live,
+                    FreeSpaceManager* target, uint64_t limit) {
+    const uint8_t* bits = frozen.data();
+    for (uint64_t byte = 0; byte < frozen.byteSize() && byte * 8 < limit; ++byte) {
+        if (!bits[byte]) continue;
+        for (uint64_t b = byte * 8; b < byte * 8 + 8 && b < limit; ++b)
+            if (!frozen.isFree(b) && kept.isFree(b) && live.isFree(b)) target->markFree(b);
+    }
+}
+
+static std::vector<uint8_t> bits_of(const FreeSpaceManager& map) {
+    return std::vector<uint8_t>(map.data(), map.data() + map.byteSize());
+}
+
+// ------------------ Setup ------------------
+
+snapshot_store::snapshot_store(FSInstance* fs_instance)
+    : fs(fs_instance), io(nullptr), frozen_blocks(nullptr), frozen_slots(nullptr) {
+    std::memset(&header, 0, sizeof(header));
+    // Sized for the growth limit, like the live bitmap
+    uint64_t capacity = max_blocks(fs->header);
+    uint32_t max_files = layout_of(fs->header)->max_files;
+    frozen_blocks = new FreeSpaceManager(capacity);
+    frozen_slots = new FreeSpaceManager(max_files);
+
+    io = io_backend::open(fs->omni_path, O_RDWR);
+    if (!io) return;
+
+    std::vector<char> area(area_size(capacity, max_files));
+    if (io->read(area.data(), area.size(), area_offset()))
+        std::memcpy(&header, area.data(), sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.count > MAX_SNAPSHOTS) {
+        std::cerr << "Error: invalid snapshot area in " << fs->omni_path << "\n";
+        delete io;
+        io = nullptr;
+        return;
+    }
+
+    const char* p = area.data() + sizeof(header);
+    records.resize(header.count);
+    if (header.count)
+        std::memcpy(records.data(), p, header.count * sizeof(SnapshotRecord));
+    p += MAX_SNAPSHOTS * sizeof(SnapshotRecord);
+    frozen_blocks->setBitmap(std::vector<uint8_t>(p, p + frozen_blocks->byteSize()));
+    p += frozen_blocks->byteSize();
+    frozen_slots->setBitmap(std::vector<uint8_t>(p, p + frozen_slots->byteSize()));
+}
+
+snapshot_store::~snapshot_store() {
+    for (auto& t : trees) delete t.second;
+    delete frozen_blocks;
+    delete frozen_slots;
+    delete io;
+}
+
+bool snapshot_store::is_open() const {
+    return io != nullptr;
+}
+
+uint64_t snapshot_store::area_offset() const {
+    return fs->header.file_state_storage_offset;
+}
+
+uint64_t snapshot_store::area_size(uint64_t total_blocks, uint32_t max_files) {
+    return sizeof(SnapshotAreaHeader) + MAX_SNAPSHOTS * sizeof(SnapshotRecord) +
+           (total_blocks + 7) / 8 + (static_cast<uint64_t>(max_files) + 7) / 8;
+}
+
+std::vector<char> snapshot_store::empty_area(uint64_t total_blocks, uint32_t max_files) {
+    std::vector<char> area(area_size(total_blocks, max_files), 0);
+    SnapshotAreaHeader hdr = {SNAPSHOT_MAGIC, 0, 1, 0};
+    std::memcpy(area.data(), &hdr, sizeof(hdr));
+    return area;
+}
+
+// Header, records and the given bitmaps, then fdatasync
+int snapshot_store::write_area(const FreeSpaceManager& blocks, const FreeSpaceManager& slots) {
+    std::vector<char> area(sizeof(header) + MAX_SNAPSHOTS * sizeof(SnapshotRecord) +
+                           blocks.byteSize() + slots.byteSize(), 0);
+    char* p = area.data();
+    std::memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    std::memcpy(p, records.data(), records.size() * sizeof(SnapshotRecord));
+    p += MAX_SNAPSHOTS * sizeof(SnapshotRecord);
+    std::memcpy(p, blocks.data(), blocks.byteSize());
+    p += blocks.byteSize();
+    std::memcpy(p, slots.data(), slots.byteSize());
+
+    std::vector<IoRequest> batch{IoRequest::write(area.data(), area.size(), area_offset()), IoRequest::sync()};
+    return io->submit(batch) ? static_cast<int>(OFSErrorCodes::SUCCESS)
+                             : static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+}
+
+// ------------------ Snapshots ------------------
+
+int snapshot_store::create(const std::string& name, uint32_t* id) {
+    if (records.size() >= MAX_SNAPSHOTS) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
+    // Content, inline slots and the bitmap go to disk first, so the
+    // snapshot only ever points at durable state
+    int res = fs->log ? fs->log->checkpoint() : fs_flush(fs);
+    if (res != 0) return res;
+
+    std::vector<char> image;
+    uint32_t entries = 0;
+    write_tree(fs, image, entries);
+
+    const uint64_t bs = fs->header.block_size;
+    uint32_t count = static_cast<uint32_t>((image.size() + bs - 1) / bs);
+    int64_t start = fs->fsm->allocate(count);
+    if (start < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    uint64_t image_bytes = image.size();
+    image.resize(count * bs, 0);
+
+    // Frozen sets are staged: the live ones change only once the area is durable
+    FreeSpaceManager blocks(max_blocks(fs->header));
+    FreeSpaceManager slots(layout_of(fs->header)->max_files);
+    blocks.setBitmap(bits_of(*frozen_blocks));
+    slots.setBitmap(bits_of(*frozen_slots));
+    claim_tree(fs, &blocks, &slots);
+    for (uint32_t k = 0; k < count; ++k) blocks.markUsed(start + k);
+
+    SnapshotRecord rec;
+    std::memset(&rec, 0, sizeof(rec));
+    rec.id = header.next_id;
+    rec.entries = entries;
+    rec.created_time = std::time(nullptr);
+    rec.tree_block = static_cast<uint32_t>(start);
+    rec.tree_blocks = count;
+    rec.tree_bytes = image_bytes;
+    std::string label = name.empty() ? "snap-" + std::to_string(rec.id) : name;
+    std::strncpy(rec.name, label.c_str(), sizeof(rec.name) - 1);
+
+    records.push_back(rec);
+    ++header.count;
+    ++header.next_id;
+
+    // The record is written only after the tree it points at is durable
+    std::vector<IoRequest> batch{IoRequest::write(image.data(), image.size(), start * bs), IoRequest::sync()};
+    if (!io->submit(batch) || write_area(blocks, slots) != 0) {
+        records.pop_back();
+        --header.count;
+        --header.next_id;
+        fs->fsm->free(start, count);
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+    frozen_blocks->setBitmap(bits_of(blocks));
+    frozen_slots->setBitmap(bits_of(slots));
+    *id = rec.id;
+    return static_cast<int>(OFSErrorCodes::SUCCESS);
+}
+
+// The frozen sets are rebuilt from the snapshots that remain. Once the
+// area is durable, what only the dropped one held and the live tree does
+// not use goes back to the allocators, its tree image included.
+int snapshot_store::remove(uint32_t id) {
+    auto it = std::find_if(records.begin(), records.end(), [id](const SnapshotRecord& rec) { return rec.id == id; });
+    if (it == records.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+
+    // Afterwards the stored entries are the live tree
+    int res = fs->log ? fs->log->checkpoint() : fs_flush(fs);
+    if (res != 0) return res;
+
+    FreeSpaceManager blocks(max_blocks(fs->header));
+    FreeSpaceManager slots(layout_of(fs->header)->max_files);
+    for (const SnapshotRecord& rec : records) {
+        if (rec.id == id) continue;
+        FSNode* root = tree(rec.id);
+        if (!root) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        claim_frozen(fs->store, root, &blocks, &slots);
+        for (uint32_t k = 0; k < rec.tree_blocks; ++k) blocks.markUsed(rec.tree_block + k);
+    }
+
+    size_t pos = it - records.begin();
+    SnapshotRecord dropped = *it;
+    records.erase(it);
+    --header.count;
+    if (write_area(blocks, slots) != 0) {
+        records.insert(records.begin() + pos, dropped);
+        ++header.count;
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+    auto loaded = trees.find(id);
+    if (loaded != trees.end()) {
+        delete loaded->second;
+        trees.erase(loaded);
+    }
+
+    FreeSpaceManager live(max_blocks(fs->header));
+    FreeSpaceManager live_slots(layout_of(fs->header)->max_files);
+    fs_walk(fs,
+            [&](FSNode* node) {
+                if (node->entry->getType() == EntryType::FILE) fs->store->claim(node->entry, &live, &live_slots, true);
+            },
+            [&](uint32_t, const MetaSlot& slot) {
+                if (slot.entry.getType() == EntryType::FILE) fs->store->claim(&slot.entry, &live, &live_slots, true);
+            });
+    release(*frozen_blocks, blocks, live, fs->fsm, fs->header.total_size / fs->header.block_size);
+    if (fs->inline_slots)
+        release(*frozen_slots, slots, live_slots, fs->inline_slots, layout_of(fs->header)->max_files);
+    frozen_blocks->setBitmap(bits_of(blocks));
+    frozen_slots->setBitmap(bits_of(slots));
+
+    // The freed blocks reach the on-disk bitmap now, not at some later
+    // checkpoint a crash could pre-empt
+    return fs->log ? fs->log->checkpoint() : fs_flush(fs);
+}
+
+std::vector<SnapshotRecord> snapshot_store::list() const {
+    return records;
+}
+
+const SnapshotRecord* snapshot_store::find(uint32_t id) const {
+    for (const SnapshotRecord& rec : records)
+        if (rec.id == id) return &rec;
+    return nullptr;
+}
+
+// Snapshots never change, so a tree stays loaded once it has been read
+FSNode* snapshot_store::tree(uint32_t id) {
+    auto it = trees.find(id);
+    if (it != trees.end()) return it->second;
+
+    const SnapshotRecord* rec = find(id);
+    if (!rec) return nullptr;
+    const uint64_t bs = fs->header.block_size;
+    std::vector<char> image(rec->tree_blocks * bs);
+    if (!io->read(image.data(), image.size(), rec->tree_block * bs)) return nullptr;
+
+    uint64_t offset = 0;
+    FSNode* root = load_fs_tree(image.data(), offset, rec->tree_bytes);
+    if (root) trees[id] = root;
+    return root;
+}
+
+int snapshot_store::read(uint32_t id, const char* path, uint64_t offset, char* buffer, size_t len, size_t* read) {
+    FSNode* node = tree(id);
+    if (!node) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+
+    std::string p = path ? path : "";
+    if (p.empty() || p[0] != '/') return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    size_t start = 1;
+    while (node && start < p.size()) {
+        size_t end = p.find('/', start);
+        std::string token = p.substr(start, end - start);
+        if (!token.empty()) node = node->getChild(token);
+        if (end == std::string::npos) break;
+        start = end + 1;
+    }
+    if (!node || node->entry->getType() != EntryType::FILE)
+        return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    if (offset > node->entry->size)
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    *read = std::min<uint64_t>(len, node->entry->size - offset);
+    int res = fs->store->read_frozen(node, buffer, offset, *read);
+    if (res != 0) *read = 0;
+    return res;
+}
+
+// ------------------ Frozen blocks and slots ------------------
+
+bool snapshot_store::holds_block(uint64_t block) const {
+    return block / 8 < frozen_blocks->byteSize() && !frozen_blocks->isFree(block);
+}
+
+bool snapshot_store::holds_slot(uint32_t slot) const {
+    return slot / 8 < frozen_slots->byteSize() && !frozen_slots->isFree(slot);
+}
+
+void snapshot_store::claim() {
+    fs->fsm->markUsedFrom(*frozen_blocks);
+    if (fs->inline_slots) fs->inline_slots->markUsedFrom(*frozen_slots);
+}
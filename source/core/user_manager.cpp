@@ -7,8 +7,8 @@
 using namespace std;
 // ===================== Constructor & Destructor =====================
 
-user_manager:: user_manager(HashTable<UserInfo>* user_table)
-    : users(user_table) {}
+user_manager:: user_manager(FSInstance* fs_instance)
+    : fs(fs_instance), users(fs_instance->users) {}
 
 user_manager::~user_manager() {
     for (auto s : active_sessions)
@@ -29,6 +29,14 @@ SessionInfo* user_manager::find_session(void* session) {
     return nullptr;
 }
 
+// Users live in the fixed slot table so they can be persisted (or mapped) in place
+UserInfo* user_manager::free_slot() {
+    for (uint32_t i = 0; i < fs->header.max_users; ++i) {
+        if (!fs->user_slots[i].is_active) return &fs->user_slots[i];
+    }
+    return nullptr;
+}
+
 std::string user_manager::hash_password(const std::string& password) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
     SHA256(reinterpret_cast<const unsigned char*>(password.c_str()), password.size(), hash);
@@ -85,12 +93,17 @@ int user_manager ::user_create(void* admin_session, const char* username, const
     if (!check_admin(admin_session)) return static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED);
     if (users->get(username)) return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
 
+    UserInfo* new_user = free_slot();
+    if (!new_user) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
     std::string hashed = hash_password(password);
-    UserInfo* new_user = new UserInfo(username, hashed, role, std::time(nullptr));
+    *new_user = UserInfo(username, hashed, role, std::time(nullptr));
     if (!users->insert(username, new_user)) {
-        delete new_user;
+        new_user->is_active = 0;
         return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
     }
+    fs_mark_user_dirty(fs, new_user);
+    fs_log_user(fs, new_user);
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
 
@@ -102,6 +115,8 @@ int user_manager::user_delete(void* admin_session, const char* username) {
 
     user->is_active = 0; // mark as inactive
     users->remove(username);
+    fs_mark_user_dirty(fs, user);
+    fs_log_user(fs, user);
 
     return static_cast<int>(OFSErrorCodes::SUCCESS);
 }
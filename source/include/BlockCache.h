@@ -0,0 +1,100 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+using namespace std;
+
+#define CACHE_INVALIDATION_SLOTS 4096   // per-block change stamps kept for fill()
+
+struct BlockCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;     // dirty blocks written to the container
+    uint64_t cached;         // blocks currently held
+    uint64_t capacity;       // frames
+};
+
+// Consecutive blocks handed to the write-back callback
+struct BlockRun {
+    uint32_t start;
+    uint32_t count;
+    const char* data;
+};
+
+// Fixed budget of container blocks kept in memory, evicted with CLOCK.
+// Writes stay in the cache (dirty) until they are evicted or flushed.
+// Frames are block aligned so they can be written with O_DIRECT.
+// Keys above UINT32_MAX hold clean data derived from the container (such
+// as decoded clusters); only container blocks are ever put dirty.
+class BlockCache {
+public:
+    // Writes a batch of runs; used for eviction and flush
+    using WriteBack = function<bool(const vector<BlockRun>& runs)>;
+
+private:
+    struct Frame {
+        uint64_t block;     // container block, or a caller-defined key above UINT32_MAX
+        bool valid;
+        bool referenced;    // second chance bit
+        bool dirty;
+        uint32_t pins;
+    };
+
+    uint32_t blockSize;
+    vector<Frame> frames;
+    char* memory;                               // frames.size() * blockSize, block aligned
+    unordered_map<uint64_t, size_t> index;      // block -> frame
+    size_t hand;
+    WriteBack writeBack;
+    mutex lock;
+    BlockCacheStats counters;
+    uint64_t generation;            // bumped on every change below
+    vector<uint64_t> invalidated;   // block % CACHE_INVALIDATION_SLOTS -> generation of its last
+                                    // put or eviction, so fill() can tell it is stale
+
+    char* slot(size_t frame);
+    void changed(uint64_t block);
+    size_t victim();
+    size_t frameFor(uint64_t block);
+
+public:
+    BlockCache(uint64_t budgetBytes, uint32_t block_size, WriteBack write_back);
+    ~BlockCache();
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    bool enabled() const;
+
+    // Copy a cached block into out. Returns false on a miss.
+    bool get(uint64_t block, char* out);
+    // Insert or replace a block. A dirty block that cannot be cached
+    // (every frame pinned) is written through; false if that write fails.
+    bool put(uint64_t block, const char* data, bool dirty);
+
+    // Read-ahead support: fill() adds a clean block read from the disk
+    // only if it is not cached and was not put or evicted since stamp()
+    // was taken before the read.
+    bool contains(uint64_t block);
+    uint64_t stamp();
+    void fill(uint64_t block, const char* data, uint64_t since);
+
+    // Blocks the caller wrote to the disk around the cache: cached copies
+    // are dropped (pinned ones refreshed from data) and fills from reads
+    // that started earlier are rejected.
+    void discard(uint32_t start, uint32_t count, const char* data);
+
+    // Keep a cached block resident until unpinned. False if not cached.
+    bool pin(uint64_t block);
+    void unpin(uint64_t block);
+
+    // Write every dirty block in one batch, coalescing consecutive blocks.
+    bool flush();
+
+    BlockCacheStats stats();
+};
+
+#endif
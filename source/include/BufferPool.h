@@ -0,0 +1,46 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+#include <vector>
+#include <cstddef>
+#include <mutex>
+using namespace std;
+
+// Fixed-size I/O buffers aligned for O_DIRECT, recycled between requests.
+class BufferPool {
+private:
+    size_t alignment;
+    size_t bufferSize;
+    size_t keep;                // idle buffers held at most
+    vector<char*> idle;
+    mutex lock;
+
+public:
+    BufferPool(size_t alignment, size_t buffer_size, size_t keep_idle);
+    ~BufferPool();
+
+    // A buffer of at least bytes; larger requests get a one-off allocation
+    char* acquire(size_t bytes);
+    void release(char* buf, size_t bytes);
+
+    size_t alignmentOf() const;
+    size_t bufferBytes() const;
+    bool aligned(const void* p) const;
+
+    static char* allocate(size_t alignment, size_t bytes);
+    static void deallocate(char* buf);
+
+    // Returns the buffer to the pool when it goes out of scope
+    class Lease {
+    private:
+        BufferPool* pool;
+        size_t bytes;
+    public:
+        char* data;
+        Lease(BufferPool* p, size_t n) : pool(p), bytes(n), data(p->acquire(n)) {}
+        ~Lease() { pool->release(data, bytes); }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+    };
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef DEDUPINDEX_H
+#define DEDUPINDEX_H
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+using namespace std;
+
+struct DedupStats {
+    uint64_t logical;       // block references held by files
+    uint64_t physical;      // distinct blocks behind them
+};
+
+// Reference counts for content blocks and a fingerprint -> block index of
+// their contents. Fingerprints are only hints: a match must be confirmed
+// by comparing the bytes before a block is shared.
+class DedupIndex {
+private:
+    vector<uint32_t> refs;                          // per container block
+    unordered_map<uint64_t, uint32_t> byPrint;      // fingerprint -> block
+    unordered_map<uint32_t, uint64_t> printOf;      // block -> fingerprint
+    DedupStats counters;
+
+public:
+    explicit DedupIndex(uint64_t total_blocks);
+
+    static uint64_t fingerprint(const char* data, size_t len);
+
+    void ref(uint32_t block);
+    // Drops one reference and returns how many are left. A block nobody
+    // references loses its fingerprint.
+    uint32_t unref(uint32_t block);
+    uint32_t refsOf(uint32_t block) const;
+
+    // Block last recorded with this fingerprint, -1 if none
+    int64_t lookup(uint64_t print) const;
+    void record(uint32_t block, uint64_t print);
+    bool known(uint32_t block) const;
+    // The block's content changed in place
+    void forget(uint32_t block);
+
+    // Drop every reference and fingerprint
+    void clear();
+
+    DedupStats stats() const;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef EXTENTMAP_H
+#define EXTENTMAP_H
+#include <vector>
+#include <cstdint>
+using namespace std;
+
+#define EXTENT_PACKED       0x80000000u     // length flag: the run holds a compressed cluster
+#define CLUSTER_BLOCKS      16              // file blocks in a compressed cluster
+
+// A run of container blocks backing consecutive file blocks. A packed run
+// holds the compressed image of the CLUSTER_BLOCKS file blocks starting at
+// logical (always cluster aligned) in fewer container blocks.
+struct Extent {
+    uint32_t logical;   // first file block covered by the run
+    uint32_t start;     // first container block
+    uint32_t length;    // number of blocks, EXTENT_PACKED if compressed
+
+    bool packed() const { return (length & EXTENT_PACKED) != 0; }
+    uint32_t blocks() const { return length & ~EXTENT_PACKED; }             // container blocks
+    uint32_t span() const { return packed() ? CLUSTER_BLOCKS : length; }    // file blocks
+};
+
+class ExtentMap {
+private:
+    vector<Extent> extents;   // sorted by logical, non-overlapping
+    Extent reservation;       // preallocated run, length 0 if none
+
+public:
+    ExtentMap();
+
+    // Index of the first extent that ends after the given file block.
+    size_t lowerBound(uint32_t logical) const;
+    // Extent covering the given file block, or nullptr for a hole.
+    const Extent* find(uint32_t logical) const;
+    // Add a run, merging it with its neighbours when they are contiguous.
+    void insert(const Extent& e);
+    // Unmap file blocks [logical, logical + count), splitting runs that
+    // straddle it. Packed runs are never split: one that overlaps goes whole.
+    void remove(uint32_t logical, uint32_t count);
+    // Drops the reservation too
+    void clear();
+
+    // Container blocks set aside for file blocks not written yet: file
+    // block reservation.logical + k goes to reservation.start + k. Kept
+    // out of list(), the blocks hold no data.
+    const Extent& reserved() const;
+    void reserve(const Extent& e);
+
+    // On-disk form: list() followed by the reservation, if any
+    vector<Extent> stored() const;
+    void restore(const vector<Extent>& runs, bool with_reservation);
+
+    const vector<Extent>& list() const;
+    size_t size() const;
+    uint64_t blockCount() const;    // container blocks
+};
+
+#endif
@@ -5,15 +5,34 @@
 #include <vector>
 #include <iostream>
 #include "LinkedList.h"
+#include "ExtentMap.h"
 #include "odf_types.hpp"
 
+class FSNode;
+
+// Reads a directory's children from the container the first time they are
+// needed (lazy loading)
+class FSNodeLoader {
+public:
+    virtual ~FSNodeLoader() = default;
+    virtual void loadChildren(FSNode* dir) = 0;
+};
+
 class FSNode {
+private:
+    static uint64_t use_clock;
+
+    void ensureLoaded() const;
 
 public:
-    FileEntry* entry;
-    std::vector<char> data;
+    FileEntry* entry;          // content lives in the container, see block_store
+    ExtentMap* extents;        // loaded from the entry on first content access
     LinkedList<FSNode*>* children;
     FSNode* parent;
+    uint32_t meta_index;       // slot in the metadata index, 0 until assigned
+    bool dirty;                // entry changed since the last flush
+    mutable FSNodeLoader* loader;   // set while the children are not read yet
+    mutable uint64_t last_used;     // use_clock at the last child lookup
 
     FSNode(FileEntry* e, FSNode* p = nullptr);
     ~FSNode();
@@ -30,6 +49,11 @@ public:
     vector<FSNode*> getChildren() const;
     FSNode* find_node_by_path(const string& path);
 
+    bool childrenLoaded() const { return loader == nullptr; }
+    // Drop the children (which must be clean) until the next lookup reads
+    // them again through loader. Returns how many nodes were freed.
+    uint64_t unloadChildren(FSNodeLoader* from);
+
 
 
     void print() const;
@@ -5,22 +5,81 @@
 #include <cstdint>
 using namespace std;
 
+#define SUMMARY_GROUP_BLOCKS    4096    // 64 bitmap words per summary group
+
 class FreeSpaceManager {
 private:
     uint64_t totalBlocks;
-    vector<uint8_t> bitmap; 
+    uint64_t freeBlocks;
+    uint64_t heldBlocks;        // free blocks promised to later allocations
+    vector<uint8_t> bitmap;     // owned storage, unused once a bitmap is attached
+    uint8_t* bits;              // bitmap in use: owned storage or attached memory
+    vector<uint64_t> dirtyWords;    // 64-bit bitmap words changed since clearDirty()
+    vector<uint8_t> wordDirty;
+
+    // Summary for the free-run search. Blocks are grouped by
+    // SUMMARY_GROUP_BLOCKS; each group keeps one "any free" bit per bitmap
+    // word, and a tree over the groups keeps, per subtree, the free run at
+    // either end and the longest free run inside. Groups changed since the
+    // last search are re-summarized on the next one.
+    struct RunSummary {
+        uint64_t prefix;        // free blocks at the start
+        uint64_t suffix;        // free blocks at the end
+        uint64_t longest;       // longest free run
+        uint64_t length;        // blocks covered
+    };
+    mutable vector<uint64_t> wordHasFree;   // per group, bit k = word k has a free block
+    mutable vector<RunSummary> tree;        // heap order, leaves at [leaves, 2 * leaves)
+    uint64_t leaves;
+    mutable vector<uint8_t> groupStale;
+    mutable vector<uint64_t> staleGroups;
+
+    void touch(uint64_t blockIndex);
+    void recount();
+    void markStale(uint64_t blockIndex);
+    uint64_t freeMask(uint64_t word) const;     // bit set = block free
+    void summarizeGroup(uint64_t group) const;
+    void refreshSummary() const;
+    void rebuildSummary();
+    int64_t scanGroup(uint64_t group, uint64_t N) const;
+    static RunSummary combine(const RunSummary& left, const RunSummary& right);
     
 public:
     FreeSpaceManager(uint64_t total_blocks);
     void markUsed(uint64_t blockIndex);
     void markFree(uint64_t blockIndex);
     bool isFree(uint64_t blockIndex) const;
+    // First run of N free blocks, -1 if there is none. Descends the
+    // summary tree, so full regions are skipped: O(log groups) plus one
+    // group scan.
     int64_t findFreeBlocks(uint64_t N);
     void printBitmap() const;
+    // Fails while fewer than N free blocks are left outside the held ones
     int64_t allocate(uint64_t N);
     void free(uint64_t start, uint64_t N);
+    // Set aside N free blocks, wherever they are, for an allocation that
+    // comes later; false if fewer than N are free and unheld. The holder
+    // releases the hold right before it allocates.
+    bool hold(uint64_t N);
+    void releaseHold(uint64_t N);
+    // Mark used every block other has used, a word at a time. Blocks past
+    // the end of either map are left alone.
+    void markUsedFrom(const FreeSpaceManager& other);
+    // Number of maximal free runs; the longest goes to largest if given
+    uint64_t freeRuns(uint64_t* largest = nullptr) const;
+    uint64_t freeCount() const;
+    // Extend to total_blocks; the new blocks start free. Attached memory must
+    // already be large enough.
+    void grow(uint64_t total_blocks);
    void setBitmap(const std::vector<uint8_t>& b);
-   const vector<uint8_t>& getBitmap() const;
+   // Operate in place on caller-owned memory (e.g. a mapped container region)
+   void attachBitmap(uint8_t* external);
+   const uint8_t* data() const;
+   uint64_t byteSize() const;
+
+   const vector<uint64_t>& getDirtyWords() const;
+   void clearDirty();
+   void markAllDirty();
 };
 
 #endif
\ No newline at end of file
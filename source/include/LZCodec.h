@@ -0,0 +1,27 @@
+#ifndef LZCODEC_H
+#define LZCODEC_H
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+// Byte-oriented LZ77 in the LZ4 block layout. The input is a series of
+// sequences:
+//   token        literal count << 4 | (match length - MIN_MATCH)
+//   [lengths]    extra literal count bytes when the nibble is 15
+//   literals
+//   offset       2 bytes little endian, back into the output
+//   [lengths]    extra match length bytes when the nibble is 15
+// Extra length bytes add up until one is below 255. The last sequence
+// has literals only and ends the input.
+class LZCodec {
+public:
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 0xFFFF;
+
+    // Bytes written to out, or 0 if the result would exceed capacity
+    static size_t compress(const char* in, size_t len, char* out, size_t capacity);
+    // False unless in decodes to exactly len bytes
+    static bool decompress(const char* in, size_t in_len, char* out, size_t len);
+};
+
+#endif
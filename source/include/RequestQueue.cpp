@@ -19,7 +19,7 @@ RequestQueue::~RequestQueue() {
 }
 
 void RequestQueue::push(int client_sock, const std::string& request_str) {
-    Request* node = new Request{client_sock, request_str, nullptr};
+    Request* node = new Request{client_sock, request_str, std::time(nullptr), nullptr};
 
     std::lock_guard<std::mutex> lock(rq_mutex);
     if (!tail) {
@@ -46,3 +46,8 @@ Request RequestQueue::pop() {
     delete old;
     return node_copy;
 }
+
+bool RequestQueue::empty() {
+    std::lock_guard<std::mutex> lock(rq_mutex);
+    return head == nullptr;
+}
@@ -2,10 +2,12 @@
 #define REQUEST_QUEUE_H
 
 #include <string>
+#include <ctime>
 
 struct Request {
     int client_sock;
     std::string request; // the raw request string
+    time_t enqueued;     // push time, for the queue timeout
     Request* next;
 };
 
@@ -26,6 +28,9 @@ public:
 
     // Pop next request (blocks until available). Caller owns returned Request (by value).
     Request pop();
+
+    // True when nothing is waiting (thread-safe)
+    bool empty();
 };
 
 #endif // REQUEST_QUEUE_H
@@ -0,0 +1,262 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <vector>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "fs_core.h"
+#include "ExtentMap.h"
+#include "BlockCache.h"
+#include "read_ahead.h"
+#include "io_backend.h"
+#include "BufferPool.h"
+#include "DedupIndex.h"
+#include "LZCodec.h"
+
+#define LAYOUT_EMPTY    0
+#define LAYOUT_EXTENTS  1
+#define LAYOUT_INLINE   2
+#define INLINE_EXTENTS  3
+
+#define CONTENT_RESERVED 0x01   // ContentRef flag: the last stored run is the file's reservation
+
+// Runs longer than this bypass the cache and go straight to the container
+#define WRITE_BACK_MAX_BLOCKS 16
+// Delayed blocks held in memory at most; a write past this places them all
+#define DELAYED_MAX_BLOCKS 2048
+
+/**
+ * Location of a file's content, stored in FileEntry::reserved.
+ * The first INLINE_EXTENTS runs live here; the rest spill into a chain
+ * of overflow extent blocks.
+ *
+ * An inline file has no extents: overflow_block is its slot in the
+ * container's inline area instead.
+ *
+ * With CONTENT_RESERVED set, the last run (inline or in the chain) is the
+ * preallocated run of ExtentMap::reserved() rather than mapped content.
+ */
+struct ContentRef {
+    uint8_t  layout;                        // LAYOUT_*
+    uint8_t  flags;
+    uint16_t extent_count;                  // inline + overflow runs
+    uint32_t overflow_block;                // first overflow extent block, 0 if none (inline slot for LAYOUT_INLINE)
+    Extent   inline_extents[INLINE_EXTENTS];
+};
+static_assert(sizeof(ContentRef) <= sizeof(FileEntry::reserved), "content ref must fit in FileEntry::reserved");
+
+// A file block moved onto an identical block by deduplication
+struct DedupRemap {
+    uint32_t logical;
+    uint32_t target;    // block it shares now
+    uint32_t old;       // block it gave up
+};
+
+#define PACKED_MAGIC    0x4B435A4C      // "LZCK"
+
+// Start of the first block of a packed run, followed by the LZCodec output.
+// Blocks of the cluster past raw_length read as zeros.
+struct PackedHeader {
+    uint32_t magic;
+    uint32_t raw_length;        // cluster bytes that were compressed
+    uint32_t packed_length;     // codec output bytes
+    uint32_t reserved;
+};
+
+struct CompressionStats {
+    uint64_t logical;       // file blocks held in packed runs
+    uint64_t stored;        // container blocks those runs take
+};
+
+struct FragmentationStats {
+    uint64_t files;         // files stored in blocks
+    uint64_t fragments;     // physically contiguous pieces of those files
+};
+
+// Blocks one defragment() call moves at most
+#define DEFRAG_STEP_BLOCKS 256
+
+// Header of an overflow extent block, followed by an array of Extent.
+struct ExtentBlockHeader {
+    uint32_t next;      // next overflow block, 0 if last
+    uint32_t count;     // extents stored in this block
+};
+
+/**
+ * File content storage in the Content Block Area.
+ *
+ * A file is a sorted list of extents (file block -> run of container
+ * blocks), so reads and writes turn into one positioned I/O per run and
+ * seeking to an offset is a binary search over the runs.
+ *
+ * All block I/O goes through a BlockCache sized by the config's
+ * cache_size; small writes stay dirty in it until flush(). Sequential
+ * reads of a file are prefetched into it by read_ahead. With direct_io
+ * the container is opened O_DIRECT and all transfers use aligned memory.
+ *
+ * Files that fit in an inline slot are kept in the inline area next to the
+ * metadata and need no block I/O; one that outgrows its slot is moved to
+ * blocks on the write that makes it too large.
+ *
+ * With dedup enabled every written block is fingerprinted; a block whose
+ * bytes already exist elsewhere is mapped to that block instead of being
+ * stored again. Shared blocks are reference counted and copied on write.
+ *
+ * With compression enabled, writes go through clusters of CLUSTER_BLOCKS
+ * file blocks. A cluster that LZCodec shrinks by at least one block is
+ * stored as a packed run; reads decompress it into the block cache, under
+ * keys outside the container's block range, so later reads of the same
+ * cluster skip both the I/O and the decoding.
+ *
+ * Blocks and inline slots a snapshot references are never written in
+ * place: writes copy them like shared dedup blocks.
+ *
+ * defragment() moves plain runs of a file next to each other; packed runs,
+ * shared and frozen blocks stay where they are.
+ *
+ * With delayed_alloc, the part of a write past the last mapped block of
+ * its range is kept in memory, with no container blocks chosen yet.
+ * allocate_delayed() runs before every change log commit and flush: by
+ * then the file's size for the batch is known, and each file's delayed
+ * blocks get one contiguous run, or the fewest runs free space allows.
+ * The blocks are held in the free space manager from the write on, so
+ * other allocations cannot take the space they will need.
+ */
+class block_store {
+private:
+    FSInstance* fs;
+    io_backend* io;
+    BufferPool* pool;               // block aligned staging buffers
+    BlockCache* cache;
+    read_ahead* prefetch;           // null when the cache is disabled
+    DedupIndex* dedup;              // null unless the config enables dedup
+
+    // Delayed allocation: file block -> block image, per file
+    unordered_map<FSNode*, std::map<uint32_t, vector<char>>> delayed;
+    uint64_t delayed_count;         // blocks across all files
+
+    // Compression and fragmentation over every stored file: counted on the
+    // first request, then kept current by save_extents
+    bool totals_ready;
+    CompressionStats packed_total;
+    FragmentationStats fragment_total;
+
+    bool submit(vector<IoRequest>& batch);
+    bool write_disk(uint32_t start, uint32_t count, const char* buf);
+    bool write_runs(const vector<BlockRun>& runs);
+    bool read_blocks(uint32_t start, uint32_t count, char* buf, uint32_t* hits = nullptr);
+    bool read_runs(const vector<pair<uint32_t, uint32_t>>& runs, char* buf, uint32_t* hits);
+    bool write_blocks(uint32_t start, uint32_t count, const char* buf);
+
+    uint32_t extents_per_block() const;
+    ExtentMap* extents_of(FSNode* node);
+    void load_extents(const FileEntry* entry, ExtentMap& map, std::vector<uint32_t>* chain);
+    std::vector<uint32_t> overflow_chain(const FileEntry* entry);
+    int map_range(FSNode* node, uint32_t first, uint32_t last, vector<bool>& fresh);
+
+    uint8_t* inline_data(const FileEntry* entry);
+    int write_inline(FSNode* node, const char* data, uint64_t len, uint64_t offset);
+    int promote(FSNode* node);
+    int write_extents(FSNode* node, const char* data, uint64_t len, uint64_t offset);
+    uint64_t write_delayed(FSNode* node, const char* data, uint64_t len, uint64_t offset);
+    bool has_delayed(FSNode* node, uint32_t first, uint32_t last) const;
+    int allocate_delayed(FSNode* node);
+
+    void release_blocks(uint32_t start, uint32_t count);
+    bool unshare(FSNode* node, uint32_t first, uint32_t last, bool head_partial, bool tail_partial,
+                 unordered_map<uint32_t, uint32_t>& cow, vector<uint32_t>& orphaned);
+    int64_t find_duplicate(const char* block, uint64_t print, uint32_t self,
+                           const unordered_set<uint32_t>& unwritten);
+    bool write_deduped(uint32_t logical, uint32_t start, uint32_t count, const char* buf,
+                       unordered_set<uint32_t>& unwritten, vector<DedupRemap>& remaps);
+
+    int read_content(FSNode* node, char* out, uint64_t offset, uint64_t len, bool observe);
+    bool read_packed(const Extent& e, char* out, uint64_t offset, uint64_t len, uint32_t* hits, uint32_t* loaded);
+    bool decode_cluster(const char* stored, size_t stored_len, char* cluster);
+    int write_packed(FSNode* node, const char* data, uint64_t len, uint64_t offset);
+    int unpack_range(FSNode* node, uint32_t first, uint32_t last);
+    void drop_cluster(FSNode* node, uint32_t first);
+    static uint32_t pieces(const vector<Extent>& list);
+    void count_runs(const vector<Extent>& list, bool add);
+    void count_totals();
+    void claim(const FileEntry* entry, const ExtentMap* map, FreeSpaceManager* blocks, FreeSpaceManager* slots,
+               bool reservation);
+    bool movable(const Extent& e);
+    static uint64_t decoded_key(uint32_t start, uint32_t index);
+
+public:
+    explicit block_store(FSInstance* fs_instance);
+    ~block_store();
+
+    bool is_open() const;
+
+    // Copy len bytes starting at offset into out. Caller keeps offset + len <= entry->size.
+    int read(FSNode* node, char* out, uint64_t offset, uint64_t len);
+    // Same for a node of a snapshot tree; kept out of read-ahead, which
+    // tracks files by inode
+    int read_frozen(FSNode* node, char* out, uint64_t offset, uint64_t len);
+
+    // Write len bytes at offset, allocating runs as needed. An offset past
+    // entry->size leaves a hole that takes no blocks and reads as zeros.
+    int write(FSNode* node, const char* data, uint64_t len, uint64_t offset);
+    // False if [offset, offset + len) overflows or ends past the last file
+    // block the container could hold; write() rejects such ranges.
+    bool in_range(uint64_t offset, uint64_t len) const;
+
+    // Return every block of the file to the free space manager.
+    void release(FSNode* node);
+
+    // Set aside one contiguous run for the file blocks below size that
+    // follow its last mapped block, replacing any earlier reservation.
+    // Writes into that range take the reserved blocks front to back.
+    // NO_SPACE if no free run is long enough.
+    int reserve(FSNode* node, uint64_t size);
+
+    // Store the in-memory extent map into the entry and a new overflow chain.
+    int save_extents(FSNode* node);
+
+    // Blocks the file owns: mapped and reserved runs plus overflow extent
+    // blocks. Zero for inline files.
+    uint64_t blocks_used(FSNode* node);
+
+    // Mark every block the file owns (runs, reservation and overflow
+    // chain), or its inline slot, as used.
+    void claim(FSNode* node);
+    // Same without the reservation, into other maps (slots may be null)
+    void claim(FSNode* node, FreeSpaceManager* blocks, FreeSpaceManager* slots);
+    // Same for an entry of the metadata index that is not loaded
+    void claim(const FileEntry* entry, FreeSpaceManager* blocks, FreeSpaceManager* slots, bool reservation);
+
+    // Write back dirty cached blocks. False if any write failed.
+    bool flush();
+
+    // Place every delayed block and log the files it was placed for.
+    // Caller holds state_mutex.
+    int allocate_delayed();
+    // Written data of node still waiting for blocks
+    bool has_delayed(FSNode* node) const;
+
+    BlockCacheStats cache_stats();
+    DedupStats dedup_stats();
+    CompressionStats compression_stats();
+    FragmentationStats fragmentation_stats();
+
+    // Physically contiguous pieces the file's blocks form, 0 for inline
+    // and empty files
+    uint32_t fragments(FSNode* node);
+    // Copy the first stretch of consecutive runs (at most DEFRAG_STEP_BLOCKS
+    // blocks) that is split on disk into one contiguous run. moved is false
+    // when no stretch could be merged. Caller holds state_mutex.
+    int defragment(FSNode* node, bool* moved);
+
+    // Recount block references from the tree, loaded or not (dedup only)
+    void rebuild_refs();
+
+    static ContentRef content_ref(const FileEntry* entry);
+    static void set_content_ref(FileEntry* entry, const ContentRef& ref);
+    static bool is_inline(const FileEntry* entry);
+};
+
+#endif // BLOCK_STORE_H
@@ -0,0 +1,116 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "fs_core.h"
+#include "io_backend.h"
+
+#define LOG_RECORD_MAGIC        0x474F4C4F      // "OLOG"
+#define LOG_BATCH_BYTES         (256 * 1024)    // commit early once a batch grows this large
+#define CHECKPOINT_LOG_PERCENT  50              // background checkpoint once the log is this full
+
+enum class LogRecordType : uint16_t {
+    ENTRY_PUT    = 1,   // parent inode, FileEntry image, overflow extents, inline content
+    ENTRY_REMOVE = 2,   // inode
+    USER_PUT     = 3,   // user slot index, UserInfo image
+    WRAP         = 4    // no payload, the next record is at the start of the region
+};
+
+// Every record in the change_log region starts with this header.
+struct LogRecordHeader {
+    uint32_t magic;
+    uint32_t crc;       // CRC-32 of the payload
+    uint64_t lsn;       // consecutive, starting after layout->checkpoint_lsn
+    uint32_t epoch;     // layout->log_epoch when written
+    uint32_t length;    // payload bytes
+    uint16_t type;      // LogRecordType
+    uint16_t reserved;
+};
+
+/**
+ * Write-ahead log in the container's change_log region.
+ *
+ * Managers append a redo record for every completed mutation. Records are
+ * buffered and written with a single fdatasync per batch (group commit);
+ * the same fdatasync also makes the content blocks written by the batch
+ * durable, since they live in the same file.
+ *
+ * The region is circular. A checkpoint writes the dirty metadata regions
+ * and moves the tail past every record they now cover. Records carry
+ * after-images keyed by inode, so replaying them on top of the last
+ * checkpoint is idempotent.
+ */
+class change_log {
+private:
+    FSInstance* fs;
+    io_backend* io;
+    uint32_t epoch;
+    uint64_t next_lsn;
+
+    // Positions inside the region
+    uint64_t head;                  // where batch[0] goes
+    uint64_t cursor;                // where the next record goes
+    size_t wrap_at;                 // batch bytes before the wrap to offset 0
+    std::vector<char> batch;        // records not yet written
+
+    std::mutex space_mutex;         // tail and used, shared with the checkpointer
+    uint64_t tail;
+    uint64_t used;                  // bytes from tail to cursor, wrap padding included
+    uint64_t durable_lsn;           // checkpoint_lsn in the on-disk header
+
+    std::vector<std::pair<uint64_t, uint64_t>> held_frees;     // (start, count)
+    std::vector<uint32_t> held_slots;                           // inline slots
+
+    std::mutex checkpoint_mutex;    // one checkpoint at a time, taken after state_mutex
+    bool snapshot_lost;             // last checkpoint failed after clearing dirty state
+
+    std::thread checkpointer;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping;
+    bool requested;
+
+    void append(LogRecordType type, const std::vector<char>& payload);
+    void release_held();
+    void request_checkpoint();
+    void checkpointer_loop();
+    uint64_t region_offset() const;
+    uint64_t region_size() const;
+
+public:
+    explicit change_log(FSInstance* fs_instance);
+    ~change_log();
+
+    bool is_open() const;
+
+    void log_entry(FSNode* node);
+    void log_remove(FSNode* node);
+    void log_user(const UserInfo* user);
+
+    void hold_free(uint64_t start, uint64_t count);
+    void hold_inline_free(uint32_t slot);
+
+    // True while records are waiting for commit()
+    bool pending() const;
+
+    // Write the batch and fdatasync the container
+    int commit();
+
+    // Fold the log into the metadata regions. The caller either holds
+    // state_mutex, or passes background = true and the checkpoint takes it
+    // just long enough to copy the dirty state.
+    int checkpoint(bool background = false);
+
+    // Periodic and log-size triggered background checkpoints
+    void start_checkpointer();
+    void stop_checkpointer();
+
+    // Replay records written after the last checkpoint, then checkpoint
+    int recover();
+};
+
+#endif // CHANGE_LOG_H
@@ -0,0 +1,66 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <cstdint>
+
+#define DEFAULT_TOTAL_SIZE      (50ULL * 1024 * 1024)
+#define DEFAULT_BLOCK_SIZE      4096
+#define DEFAULT_MAX_FILES       1000
+#define DEFAULT_MAX_USERS       1024
+#define DEFAULT_CACHE_SIZE      (16ULL * 1024 * 1024)
+#define DEFAULT_CHECKPOINT_SEC  30      // background checkpoint at least this often
+#define DEFAULT_PORT            8080
+#define DEFAULT_MAX_CONN        10
+#define DEFAULT_BUFFER_SIZE     8192
+#define CONFIG_HASH_LEN         64      // hex SHA-256, fills OMNIHeader::config_hash
+
+/**
+ * Settings from a .uconf file: "key = value" lines under [section] headers,
+ * '#' starting a comment and string values optionally in double quotes.
+ * Unknown keys are ignored. Keys the file leaves out keep the defaults
+ * below.
+ *
+ * Format-time keys (total_size, max_size, block_size, max_files,
+ * max_users, the admin account) shape a new container and are ignored
+ * when an existing one is opened; the rest apply on every start, except
+ * that dedup cannot be turned off again for a container that used it.
+ */
+struct OFSConfig {
+    // [filesystem]
+    uint64_t total_size = DEFAULT_TOTAL_SIZE;
+    uint64_t max_size = 0;              // growth limit, 0 = total_size
+    bool preallocate = false;
+    uint64_t block_size = DEFAULT_BLOCK_SIZE;
+    uint32_t max_files = DEFAULT_MAX_FILES;
+    uint64_t cache_size = DEFAULT_CACHE_SIZE;  // block cache budget, 0 disables it
+    uint32_t prefetch_workers = 1;      // read-ahead threads, 0 disables read-ahead
+    uint32_t checkpoint_interval = DEFAULT_CHECKPOINT_SEC;
+    bool direct_io = false;
+    bool dedup = false;
+    bool compression = false;
+    bool defrag = false;
+    bool delayed_alloc = true;
+    bool lazy_load = false;
+    uint64_t max_loaded_entries = 0;
+
+    // [security]
+    uint32_t max_users = DEFAULT_MAX_USERS;
+    std::string admin_username = "admin";
+    std::string admin_password = "admin123";
+
+    // [server]
+    uint32_t port = DEFAULT_PORT;
+    uint32_t max_connections = DEFAULT_MAX_CONN;
+    uint32_t queue_timeout = 0;         // seconds a request may wait, 0 = no limit
+    uint32_t buffer_size = DEFAULT_BUFFER_SIZE;
+
+    std::string hash;                   // SHA-256 of the file, empty without one
+};
+
+// Parse path into config. ERROR_IO_ERROR if the file cannot be read (config
+// keeps the defaults), ERROR_INVALID_CONFIG if a value is malformed or out
+// of range.
+int config_load(const char* path, OFSConfig* config);
+
+#endif // CONFIG_H
@@ -0,0 +1,47 @@
+#ifndef DEFRAGMENTER_H
+#define DEFRAGMENTER_H
+
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_set>
+#include "fs_core.h"
+
+#define DEFRAG_PAUSE_MS     50      // between two steps
+#define DEFRAG_IDLE_SEC     60      // rescan interval once nothing is left to merge
+
+/**
+ * Background compaction of fragmented files.
+ *
+ * Each step takes state_mutex only if no request holds it, picks the file
+ * split into the most pieces and merges one stretch of it (at most
+ * DEFRAG_STEP_BLOCKS blocks) into a contiguous run through
+ * block_store::defragment. The move is logged and committed like any other
+ * change, so the old blocks are reused only once the new map is durable.
+ * Steps are short and spaced DEFRAG_PAUSE_MS apart, so foreground requests
+ * never wait behind more than one of them.
+ */
+class defragmenter {
+private:
+    FSInstance* fs;
+    std::unordered_set<uint32_t> stuck;     // inodes with nothing movable, retried after idling
+
+    std::thread worker;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    FSNode* pick(FSNode* node, uint32_t& most);
+    bool step();
+    void worker_loop();
+
+public:
+    explicit defragmenter(FSInstance* fs_instance);
+    ~defragmenter();
+
+    void start();
+    void stop();
+};
+
+#endif // DEFRAGMENTER_H
@@ -6,11 +6,13 @@
 #include "FSNode.h"
 #include "user_manager.h"
 #include "odf_types.hpp"
+#include "fs_core.h"
 
 using namespace std;
 
 class dir_manager {
 private:
+    FSInstance* fs;
     FSNode* root;
     user_manager* um;
 
@@ -20,7 +22,7 @@ private:
     
 
 public:
-    dir_manager(FSNode* root_node, user_manager* user_mgr);
+    dir_manager(FSInstance* fs_instance, user_manager* user_mgr);
 
     int dir_create(void* session, const char* path);
     int dir_list(void* session, const char* path, FileEntry** entries, int* count);
@@ -21,11 +21,17 @@ public:
     explicit file_manager(FSInstance* fs, user_manager* user_mgr);
     ~file_manager();
 
-    int file_create(void* session, const char* path, const char* data, size_t size);
+    // size_hint > size reserves contiguous space for the rest of the upload
+    int file_create(void* session, const char* path, const char* data, size_t size, uint64_t size_hint = 0);
     int file_read(void* session, const char* path, char** buffer, size_t* size);
-    int file_edit(void* session, const char* path, const char* data, size_t size, uint index);
+    // Up to len bytes from offset into buffer; *read is 0 at end of file
+    int file_read_at(void* session, const char* path, uint64_t offset, char* buffer, size_t len, size_t* read);
+    int file_edit(void* session, const char* path, const char* data, size_t size, uint64_t index);
     int file_delete(void* session, const char* path);
     int file_truncate(void* session, const char* path);
+    // Reserve one contiguous run for the file up to size bytes; the file
+    // size itself does not change
+    int file_fallocate(void* session, const char* path, uint64_t size);
     int file_exists(void* session, const char* path);
     int file_rename(void* session, const char* old_path, const char* new_path);
 
@@ -3,25 +3,215 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
+#include <functional>
 #include "odf_types.hpp"
 #include "HashTable.h"
 #include "FSNode.h"
 #include "FreeSpaceManager.h"
+#include "config.h"
 
 using namespace std;
+
+#define OMNI_FORMAT_VERSION 0x00010002
+#define DEFAULT_LOG_SIZE    (4ULL * 1024 * 1024)
+#define INLINE_SLOT_SIZE    512                     // files up to this size live in the inline area
+
+class block_store;
+class change_log;
+class snapshot_store;
+class defragmenter;
+
+/**
+ * Container layout, stored in OMNIHeader::reserved.
+ *
+ *   [0]              OMNIHeader
+ *   [user_table]     UserInfo x max_users
+ *   [meta_offset]    metadata index, MetaSlot x (max_files + 1)
+ *   [bitmap_offset]  free space bitmap (one bit per block, sized for max_size)
+ *   [inline_offset]  inline content, max_files slots of inline_slot_size bytes
+ *   [file_state]     snapshot table and frozen block bitmaps, see snapshot_store
+ *   [change_log]     write-ahead log (log_size bytes, block aligned)
+ *   [content]        content blocks, block i lives at byte i * block_size
+ *
+ * Everything before the content area is marked used in the bitmap,
+ * so block index 0 is never handed out and can mean "no block". The content
+ * area is the end of the file, so the container grows by extending it up
+ * to the capacity the bitmap was sized for at format time.
+ */
+struct OMNILayout {
+    uint64_t meta_offset;
+    uint64_t meta_size;
+    uint64_t bitmap_offset;
+    uint64_t bitmap_size;       // one bit per block up to the growth limit
+    uint32_t max_files;
+    uint32_t next_inode;
+    uint64_t log_size;          // 0 when the container has no change log
+    uint64_t checkpoint_lsn;    // last log record already reflected in the metadata regions
+    uint64_t log_tail;          // offset in the log of the record after checkpoint_lsn
+    uint32_t log_epoch;         // bumped on every open, older records are ignored
+    uint64_t inline_offset;
+    uint32_t inline_slot_size;  // 0 when the container has no inline area
+    uint32_t features;          // CONTAINER_* settings the stored content depends on
+};
+static_assert(sizeof(OMNILayout) <= sizeof(OMNIHeader::reserved), "layout must fit in header reserved area");
+
+// Set on the first open with dedup and never cleared: files may share
+// blocks, which are only safe to free or overwrite while reference counted
+#define CONTAINER_DEDUP     0x01
+
+#define META_SLOT_USED      0x01
+#define META_ROOT_INDEX     1
+
+/**
+ * One entry of the metadata index area. Entry index i (1-based, the root is
+ * META_ROOT_INDEX) lives at meta_offset + (i - 1) * sizeof(MetaSlot); 0
+ * means "none". A directory's children are a list threaded through
+ * next_sibling, so adding, removing or moving an entry rewrites only the
+ * slots whose links change.
+ */
+struct MetaSlot {
+    FileEntry entry;
+    uint32_t parent;            // entry index of the parent, 0 for the root
+    uint32_t first_child;       // directories only
+    uint32_t next_sibling;
+    uint32_t flags;             // META_SLOT_USED
+};
+
+inline OMNILayout* layout_of(OMNIHeader& header) {
+    return reinterpret_cast<OMNILayout*>(header.reserved);
+}
+
+// Blocks the container can grow to without a reformat
+inline uint64_t max_blocks(OMNIHeader& header) {
+    return layout_of(header)->bitmap_size * 8;
+}
+
 struct FSInstance {
     std::string omni_path;
     OMNIHeader header;
+    UserInfo* user_slots;           // max_users slots, the users table points into these
     HashTable<UserInfo>* users;
     FSNode* root;
     FreeSpaceManager* fsm;
+    block_store* store;
+    change_log* log;                // null when the container has no change log
+    snapshot_store* snapshots;      // null when the container has no file_state area
+    defragmenter* defrag_worker;    // null unless defrag is set
     vector<void*> sessions;
-    uint next_file_index; 
+    uint next_file_index;
+    uint64_t cache_bytes;           // block cache budget, 0 disables the cache
+    bool direct_io;                 // content blocks bypass the kernel page cache
+    bool dedup;                     // identical content blocks are stored once; stays set for CONTAINER_DEDUP
+    bool compression;               // content is stored in compressed clusters
+    bool defrag;                    // fragmented files are compacted in the background
+    bool delayed_alloc;             // blocks are chosen at commit or flush, not per write
+    uint32_t prefetch_workers;      // read-ahead threads, 0 disables read-ahead
+    uint32_t checkpoint_interval;   // seconds between background checkpoints
+
+    // Lazy mode: directories are read from the metadata index on first use,
+    // and cold ones are dropped again once more than max_loaded entries
+    // are in memory (0 = no limit)
+    bool lazy_load;
+    uint64_t max_loaded;
+    uint64_t loaded_entries;        // FSNodes in the live tree
+    FSNodeLoader* loader;           // null unless lazy_load
+
+    // Mapped mode: header, user table, metadata area and bitmap are used in
+    // place from a shared mapping of the container's metadata regions.
+    uint8_t* map_base;
+    size_t map_length;
+
+    // Content of inline files, slot i at inline_area + i * inline_slot_size.
+    // Points into the mapping in mapped mode; null without an inline area.
+    uint8_t* inline_area;
+    FreeSpaceManager* inline_slots;     // rebuilt from the tree on open
+
+    // Held by whoever changes the tree, users or bitmap while a background
+    // checkpoint may be taking a snapshot
+    std::mutex state_mutex;
+
+    FreeSpaceManager* meta_slots;   // metadata index slots in use, rebuilt from the tree on open
+
+    // Regions changed since the last snapshot
+    bool tree_dirty;                // rewrite the whole metadata index
+    vector<FSNode*> dirty_nodes;    // slots to rewrite
+    vector<uint32_t> freed_meta;    // slots to clear
+    vector<uint32_t> dirty_users;   // user slot indices
+    vector<uint32_t> dirty_inline;  // inline slot indices
 };
 
+void fs_mark_node_dirty(FSInstance* fs, FSNode* node);
+void fs_mark_tree_dirty(FSInstance* fs);
+void fs_mark_user_dirty(FSInstance* fs, const UserInfo* user);
+void fs_mark_inline_dirty(FSInstance* fs, uint32_t slot);
+void fs_mark_all_dirty(FSInstance* fs);
+
+// Metadata index links. fs_link_node runs after a node is added to its
+// parent: it gives the node a slot if it has none (ERROR_NO_SPACE when the
+// index is full) and marks the slots whose links change. fs_unlink_node
+// runs before a node leaves its parent; with release the slots of its
+// subtree are freed too.
+int fs_link_node(FSInstance* fs, FSNode* node);
+void fs_unlink_node(FSInstance* fs, FSNode* node, bool release);
+
+// Lazy mode: drop cold directories while more than max_loaded entries are
+// in memory. Only clean entries go, so call it right after a checkpoint,
+// holding state_mutex and no FSNode pointers.
+void fs_evict_cold(FSInstance* fs);
+
+// Every entry of the live tree without loading it: loaded nodes go to
+// on_node, the entries below a directory that is not loaded go to on_slot
+// (if given) straight from the metadata index. Directories are only
+// unloaded while clean, so their stored subtrees are current.
+//
+// In lazy mode this is how stats, slot and reference accounting, recovery
+// and snapshots see the whole tree. Directories are loaded only by path
+// lookups (each directory on the path), listing or deleting a directory
+// (that directory), and change log replay (the path of each replayed
+// entry); nothing loads the whole tree.
+typedef std::function<void(FSNode*)> NodeVisitor;
+typedef std::function<void(uint32_t, const MetaSlot&)> SlotVisitor;
+void fs_walk(FSInstance* fs, const NodeVisitor& on_node, const SlotVisitor& on_slot);
+
+// Lazy mode: the node in metadata index slot index, loading the
+// directories on its path. Null when the path no longer leads to it.
+FSNode* fs_load_slot(FSInstance* fs, uint32_t index);
+
+// Change log records for completed operations (no-ops without a log)
+void fs_log_entry(FSInstance* fs, FSNode* node);
+void fs_log_remove(FSInstance* fs, FSNode* node);
+void fs_log_user(FSInstance* fs, const UserInfo* user);
+
+// Return blocks to the free space manager. With a change log the blocks are
+// held back until the operation that freed them is committed.
+void fs_free_blocks(FSInstance* fs, uint64_t start, uint64_t count);
+void fs_free_inline(FSInstance* fs, uint32_t slot);
+
+// Pre-order tree stream of a snapshot image, parsed from memory
+FSNode* load_fs_tree(const char* buf, uint64_t& offset, uint64_t end_offset);
 
 int fs_format(const char* omni_path, const char* config_path);
 int fs_init(void** instance, const char* omni_path, const char* config_path);
+int fs_init_mapped(void** instance, const char* omni_path, const char* config_path);
+
+// Dirty metadata copied out of the instance: (container offset, bytes)
+// pieces plus the header to write once they are durable. In mapped mode
+// the metadata is already in the mapping and mapped holds the
+// (offset, length) ranges to sync instead.
+struct FlushImage {
+    OMNIHeader header;
+    vector<pair<uint64_t, vector<char>>> pieces;
+    vector<pair<uint64_t, uint64_t>> mapped;
+};
+
+int fs_snapshot(FSInstance* fs, FlushImage& image);      // caller holds state_mutex
+int fs_write_image(FSInstance* fs, const FlushImage& image);
+int fs_flush(FSInstance* fs);                           // snapshot + write
+
+// Grow the container to new_size bytes while it stays open. The caller
+// holds state_mutex.
+int fs_grow(FSInstance* fs, uint64_t new_size);
 void fs_shutdown(void* instance);
 
 #endif // FS_CORE_H
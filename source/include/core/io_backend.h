@@ -0,0 +1,72 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+#define IO_URING_DEPTH  64      // submission queue entries per ring
+
+enum class IoOp : uint8_t {
+    READ,
+    WRITE,
+    SYNC        // fdatasync; also a barrier for the requests around it
+};
+
+struct IoRequest {
+    IoOp op;
+    void* buf;          // source for WRITE, destination for READ
+    size_t len;
+    uint64_t offset;
+    ssize_t result;     // bytes transferred or -errno, set by submit()
+
+    static IoRequest read(void* buf, size_t len, uint64_t offset) {
+        return IoRequest{IoOp::READ, buf, len, offset, 0};
+    }
+    static IoRequest write(const void* buf, size_t len, uint64_t offset) {
+        return IoRequest{IoOp::WRITE, const_cast<void*>(buf), len, offset, 0};
+    }
+    static IoRequest sync() {
+        return IoRequest{IoOp::SYNC, nullptr, 0, 0, 0};
+    }
+};
+
+/**
+ * Positioned I/O on the container file, one descriptor per backend.
+ *
+ * submit() hands a whole batch to the kernel and returns once every
+ * request has completed. Reads and writes between two SYNCs may run
+ * concurrently and complete in any order; a SYNC starts after everything
+ * before it and everything after it starts after the SYNC.
+ *
+ * The io_uring backend keeps the batch in flight at once. The fallback
+ * runs it one pread/pwrite/fdatasync at a time.
+ */
+class io_backend {
+protected:
+    int fd;
+
+    explicit io_backend(int file);
+
+    // pread/pwrite the remainder of a short transfer
+    static bool finish(int file, IoRequest& req);
+
+public:
+    virtual ~io_backend();
+
+    virtual const char* name() const = 0;
+
+    // False if any request failed or transferred fewer than len bytes
+    virtual bool submit(std::vector<IoRequest>& batch) = 0;
+
+    bool read(void* buf, size_t len, uint64_t offset);
+    bool write(const void* buf, size_t len, uint64_t offset);
+    bool sync();
+
+    // io_uring when the kernel supports it (and OFS_IO_BACKEND is not
+    // "pread"), pread/pwrite otherwise. Null if the file cannot be opened.
+    static io_backend* open(const std::string& path, int flags);
+};
+
+#endif // IO_BACKEND_H
@@ -17,8 +17,8 @@ class metadata {
 private:
     FSInstance* fs;  // Pointer to file system instance
 
-    // Helper: recursively count files/directories for get_stats
-    void count_nodes(FSNode* node, uint32_t& files, uint32_t& dirs);
+    // Helper: count files/directories for get_stats, loaded or not
+    void count_nodes(uint32_t& files, uint32_t& dirs);
 
 public:
     explicit metadata(FSInstance* fs_instance);
@@ -64,6 +64,8 @@ public:
     
     strncpy(node->entry->owner, new_owner.c_str(), sizeof(node->entry->owner));
     node->entry->owner[sizeof(node->entry->owner)-1] = '\0';
+    fs_mark_node_dirty(fs, node);
+    fs_log_entry(fs, node);
     
     // Give full permissions to new owner
     /*node->entry->permissions |= static_cast<uint32_t>(FilePermissions::OWNER_READ)   |
@@ -0,0 +1,76 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include "fs_core.h"
+#include "BlockCache.h"
+#include "ExtentMap.h"
+#include "io_backend.h"
+#include "BufferPool.h"
+
+#define READ_AHEAD_MIN_BLOCKS   4       // window after a seek or a cold start
+#define READ_AHEAD_MAX_BLOCKS   256     // window cap (1 MB with 4 KB blocks)
+#define READ_AHEAD_MAX_STREAMS  256     // files tracked at once
+#define READ_AHEAD_MAX_QUEUED   64      // pending runs, the oldest are dropped
+
+/**
+ * Sequential read detection and asynchronous prefetch into the block cache.
+ *
+ * block_store reports every read of a file's blocks. When a read starts
+ * where the previous one on the same file ended, the next window of file
+ * blocks is mapped to container runs and handed to the prefetch_workers
+ * threads, which read them through an io_backend each and fill the cache. The window
+ * doubles while prefetched blocks are found in the cache and halves when
+ * they were evicted before the reader got to them.
+ */
+class read_ahead {
+private:
+    struct Stream {
+        uint32_t next;          // file block the next sequential read starts at
+        uint32_t window;        // blocks to prefetch past the read
+        uint32_t fetched;       // file blocks below this were already queued
+    };
+    struct Run {
+        uint32_t start;
+        uint32_t count;
+    };
+
+    FSInstance* fs;
+    BlockCache* cache;
+    BufferPool* pool;
+
+    std::unordered_map<uint32_t, Stream> streams;   // inode -> state, reader thread only
+
+    std::vector<std::thread> workers;
+    std::vector<io_backend*> ios;       // one per worker
+    std::mutex queue_mutex;
+    std::condition_variable wake;
+    std::deque<Run> queue;
+    bool stopping;
+
+    void worker_loop(io_backend* io);
+    void prefetch(io_backend* io, const Run& run);
+
+public:
+    read_ahead(FSInstance* fs_instance, BlockCache* block_cache, BufferPool* buffers);
+    ~read_ahead();
+
+    bool is_open() const;
+
+    // File blocks [first, last] of node were just read: loaded of them are
+    // mapped and hits came from the cache. Queues the next window when the
+    // access is sequential.
+    void observe(FSNode* node, const ExtentMap* map, uint32_t first, uint32_t last,
+                 uint32_t hits, uint32_t loaded);
+
+    // Drop the state of a deleted or truncated file
+    void forget(uint32_t inode);
+};
+
+#endif // READ_AHEAD_H
@@ -0,0 +1,95 @@
+#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "fs_core.h"
+#include "io_backend.h"
+
+#define SNAPSHOT_MAGIC      0x50414E53      // "SNAP"
+#define MAX_SNAPSHOTS       32
+#define SNAPSHOT_NAME_LEN   32
+
+// Start of the file_state_storage area
+struct SnapshotAreaHeader {
+    uint32_t magic;
+    uint32_t count;         // records in use
+    uint32_t next_id;
+    uint32_t reserved;
+};
+
+// One point-in-time copy. Its tree is stored as a pre-order stream of
+// FileEntry records and child counts, in a run of content blocks.
+struct SnapshotRecord {
+    uint32_t id;
+    uint32_t entries;           // FileEntry records in the tree
+    uint64_t created_time;
+    uint32_t tree_block;        // first block of the serialized tree
+    uint32_t tree_blocks;
+    uint64_t tree_bytes;
+    char name[SNAPSHOT_NAME_LEN];
+};
+
+/**
+ * Read-only snapshots in the container's file_state_storage area (Delta
+ * Vault).
+ *
+ *   [0]          SnapshotAreaHeader
+ *   [16]         SnapshotRecord x MAX_SNAPSHOTS
+ *   [frozen]     one bit per content block a snapshot references, up to
+ *                the container's growth limit
+ *   [slots]      one bit per inline slot a snapshot references
+ *
+ * Taking a snapshot copies metadata only: the tree is serialized and every
+ * block and inline slot it references is frozen. Data is shared with the
+ * live tree from then on. block_store never writes a frozen block or slot
+ * in place: the live file gets a copy on its next write, and freeing one
+ * leaves it allocated for the snapshot. Dropping a snapshot recomputes the
+ * frozen sets from the ones that remain.
+ */
+class snapshot_store {
+private:
+    FSInstance* fs;
+    io_backend* io;
+    SnapshotAreaHeader header;
+    std::vector<SnapshotRecord> records;
+    FreeSpaceManager* frozen_blocks;    // "used" = referenced by a snapshot
+    FreeSpaceManager* frozen_slots;
+    std::unordered_map<uint32_t, FSNode*> trees;    // loaded on first read, by id
+
+    uint64_t area_offset() const;
+    int write_area(const FreeSpaceManager& blocks, const FreeSpaceManager& slots);
+    const SnapshotRecord* find(uint32_t id) const;
+    FSNode* tree(uint32_t id);
+
+public:
+    explicit snapshot_store(FSInstance* fs_instance);
+    ~snapshot_store();
+
+    bool is_open() const;
+
+    // Bytes the area needs in a container with this many blocks and files
+    static uint64_t area_size(uint64_t total_blocks, uint32_t max_files);
+    // Empty area written by fs_format
+    static std::vector<char> empty_area(uint64_t total_blocks, uint32_t max_files);
+
+    // Checkpoint the live state and freeze it as a new snapshot. The caller
+    // holds state_mutex.
+    int create(const std::string& name, uint32_t* id);
+    // Drop snapshot id and free what only it referenced (NOT_FOUND if
+    // there is no such snapshot). The caller holds state_mutex.
+    int remove(uint32_t id);
+    std::vector<SnapshotRecord> list() const;
+    // Same contract as file_manager::file_read_at, against snapshot id
+    int read(uint32_t id, const char* path, uint64_t offset, char* buffer, size_t len, size_t* read);
+
+    bool holds_block(uint64_t block) const;
+    bool holds_slot(uint32_t slot) const;
+
+    // Mark frozen blocks and slots used in the live allocators
+    void claim();
+};
+
+#endif // SNAPSHOT_STORE_H
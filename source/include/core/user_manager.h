@@ -6,17 +6,19 @@
 #include <unordered_map>
 #include "odf_types.hpp"
 #include "HashTable.h"
+#include "fs_core.h"
 
 struct SessionInfo;
 struct UserInfo;
 
 class user_manager {
 private:
+    FSInstance* fs;
     HashTable<UserInfo> *users;               
     std::vector<SessionInfo*> active_sessions;
 
 public:
-    explicit user_manager(HashTable<UserInfo>* user_table);
+    explicit user_manager(FSInstance* fs_instance);
     ~user_manager();
 
     // User management functions
@@ -33,6 +35,7 @@ public:
 private:
     bool check_admin(void* session);
     SessionInfo* find_session(void* session);
+    UserInfo* free_slot();
     
 };
 
@@ -233,7 +233,18 @@ struct FSStats {
     uint32_t total_users;       // Total number of users
     uint32_t active_sessions;   // Currently active sessions
     double fragmentation;       // Fragmentation percentage (0.0 - 100.0)
-    uint8_t reserved[64];       // Reserved
+    uint64_t cache_hits;        // Block cache lookups served from memory
+    uint64_t cache_misses;      // Block cache lookups that went to the container
+    uint64_t cache_evictions;   // Blocks evicted from the cache
+    uint32_t cache_blocks;      // Blocks currently cached
+    uint32_t cache_capacity;    // Cache size in blocks
+    uint64_t dedup_logical;     // Content block references held by files
+    uint64_t dedup_physical;    // Distinct blocks stored for them
+    double dedup_ratio;         // logical / physical (1.0 without dedup)
+    uint64_t compressed_logical;    // File blocks held in compressed clusters
+    uint64_t compressed_stored;     // Container blocks storing them
+    double compression_ratio;       // logical / stored (1.0 without compression)
+    uint8_t reserved[8];        // Reserved
 
     // Default constructor
     FSStats() = default;
@@ -242,7 +253,11 @@ struct FSStats {
     FSStats(uint64_t total, uint64_t used, uint64_t free)
         : total_size(total), used_space(used), free_space(free),
           total_files(0), total_directories(0), total_users(0),
-          active_sessions(0), fragmentation(0.0) {
+          active_sessions(0), fragmentation(0.0),
+          cache_hits(0), cache_misses(0), cache_evictions(0),
+          cache_blocks(0), cache_capacity(0),
+          dedup_logical(0), dedup_physical(0), dedup_ratio(1.0),
+          compressed_logical(0), compressed_stored(0), compression_ratio(1.0) {
         std::memset(reserved, 0, sizeof(reserved));
     }
 };
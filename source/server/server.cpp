@@ -1,6 +1,7 @@
 #include <iostream>
 #include <filesystem>
 #include <thread>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <cstring>
@@ -10,8 +11,15 @@
 #include <unistd.h>
 #include <ctime>
 #include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <atomic>
 
 #include "fs_core.h"
+#include "config.h"
+#include "change_log.h"
+#include "snapshot_store.h"
+#include "defragmenter.h"
 #include "user_manager.h"
 #include "dir_manager.h"
 #include "file_manager.h"
@@ -22,9 +30,7 @@
 
 #include "session_manager.h"
 
-#define PORT 8080
-#define MAX_CONN 10
-#define BUFFER_SIZE 8192
+#define LOG_GROUP_MAX 64    // requests per change log commit at most
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -39,6 +45,13 @@ metadata* meta = nullptr;
 // Global FIFO queue
 static RequestQueue req_queue;
 
+// Server settings from the .uconf given on the command line
+static OFSConfig config;
+static std::atomic<uint32_t> client_count{0};
+
+// Replies waiting for the change log group commit, in send order
+static vector<pair<int, string>> held_replies;
+
 // ----------------------- Helper functions -----------------------
 std::string read_until_eof(int client_sock, const std::string& eof_marker = "<<<EOF>>>") {
     std::string buffer; // temporary buffer from recv
@@ -78,13 +91,42 @@ void send_msg(int sock, const string& msg) {
     }
 }
 
+// Worker replies: held while logged changes are uncommitted, so a client
+// never sees SUCCESS for something a crash could still undo
+void reply(int sock, const string& msg) {
+    if (!held_replies.empty() || (fs_inst->log && fs_inst->log->pending()))
+        held_replies.push_back({sock, msg});
+    else
+        send_msg(sock, msg);
+}
+
+// Group commit: one fdatasync for every change made since the last call
+void commit_held() {
+    if (fs_inst->log && fs_inst->log->commit() != 0)
+        cerr << "Error: change log commit failed" << endl;
+    for (auto& r : held_replies)
+        send_msg(r.first, r.second);
+    held_replies.clear();
+}
+
 string recv_msg(int sock) {
     // Read once (this is same behaviour as your earlier recv_msg).
-    char buffer[BUFFER_SIZE];
-    int n = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+    vector<char> buffer(config.buffer_size);
+    int n = recv(sock, buffer.data(), buffer.size() - 1, 0);
     if (n <= 0) return "";
-    buffer[n] = '\0';
-    return string(buffer, n);
+    return string(buffer.data(), n);
+}
+
+// Decimal token from a client. False instead of throwing on anything that is
+// not a non-negative number that fits in 64 bits.
+static bool parse_u64(const string& token, uint64_t& out) {
+    if (token.empty() || !isdigit(static_cast<unsigned char>(token[0]))) return false;
+    errno = 0;
+    char* end = nullptr;
+    unsigned long long value = strtoull(token.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0') return false;
+    out = value;
+    return true;
 }
 
 void send_raw(int sock, const char* data, size_t len) {
@@ -161,7 +203,9 @@ static inline vector<string> tokenize_command(const string &line) {
 
 // ----------------------- Core request handler -----------------------
 // Processes ONE enqueued request. It uses session_manager to track session per client.
-void handle_client_request(int client_sock, const string& raw_request) {
+// state holds fs_inst->state_mutex; CREATE and EDIT let go of it while
+// they wait for the client's content
+void handle_client_request(int client_sock, const string& raw_request, unique_lock<mutex>& state) {
     // get (or create) session for this client
     void* session = get_session(client_sock);
 
@@ -169,7 +213,7 @@ void handle_client_request(int client_sock, const string& raw_request) {
     // to read further from the socket — so keep the socket open until we finish processing.
     // Send welcome only if client hasn't been seen before
     if (!session) {
-        send_msg(client_sock, build_response("WELCOME", "", "message", "Welcome to OFS server!", to_string(time(nullptr))));
+        reply(client_sock, build_response("WELCOME", "", "message", "Welcome to OFS server!", to_string(time(nullptr))));
     }
 
     string request = trim_all(raw_request);
@@ -180,7 +224,7 @@ void handle_client_request(int client_sock, const string& raw_request) {
 
     vector<string> tokens = tokenize_command(request);
     if (tokens.empty()) {
-        send_msg(client_sock, build_response("INVALID_COMMAND", session ? to_string((uintptr_t)session) : "", "error", "ERROR_INVALID_COMMAND", to_string(time(nullptr))));
+        reply(client_sock, build_response("INVALID_COMMAND", session ? to_string((uintptr_t)session) : "", "error", "ERROR_INVALID_COMMAND", to_string(time(nullptr))));
         return;
     }
 
@@ -193,7 +237,7 @@ void handle_client_request(int client_sock, const string& raw_request) {
     // --------- USER COMMANDS ---------
     if (cmd == "LOGIN") {
         if (tokens.size() < 3) {
-            send_msg(client_sock, build_response("LOGIN", session_id, "error", "ERROR_INVALID_COMMAND", request_id));
+            reply(client_sock, build_response("LOGIN", session_id, "error", "ERROR_INVALID_COMMAND", request_id));
             return;
         }
         string username = tokens[1];
@@ -203,230 +247,411 @@ void handle_client_request(int client_sock, const string& raw_request) {
             set_session(client_sock, session);
             session_id = to_string((uintptr_t)session);
         }
-        send_msg(client_sock, build_response("LOGIN", session_id, "result", res == 0 ? "SUCCESS_LOGIN" : "ERROR_INVALID_CREDENTIALS", request_id));
+        reply(client_sock, build_response("LOGIN", session_id, "result", res == 0 ? "SUCCESS_LOGIN" : "ERROR_INVALID_CREDENTIALS", request_id));
         return;
     }
 
     if (cmd == "LOGOUT") {
         if (session) { um->user_logout(session); remove_session(client_sock); session = nullptr; }
-        send_msg(client_sock, build_response("LOGOUT", "", "result", "SUCCESS_LOGOUT", request_id));
+        reply(client_sock, build_response("LOGOUT", "", "result", "SUCCESS_LOGOUT", request_id));
         return;
     }
 
     if (cmd == "CREATE_USER") {
-        if (!session) { send_msg(client_sock, build_response("CREATE_USER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 4) { send_msg(client_sock, build_response("CREATE_USER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("CREATE_USER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 4) { reply(client_sock, build_response("CREATE_USER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         string username = tokens[1], password = tokens[2];
         int role = stoi(tokens[3]);
         int res = um->user_create(session, username.c_str(), password.c_str(), static_cast<UserRole>(role));
-        send_msg(client_sock, build_response("CREATE_USER", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("CREATE_USER", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "DELETE_USER") {
-        if (!session) { send_msg(client_sock, build_response("DELETE_USER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DELETE_USER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DELETE_USER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DELETE_USER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = um->user_delete(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("DELETE_USER", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("DELETE_USER", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "LIST_USERS") {
-        if (!session) { send_msg(client_sock, build_response("LIST_USERS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("LIST_USERS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
         UserInfo* users = nullptr; int count = 0;
         int res = um->user_list(session, &users, &count);
         if (res == 0) {
             for (int i = 0; i < count; ++i) {
-                send_msg(client_sock, build_response("LIST_USERS", session_id, "user", users[i].username, request_id));
+                reply(client_sock, build_response("LIST_USERS", session_id, "user", users[i].username, request_id));
             }
         } else {
-            send_msg(client_sock, build_response("LIST_USERS", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+            reply(client_sock, build_response("LIST_USERS", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         }
         return;
     }
 
     if (cmd == "GET_SESSION_INFO") {
-        if (!session) { send_msg(client_sock, build_response("GET_SESSION_INFO", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("GET_SESSION_INFO", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
         SessionInfo info; int res = um->get_session_info(session, &info);
-        send_msg(client_sock, build_response("GET_SESSION_INFO", session_id, "user", res == 0 ? info.user.username : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("GET_SESSION_INFO", session_id, "user", res == 0 ? info.user.username : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     // ------- FILE COMMANDS -------
     if (cmd == "CREATE") {
     if (!session) { 
-        send_msg(client_sock, build_response("CREATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); 
+        reply(client_sock, build_response("CREATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); 
         return; 
     }
     if (tokens.size() < 2) { 
-        send_msg(client_sock, build_response("CREATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); 
+        reply(client_sock, build_response("CREATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); 
         return; 
     }
 
     std::string path = tokens[1];
+    // CREATE <path> [size]: the expected size reserves contiguous space up front
+    uint64_t size_hint = 0;
+    if (tokens.size() > 2 && !parse_u64(tokens[2], size_hint)) {
+        reply(client_sock, build_response("CREATE", session_id, "error", "ERROR_INVALID_OPERATION", request_id));
+        return;
+    }
 
-    // ask for content
+    // ask for content; the client only answers once it sees the prompt
+    commit_held();
     send_msg(client_sock, build_response("CREATE", session_id, "message", "Enter content. End with <<<EOF>>>", request_id));
 
-    // read content until <<<EOF>>>
+    // read content until <<<EOF>>>, without blocking checkpoints meanwhile
+    state.unlock();
     std::string data = read_until_eof(client_sock);
+    state.lock();
 
-    int res = fm->file_create(session, path.c_str(), data.c_str(), data.size());
-    send_msg(client_sock, build_response("CREATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+    int res = fm->file_create(session, path.c_str(), data.c_str(), data.size(), size_hint);
+    reply(client_sock, build_response("CREATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
     return;
 }
 
 if (cmd == "EDIT") {
     if (!session) { 
-        send_msg(client_sock, build_response("EDIT", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); 
+        reply(client_sock, build_response("EDIT", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); 
         return; 
     }
     if (tokens.size() < 3) { 
-        send_msg(client_sock, build_response("EDIT", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); 
+        reply(client_sock, build_response("EDIT", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); 
         return; 
     }
 
     std::string path = tokens[1];
-    size_t index = (size_t)std::stoul(tokens[2]);
+    uint64_t index;
+    if (!parse_u64(tokens[2], index)) {
+        reply(client_sock, build_response("EDIT", session_id, "error", "ERROR_INVALID_OPERATION", request_id));
+        return;
+    }
 
+    commit_held();
     send_msg(client_sock, build_response("EDIT", session_id, "message", "Enter new content. End with <<<EOF>>>", request_id));
 
+    state.unlock();
     std::string data = read_until_eof(client_sock);
+    state.lock();
 
     int res = fm->file_edit(session, path.c_str(), data.c_str(), data.size(), index);
-    send_msg(client_sock, build_response("EDIT", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+    reply(client_sock, build_response("EDIT", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
     return;
 }
 
     if (cmd == "READ") {
-        if (!session) { send_msg(client_sock, build_response("READ", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("READ", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
-        char* buffer = nullptr; size_t size = 0;
-        int res = fm->file_read(session, tokens[1].c_str(), &buffer, &size);
-        if (res == 0) {
-            const size_t CHUNK = 4096;
-            for (size_t i = 0; i < size; i += CHUNK) {
-                size_t len = std::min(CHUNK, size - i);
-                send_raw(client_sock, buffer + i, len);
-            }
-            send_msg(client_sock, build_response("READ", session_id, "status", "EOF_REACHED", request_id));
-            meta->free_buffer(buffer);
-        } else {
-            send_msg(client_sock, build_response("READ", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        if (!session) { reply(client_sock, build_response("READ", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("READ", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        // READ <path> [offset] [length]: streamed one ranged read at a time,
+        // sequential chunks are prefetched into the block cache
+        uint64_t offset = 0, remaining = UINT64_MAX;
+        if ((tokens.size() > 2 && !parse_u64(tokens[2], offset)) || (tokens.size() > 3 && !parse_u64(tokens[3], remaining))) {
+            reply(client_sock, build_response("READ", session_id, "error", "ERROR_INVALID_OPERATION", request_id));
+            return;
         }
+        const size_t CHUNK = 4096;
+        const size_t READ_CHUNK = 64 * 1024;
+        vector<char> buffer(READ_CHUNK);
+        size_t got = 0;
+        int res = fm->file_read_at(session, tokens[1].c_str(), offset, buffer.data(), std::min<uint64_t>(READ_CHUNK, remaining), &got);
+        if (res != 0) {
+            reply(client_sock, build_response("READ", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+            return;
+        }
+        commit_held();
+        while (got > 0 && res == 0) {
+            for (size_t i = 0; i < got; i += CHUNK)
+                send_raw(client_sock, buffer.data() + i, std::min(CHUNK, got - i));
+            offset += got;
+            remaining -= got;
+            if (remaining == 0) break;
+            res = fm->file_read_at(session, tokens[1].c_str(), offset, buffer.data(), std::min<uint64_t>(READ_CHUNK, remaining), &got);
+        }
+        if (res == 0)
+            reply(client_sock, build_response("READ", session_id, "status", "EOF_REACHED", request_id));
+        else
+            reply(client_sock, build_response("READ", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "DELETE_FILE") {
-        if (!session) { send_msg(client_sock, build_response("DELETE_FILE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DELETE_FILE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DELETE_FILE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DELETE_FILE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = fm->file_delete(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("DELETE_FILE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("DELETE_FILE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "TRUNCATE") {
-        if (!session) { send_msg(client_sock, build_response("TRUNCATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("TRUNCATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("TRUNCATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("TRUNCATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = fm->file_truncate(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("TRUNCATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("TRUNCATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "FALLOCATE") {
+        if (!session) { reply(client_sock, build_response("FALLOCATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 3) { reply(client_sock, build_response("FALLOCATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        uint64_t size;
+        if (!parse_u64(tokens[2], size)) { reply(client_sock, build_response("FALLOCATE", session_id, "error", "ERROR_INVALID_OPERATION", request_id)); return; }
+        int res = fm->file_fallocate(session, tokens[1].c_str(), size);
+        reply(client_sock, build_response("FALLOCATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "FILE_EXISTS") {
-        if (!session) { send_msg(client_sock, build_response("FILE_EXISTS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("FILE_EXISTS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("FILE_EXISTS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("FILE_EXISTS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = fm->file_exists(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("FILE_EXISTS", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("FILE_EXISTS", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "RENAME_FILE") {
-        if (!session) { send_msg(client_sock, build_response("RENAME_FILE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 3) { send_msg(client_sock, build_response("RENAME_FILE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("RENAME_FILE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 3) { reply(client_sock, build_response("RENAME_FILE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = fm->file_rename(session, tokens[1].c_str(), tokens[2].c_str());
-        send_msg(client_sock, build_response("RENAME_FILE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("RENAME_FILE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     // ------- DIRECTORY -------
     if (cmd == "DIR_CREATE") {
-        if (!session) { send_msg(client_sock, build_response("DIR_CREATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DIR_CREATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DIR_CREATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DIR_CREATE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = dm->dir_create(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("DIR_CREATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("DIR_CREATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "DIR_LIST") {
-        if (!session) { send_msg(client_sock, build_response("DIR_LIST", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DIR_LIST", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DIR_LIST", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DIR_LIST", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         FileEntry* entries = nullptr; int count = 0;
         int res = dm->dir_list(session, tokens[1].c_str(), &entries, &count);
         if (res == 0) {
             for (int i = 0; i < count; ++i) {
-                send_msg(client_sock, build_response("DIR_LIST", session_id, "entry", entries[i].name, request_id));
+                reply(client_sock, build_response("DIR_LIST", session_id, "entry", entries[i].name, request_id));
             }
         } else {
-            send_msg(client_sock, build_response("DIR_LIST", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+            reply(client_sock, build_response("DIR_LIST", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         }
         return;
     }
 
     if (cmd == "DELETE_DIR") {
-        if (!session) { send_msg(client_sock, build_response("DELETE_DIR", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DELETE_DIR", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DELETE_DIR", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DELETE_DIR", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = dm->dir_delete(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("DELETE_DIR", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("DELETE_DIR", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "DIR_EXISTS") {
-        if (!session) { send_msg(client_sock, build_response("DIR_EXISTS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("DIR_EXISTS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("DIR_EXISTS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("DIR_EXISTS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = dm->dir_exists(session, tokens[1].c_str());
-        send_msg(client_sock, build_response("DIR_EXISTS", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("DIR_EXISTS", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     // ------- METADATA -------
     if (cmd == "GET_METADATA") {
-        if (!session) { send_msg(client_sock, build_response("GET_METADATA", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 2) { send_msg(client_sock, build_response("GET_METADATA", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("GET_METADATA", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("GET_METADATA", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         FileMetadata meta_out;
         int res = meta->get_metadata(session, tokens[1].c_str(), &meta_out);
-        send_msg(client_sock, build_response("GET_METADATA", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        if (res == 0) {
+            vector<pair<string, uint64_t>> lines = {
+                {"size", meta_out.entry.size}, {"blocks_used", meta_out.blocks_used},
+                {"actual_size", meta_out.actual_size}
+            };
+            for (auto& line : lines)
+                reply(client_sock, build_response("GET_METADATA", session_id, "stat", line.first + "=" + to_string(line.second), request_id));
+        }
+        reply(client_sock, build_response("GET_METADATA", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "SET_PERMISSIONS") {
-        if (!session) { send_msg(client_sock, build_response("SET_PERMISSIONS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 3) { send_msg(client_sock, build_response("SET_PERMISSIONS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("SET_PERMISSIONS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 3) { reply(client_sock, build_response("SET_PERMISSIONS", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         uint32_t perms = (uint32_t)stoul(tokens[2]);
         int res = meta->set_permissions(session, tokens[1].c_str(), perms);
-        send_msg(client_sock, build_response("SET_PERMISSIONS", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("SET_PERMISSIONS", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "GET_STATS") {
-        if (!session) { send_msg(client_sock, build_response("GET_STATS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("GET_STATS", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
         FSStats stats;
         int res = meta->get_stats(session, &stats);
-        send_msg(client_sock, build_response("GET_STATS", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        if (res == 0) {
+            vector<pair<string, uint64_t>> lines = {
+                {"total_files", stats.total_files}, {"total_directories", stats.total_directories},
+                {"total_users", stats.total_users}, {"active_sessions", stats.active_sessions},
+                {"cache_hits", stats.cache_hits}, {"cache_misses", stats.cache_misses},
+                {"cache_evictions", stats.cache_evictions}, {"cache_blocks", stats.cache_blocks},
+                {"cache_capacity", stats.cache_capacity},
+                {"dedup_logical", stats.dedup_logical}, {"dedup_physical", stats.dedup_physical},
+                {"compressed_logical", stats.compressed_logical}, {"compressed_stored", stats.compressed_stored}
+            };
+            for (auto& line : lines)
+                reply(client_sock, build_response("GET_STATS", session_id, "stat", line.first + "=" + to_string(line.second), request_id));
+            char ratio[32];
+            snprintf(ratio, sizeof(ratio), "dedup_ratio=%.2f", stats.dedup_ratio);
+            reply(client_sock, build_response("GET_STATS", session_id, "stat", ratio, request_id));
+            snprintf(ratio, sizeof(ratio), "compression_ratio=%.2f", stats.compression_ratio);
+            reply(client_sock, build_response("GET_STATS", session_id, "stat", ratio, request_id));
+            snprintf(ratio, sizeof(ratio), "fragmentation=%.2f", stats.fragmentation);
+            reply(client_sock, build_response("GET_STATS", session_id, "stat", ratio, request_id));
+        }
+        reply(client_sock, build_response("GET_STATS", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "CHECKPOINT") {
+        if (!session) { reply(client_sock, build_response("CHECKPOINT", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        SessionInfo info;
+        if (um->get_session_info(session, &info) != 0 || info.user.role != UserRole::ADMIN) {
+            reply(client_sock, build_response("CHECKPOINT", session_id, "error", "ERROR_PERMISSION_DENIED", request_id));
+            return;
+        }
+        int res = fs_inst->log ? fs_inst->log->checkpoint() : fs_flush(fs_inst);
+        reply(client_sock, build_response("CHECKPOINT", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "RESIZE") {
+        if (!session) { reply(client_sock, build_response("RESIZE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("RESIZE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        SessionInfo info;
+        if (um->get_session_info(session, &info) != 0 || info.user.role != UserRole::ADMIN) {
+            reply(client_sock, build_response("RESIZE", session_id, "error", "ERROR_PERMISSION_DENIED", request_id));
+            return;
+        }
+        // RESIZE <total_size>: grow only, up to the max_size the container was formatted with
+        uint64_t total_size;
+        if (!parse_u64(tokens[1], total_size)) { reply(client_sock, build_response("RESIZE", session_id, "error", "ERROR_INVALID_OPERATION", request_id)); return; }
+        int res = fs_grow(fs_inst, total_size);
+        reply(client_sock, build_response("RESIZE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "SNAPSHOT_CREATE") {
+        if (!session) { reply(client_sock, build_response("SNAPSHOT_CREATE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        SessionInfo info;
+        if (um->get_session_info(session, &info) != 0 || info.user.role != UserRole::ADMIN) {
+            reply(client_sock, build_response("SNAPSHOT_CREATE", session_id, "error", "ERROR_PERMISSION_DENIED", request_id));
+            return;
+        }
+        if (!fs_inst->snapshots) { reply(client_sock, build_response("SNAPSHOT_CREATE", session_id, "error", "ERROR_NOT_IMPLEMENTED", request_id)); return; }
+        // SNAPSHOT_CREATE [name]
+        uint32_t id = 0;
+        int res = fs_inst->snapshots->create(tokens.size() > 1 ? tokens[1] : "", &id);
+        if (res == 0)
+            reply(client_sock, build_response("SNAPSHOT_CREATE", session_id, "snapshot_id", to_string(id), request_id));
+        reply(client_sock, build_response("SNAPSHOT_CREATE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "SNAPSHOT_DELETE") {
+        if (!session) { reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 2) { reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        SessionInfo info;
+        if (um->get_session_info(session, &info) != 0 || info.user.role != UserRole::ADMIN) {
+            reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "error", "ERROR_PERMISSION_DENIED", request_id));
+            return;
+        }
+        if (!fs_inst->snapshots) { reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "error", "ERROR_NOT_IMPLEMENTED", request_id)); return; }
+        // SNAPSHOT_DELETE <id>
+        uint64_t id = 0;
+        if (!parse_u64(tokens[1], id) || id > UINT32_MAX) { reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "error", "ERROR_INVALID_OPERATION", request_id)); return; }
+        int res = fs_inst->snapshots->remove(static_cast<uint32_t>(id));
+        reply(client_sock, build_response("SNAPSHOT_DELETE", session_id, "result", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        return;
+    }
+
+    if (cmd == "SNAPSHOT_LIST") {
+        if (!session) { reply(client_sock, build_response("SNAPSHOT_LIST", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (!fs_inst->snapshots) { reply(client_sock, build_response("SNAPSHOT_LIST", session_id, "error", "ERROR_NOT_IMPLEMENTED", request_id)); return; }
+        for (const SnapshotRecord& rec : fs_inst->snapshots->list()) {
+            string line = "id=" + to_string(rec.id) + " name=" + rec.name + " created=" + to_string(rec.created_time) +
+                          " entries=" + to_string(rec.entries);
+            reply(client_sock, build_response("SNAPSHOT_LIST", session_id, "snapshot", line, request_id));
+        }
+        reply(client_sock, build_response("SNAPSHOT_LIST", session_id, "result", "SUCCESS", request_id));
+        return;
+    }
+
+    if (cmd == "SNAPSHOT_READ") {
+        if (!session) { reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 3) { reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!fs_inst->snapshots) { reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", "ERROR_NOT_IMPLEMENTED", request_id)); return; }
+        // SNAPSHOT_READ <id> <path> [offset] [length], streamed like READ
+        uint64_t id = 0, offset = 0, remaining = UINT64_MAX;
+        if (!parse_u64(tokens[1], id) || id > UINT32_MAX || (tokens.size() > 3 && !parse_u64(tokens[3], offset)) ||
+            (tokens.size() > 4 && !parse_u64(tokens[4], remaining))) {
+            reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", "ERROR_INVALID_OPERATION", request_id));
+            return;
+        }
+        const size_t CHUNK = 4096;
+        const size_t READ_CHUNK = 64 * 1024;
+        vector<char> buffer(READ_CHUNK);
+        size_t got = 0;
+        int res = fs_inst->snapshots->read(id, tokens[2].c_str(), offset, buffer.data(), std::min<uint64_t>(READ_CHUNK, remaining), &got);
+        if (res != 0) {
+            reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+            return;
+        }
+        commit_held();
+        while (got > 0 && res == 0) {
+            for (size_t i = 0; i < got; i += CHUNK)
+                send_raw(client_sock, buffer.data() + i, std::min(CHUNK, got - i));
+            offset += got;
+            remaining -= got;
+            if (remaining == 0) break;
+            res = fs_inst->snapshots->read(id, tokens[2].c_str(), offset, buffer.data(), std::min<uint64_t>(READ_CHUNK, remaining), &got);
+        }
+        if (res == 0)
+            reply(client_sock, build_response("SNAPSHOT_READ", session_id, "status", "EOF_REACHED", request_id));
+        else
+            reply(client_sock, build_response("SNAPSHOT_READ", session_id, "error", error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "SET_OWNER") {
-        if (!session) { send_msg(client_sock, build_response("SET_OWNER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
-        if (tokens.size() < 3) { send_msg(client_sock, build_response("SET_OWNER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
+        if (!session) { reply(client_sock, build_response("SET_OWNER", session_id, "error", "ERROR_NOT_LOGGED_IN", request_id)); return; }
+        if (tokens.size() < 3) { reply(client_sock, build_response("SET_OWNER", session_id, "error", "ERROR_INVALID_COMMAND", request_id)); return; }
         int res = meta->set_owner(session, tokens[1].c_str(), tokens[2].c_str());
-        send_msg(client_sock, build_response("SET_OWNER", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
+        reply(client_sock, build_response("SET_OWNER", session_id, "result", res == 0 ? "SUCCESS" : error_to_string(static_cast<OFSErrorCodes>(res)), request_id));
         return;
     }
 
     if (cmd == "EXIT") {
 
     remove_session(client_sock);
+    commit_held();
 
     // Send goodbye message
     send(client_sock,
@@ -439,16 +664,24 @@ if (cmd == "EDIT") {
 
 
     // Unknown command
-    send_msg(client_sock, build_response("UNKNOWN_COMMAND", session_id, "error", "ERROR_UNKNOWN_COMMAND", request_id));
+    reply(client_sock, build_response("UNKNOWN_COMMAND", session_id, "error", "ERROR_UNKNOWN_COMMAND", request_id));
 }
 
 // ----------------------- worker that pops and processes requests -----------------------
 void process_requests() {
     while (true) {
         Request r = req_queue.pop(); // blocks until a request exists
-        // Process the single request in FIFO order
-        handle_client_request(r.client_sock, r.request);
+        // The background checkpointer snapshots state between requests
+        unique_lock<mutex> state(fs_inst->state_mutex);
+        // Process the single request in FIFO order, unless it waited longer
+        // than queue_timeout for its turn
+        if (config.queue_timeout != 0 && time(nullptr) - r.enqueued > (time_t)config.queue_timeout)
+            reply(r.client_sock, build_response("QUEUE_TIMEOUT", "", "error", "ERROR_QUEUE_TIMEOUT", ""));
+        else
+            handle_client_request(r.client_sock, r.request, state);
         // do NOT close client here — client may send more commands; client connection closed in accept loop when client disconnects
+        if (!held_replies.empty() && (req_queue.empty() || held_replies.size() >= LOG_GROUP_MAX))
+            commit_held();
     }
 }
 
@@ -460,6 +693,12 @@ void accept_loop(int server_fd) {
             perror("accept");
             continue;
         }
+        if (client_count >= config.max_connections) {
+            send_msg(client_sock, build_response("BUSY", "", "error", "ERROR_MAX_CONNECTIONS", to_string(time(nullptr))));
+            close(client_sock);
+            continue;
+        }
+        ++client_count;
 
         // We will read from this socket in the accept loop non-blocking fashion: repeatedly receive commands and enqueue them.
         // To keep it simple and safe: spawn a thread per client that reads messages and enqueues them.
@@ -477,32 +716,43 @@ void accept_loop(int server_fd) {
             // client disconnected: cleanup session record
             remove_session(client_sock);
             close(client_sock);
+            --client_count;
         }).detach();
     }
 }
 
 // ----------------------- main -----------------------
-int main() {
+int main(int argc, char** argv) {
+    // ofs_server [config.uconf]
+    const char* config_path = argc > 1 ? argv[1] : "default.uconf";
+    int res = config_load(config_path, &config);
+    if (res == static_cast<int>(OFSErrorCodes::ERROR_INVALID_CONFIG)) return 1;
+    if (res != 0) cerr << "Warning: cannot read " << config_path << ", using defaults" << endl;
+
     // initialize FS
     if (fs::exists("file.omni")) {
-        if (fs_init((void**)&fs_inst, "file.omni", "default.uconf.txt") != 0) {
+        if (fs_init_mapped((void**)&fs_inst, "file.omni", config_path) != 0) {
             cerr << "FS Init failed!" << endl;
             return 1;
         }
     } else {
-        fs_format("file.omni", "default_config.txt");
-        if (fs_init((void**)&fs_inst, "file.omni", "default.uconf.txt") != 0) {
+        fs_format("file.omni", config_path);
+        if (fs_init_mapped((void**)&fs_inst, "file.omni", config_path) != 0) {
             cerr << "FS Init failed!" << endl;
             return 1;
         }
     }
 
     // initialize managers
-    um = new user_manager(fs_inst->users);
-    dm = new dir_manager(fs_inst->root, um);
+    um = new user_manager(fs_inst);
+    dm = new dir_manager(fs_inst, um);
     fm = new file_manager(fs_inst, um);
     meta = new metadata(fs_inst);
 
+    // periodic checkpoints keep the change log (and recovery time) short
+    if (fs_inst->log) fs_inst->log->start_checkpointer();
+    if (fs_inst->defrag_worker) fs_inst->defrag_worker->start();
+
     // server socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) { perror("socket failed"); return 1; }
@@ -513,12 +763,12 @@ int main() {
     struct sockaddr_in address{};
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(config.port);
 
     if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) { perror("bind failed"); return 1; }
-    if (listen(server_fd, MAX_CONN) < 0) { perror("listen failed"); return 1; }
+    if (listen(server_fd, config.max_connections) < 0) { perror("listen failed"); return 1; }
 
-    cout << "OFS Server listening on port " << PORT << endl;
+    cout << "OFS Server listening on port " << config.port << endl;
 
     // start worker that processes requests FIFO
     //std:: thread(worker_thread, process_requests);
@@ -1006,7 +1256,7 @@ int main() {
 
     // Initialize managers
     um = new user_manager(fs_inst->users);
-    dm = new dir_manager(fs_inst->root, um);
+    dm = new dir_manager(fs_inst, um);
     fm = new file_manager(fs_inst, um);
     meta = new metadata(fs_inst);
 
@@ -2,11 +2,21 @@
 #include <iomanip>
 #include <cstring>
 #include <ctime>
+#include <fstream>
+#include <random>
+#include <vector>
 #include "core/fs_core.h"
 #include "core/user_manager.h"
 #include "core/file_manager.h"
 #include "core/dir_manager.h"
 #include "core/metadata.h"
+#include "core/block_store.h"
+#include "core/change_log.h"
+#include "core/snapshot_store.h"
+#include "core/config.h"
+#include "ExtentMap.h"
+#include "LZCodec.h"
+#include "FreeSpaceManager.h"
 #include "odf_types.hpp"
 
 using namespace std;
@@ -44,6 +54,54 @@ void print_test(const string& test_name, int status) {
         cout << red << "FAIL (" << get_error_string(status) << ")" << reset << endl;
 }
 
+// Status for a check that is not an FS call
+int expect(bool ok) {
+    return ok ? 0 : static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+}
+
+// Log tail written to the container header by the last checkpoint
+uint64_t disk_log_tail(const char* path) {
+    OMNIHeader header;
+    ifstream in(path, ios::binary);
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return layout_of(header)->log_tail;
+}
+
+// Compress and decompress in, true if the result is identical
+bool lz_round_trip(const string& in) {
+    vector<char> packed(in.size() + in.size() / 255 + 16);
+    size_t n = LZCodec::compress(in.data(), in.size(), packed.data(), packed.size());
+    if (n == 0) return false;
+    string out(in.size(), '\0');
+    return LZCodec::decompress(packed.data(), n, &out[0], out.size()) && out == in;
+}
+
+// config_load on a file holding text
+int load_config_text(const string& text, OFSConfig* config) {
+    ofstream("config_test.uconf", ios::binary | ios::trunc) << text;
+    return config_load("config_test.uconf", config);
+}
+
+// Whole content of a file, empty if it cannot be read
+string read_file(file_manager& files, const char* path) {
+    char* buf = nullptr;
+    size_t n = 0;
+    if (files.file_read(nullptr, path, &buf, &n) != 0) return "";
+    string out(buf, n);
+    delete[] buf;
+    return out;
+}
+
+// First run of n free blocks by a plain scan, for checking the summary tree
+int64_t naive_find(const FreeSpaceManager& fsm, uint64_t total, uint64_t n) {
+    uint64_t run = 0;
+    for (uint64_t i = 0; i < total; ++i) {
+        run = fsm.isFree(i) ? run + 1 : 0;
+        if (run == n) return static_cast<int64_t>(i + 1 - n);
+    }
+    return -1;
+}
+
 // ============================================================================
 // MAIN TEST HARNESS
 // ============================================================================
@@ -65,8 +123,8 @@ int main() {
     print_test("Initialize FS", status);
 
     // Build core managers
-    user_manager users(fs->users);
-    dir_manager dirs(fs->root, &users);
+    user_manager users(fs);
+    dir_manager dirs(fs, &users);
     file_manager files(fs, &users);
     metadata meta(fs);
 
@@ -106,8 +164,8 @@ int main() {
     // ------------------------------------------------------------------------
     // Step 5: Rename and Truncate
     // ------------------------------------------------------------------------
-    //status = files.file_rename(admin_session, "/docs/info.txt", "/docs/info_v2.txt");
-    //print_test("Rename /docs/info.txt → /docs/info_v2.txt", status);
+    status = files.file_rename(admin_session, "/docs/info.txt", "/docs/info_v2.txt");
+    print_test("Rename /docs/info.txt → /docs/info_v2.txt", status);
 
     status = files.file_truncate(admin_session, "/docs/info_v2.txt");
     print_test("Truncate /docs/info_v2.txt", status);
@@ -201,8 +259,8 @@ meta.set_permissions(admin_session,"/",all_perms);
 
     
     data = "dfbbhbnbnbnnbnnbvdfghghahggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvsddddddddddddddddddddddtrfgfgggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaabbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbcccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccdddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeefffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffgggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggghhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhhiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiijjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjjkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllllmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnoooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooooppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrsssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssssstttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttttuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuuvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyzzzzzzzzzzzzzzzzzzzzzzzzzzzz";
-     status = files.file_edit(admin_session, "/docs/info.txt", data, strlen(data),1);
-     print_test("Admin Edit /docs/info.txt",status);
+     status = files.file_edit(admin_session, "/docs/info_v2.txt", data, strlen(data),1);
+     print_test("Admin Edit /docs/info_v2.txt",status);
 
      buffer = nullptr;
     size = 0;
@@ -214,9 +272,9 @@ meta.set_permissions(admin_session,"/",all_perms);
 
     buffer = nullptr;
     size = 0;
-     status = files.file_read(admin_session, "/docs/info.txt", &buffer, &size);
+     status = files.file_read(admin_session, "/docs/info_v2.txt", &buffer, &size);
 
-    print_test("Read /docs/info.txt", status);
+    print_test("Read /docs/info_v2.txt", status);
     if (status == 0 && buffer)
         cout << "  → File content: " << string(buffer, size) << endl;
 
@@ -253,6 +311,1046 @@ if (status == 0)
     fs_shutdown(fs);
     print_test("Shutdown FS", 0);
 
+    // ------------------------------------------------------------------------
+    // Step 10: Extent Map
+    // ------------------------------------------------------------------------
+    {
+        ExtentMap map;
+        map.insert(Extent{4, 104, 4});
+        map.insert(Extent{10, 200, 2});
+        map.insert(Extent{0, 100, 4});      // contiguous with the run after it
+        status = expect(map.size() == 2 && map.list()[0].logical == 0 && map.list()[0].length == 8);
+        print_test("Extents merge contiguous runs", status);
+
+        status = expect(map.find(7) && map.find(7)->start == 100 && !map.find(8) && !map.find(9) &&
+                        map.find(11) && map.find(11)->start == 200 && !map.find(12));
+        print_test("Extent lookup skips holes", status);
+
+        map.remove(2, 3);                   // splits [0, 8) around the hole
+        const vector<Extent>& runs = map.list();
+        status = expect(runs.size() == 3 && runs[0].start == 100 && runs[0].length == 2 &&
+                        runs[1].logical == 5 && runs[1].start == 105 && runs[1].length == 3 &&
+                        map.blockCount() == 7);
+        print_test("Extent remove splits a run", status);
+
+        map.insert(Extent{2, 102, 3});      // fills the hole, merges both ways
+        status = expect(map.size() == 2 && runs[0].length == 8);
+        print_test("Extent insert merges both neighbours", status);
+
+        map.insert(Extent{16, 300, 3 | EXTENT_PACKED});
+        map.insert(Extent{32, 303, 4});     // physically contiguous, but after a packed run
+        bool kept = map.size() == 4 && map.find(20) && map.find(20)->packed() && map.find(20)->span() == CLUSTER_BLOCKS;
+        map.remove(20, 1);                  // a packed run goes whole
+        status = expect(kept && map.size() == 3 && !map.find(16) && map.blockCount() == 14);
+        print_test("Packed extents are never merged or split", status);
+
+        map.reserve(Extent{36, 400, 8});
+        ExtentMap copy;
+        copy.restore(map.stored(), true);
+        bool same = copy.size() == map.size() && copy.reserved().start == 400 && copy.reserved().length == 8;
+        for (size_t i = 0; same && i < map.size(); ++i)
+            same = copy.list()[i].logical == runs[i].logical && copy.list()[i].start == runs[i].start &&
+                   copy.list()[i].length == runs[i].length;
+        status = expect(same);
+        print_test("Extent map stored/restore round trip", status);
+
+        map.remove(0, UINT32_MAX);
+        status = expect(map.size() == 0 && map.reserved().length == 8);
+        print_test("Extent remove of the whole range", status);
+    }
+
+    // A file with holes between every block needs one extent per block,
+    // more than fit inline plus one overflow block
+    {
+        fs_format("extent_test.omni", "default_config.txt");
+        FSInstance* efs = nullptr;
+        status = fs_init((void**)&efs, "extent_test.omni", "default_config.txt");
+        user_manager eusers(efs);
+        file_manager efiles(efs, &eusers);
+        void* s = nullptr;
+        eusers.user_login(&s, "admin", "admin123");
+        const uint64_t bs = efs->header.block_size;
+        const uint32_t pieces = 800;
+        string model;
+        efiles.file_create(s, "/sparse.bin", "", 0);
+        for (uint32_t k = 0; status == 0 && k < pieces; ++k) {
+            string piece(bs / 2, char('a' + k % 26));
+            uint64_t at = 2 * k * bs;
+            status = efiles.file_edit(s, "/sparse.bin", piece.data(), piece.size(), at);
+            model.resize(at + piece.size(), '\0');
+            model.replace(at, piece.size(), piece);
+        }
+        eusers.user_logout(s);
+        fs_shutdown(efs);
+        print_test("Write sparse file with 800 extents", status);
+
+        status = fs_init((void**)&efs, "extent_test.omni", "default_config.txt");
+        user_manager rusers(efs);
+        file_manager rfiles(efs, &rusers);
+        char* content = nullptr;
+        size_t content_size = 0;
+        if (status == 0) status = rfiles.file_read(nullptr, "/sparse.bin", &content, &content_size);
+        FSNode* node = status == 0 ? efs->root->getChild("sparse.bin") : nullptr;
+        if (status == 0)
+            status = expect(content_size == model.size() && memcmp(content, model.data(), model.size()) == 0 &&
+                            node && node->extents && node->extents->size() == pieces);
+        print_test("Reopen reads extent overflow chain", status);
+        delete[] content;
+
+        rusers.user_login(&s, "admin", "admin123");
+        status = rfiles.file_truncate(s, "/sparse.bin");
+        if (status == 0) status = expect(efs->store->blocks_used(efs->root->getChild("sparse.bin")) == 0);
+        print_test("Truncate releases extents and chain", status);
+        rusers.user_logout(s);
+        fs_shutdown(efs);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 11: Change Log Recovery
+    // ------------------------------------------------------------------------
+    // A "crash" drops the instance without shutdown: only what commit()
+    // made durable survives, and the next fs_init replays it.
+    {
+        fs_format("wal_test.omni", "default_config.txt");
+        FSInstance* wfs = nullptr;
+        status = fs_init((void**)&wfs, "wal_test.omni", "default_config.txt");
+        if (status == 0 && !wfs->log) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        user_manager wusers(wfs);
+        file_manager wfiles(wfs, &wusers);
+        void* s = nullptr;
+        wusers.user_login(&s, "admin", "admin123");
+
+        // Checkpoint until the tail sits a few records before the end of
+        // the region, then log past the end without checkpointing
+        string content(400, 'a');
+        if (status == 0) status = wfiles.file_create(s, "/wal.txt", content.data(), content.size());
+        const uint64_t log_size = status == 0 ? layout_of(wfs->header)->log_size : 0;
+        uint64_t tail = disk_log_tail("wal_test.omni"), record = 0;
+        uint32_t edits = 0;
+        while (status == 0) {
+            uint64_t before = tail;
+            uint32_t ops = log_size - tail > 64 * 1024 ? 32 : 1;
+            for (uint32_t k = 0; status == 0 && k < ops; ++k, ++edits) {
+                content[edits % content.size()] = char('a' + edits % 26);
+                status = wfiles.file_edit(s, "/wal.txt", content.data(), content.size(), 0);
+            }
+            if (status == 0) status = wfs->log->checkpoint();
+            tail = disk_log_tail("wal_test.omni");
+            if (tail <= before) status = static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+            record = std::max(record, (tail - before) / ops);
+            if (log_size - tail < 4 * record) break;
+        }
+        for (uint32_t k = 0; status == 0 && k < 12; ++k, ++edits) {
+            content[edits % content.size()] = char('a' + edits % 26);
+            status = wfiles.file_edit(s, "/wal.txt", content.data(), content.size(), 0);
+        }
+        if (status == 0) status = wfs->log->commit();
+        print_test("Log records past the end of the region", status);
+
+        FSInstance* rfs = nullptr;
+        status = fs_init((void**)&rfs, "wal_test.omni", "default_config.txt");
+        user_manager rusers(rfs);
+        file_manager rfiles(rfs, &rusers);
+        char* got = nullptr;
+        size_t got_size = 0;
+        if (status == 0) status = rfiles.file_read(nullptr, "/wal.txt", &got, &got_size);
+        // Recovery checkpoints at the end of what it replayed: past the wrap
+        if (status == 0)
+            status = expect(got_size == content.size() && memcmp(got, content.data(), got_size) == 0 &&
+                            disk_log_tail("wal_test.omni") < tail);
+        print_test("Replay after the log wraps", status);
+        delete[] got;
+
+        // Three one-byte appends of the same record size; the last one is
+        // torn by flipping a byte of its payload
+        rusers.user_login(&s, "admin", "admin123");
+        string big(8000, 'x');
+        status = rfiles.file_create(s, "/torn.txt", big.data(), big.size());
+        if (status == 0) status = rfs->log->checkpoint();
+        uint64_t t0 = disk_log_tail("wal_test.omni");
+        if (status == 0) status = rfiles.file_edit(s, "/torn.txt", "1", 1, 8000);
+        if (status == 0) status = rfs->log->checkpoint();
+        uint64_t t1 = disk_log_tail("wal_test.omni");
+        if (status == 0) status = rfiles.file_edit(s, "/torn.txt", "2", 1, 8001);
+        if (status == 0) status = rfiles.file_edit(s, "/torn.txt", "3", 1, 8002);
+        if (status == 0) status = rfs->log->commit();
+        if (status == 0) {
+            fstream raw("wal_test.omni", ios::in | ios::out | ios::binary);
+            uint64_t at = rfs->header.change_log_offset + t1 + (t1 - t0) + sizeof(LogRecordHeader);
+            char byte = 0;
+            raw.seekg(at);
+            raw.get(byte);
+            raw.seekp(at);
+            raw.put(static_cast<char>(~byte));
+        }
+
+        FSInstance* tfs = nullptr;
+        if (status == 0) status = fs_init((void**)&tfs, "wal_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager tusers(tfs);
+            file_manager tfiles(tfs, &tusers);
+            status = tfiles.file_read(nullptr, "/torn.txt", &got, &got_size);
+            if (status == 0)
+                status = expect(got_size == 8002 && memcmp(got, big.data(), 8000) == 0 && got[8000] == '1' && got[8001] == '2');
+            delete[] got;
+            fs_shutdown(tfs);
+        }
+        print_test("Replay stops at a torn record", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 12: LZ Codec
+    // ------------------------------------------------------------------------
+    {
+        mt19937 rng(7);
+        string noise(70000, '\0');
+        for (char& c : noise) c = static_cast<char>(rng());
+        string text;
+        while (text.size() < 65536) text += "block " + to_string(rng() % 50) + " of the cluster; ";
+
+        status = expect(lz_round_trip("") && lz_round_trip("abc") && lz_round_trip("abcd"));
+        print_test("LZ round trip of tiny inputs", status);
+
+        // A one-byte run is a match overlapping its own output, and needs
+        // extra match length bytes
+        status = expect(lz_round_trip(string(5000, 'z')) && lz_round_trip(text));
+        print_test("LZ round trip of repetitive data", status);
+
+        // Literal runs longer than 15 + 255 need extra literal length bytes
+        status = expect(lz_round_trip(noise) && lz_round_trip(noise.substr(0, 300) + string(600, 'q') + noise.substr(300, 5)));
+        print_test("LZ round trip of incompressible data", status);
+
+        vector<char> packed(text.size());
+        size_t n = LZCodec::compress(text.data(), text.size(), packed.data(), packed.size());
+        vector<char> small(noise.size() / 2);
+        status = expect(n > 0 && n < text.size() / 4 &&
+                        LZCodec::compress(noise.data(), noise.size(), small.data(), small.size()) == 0);
+        print_test("LZ compress ratio and capacity limit", status);
+
+        // Corrupt input must be rejected, never read or written out of bounds
+        string out(text.size(), '\0');
+        bool rejects = !LZCodec::decompress(packed.data(), n / 2, &out[0], out.size()) &&
+                       !LZCodec::decompress(packed.data(), n, &out[0], out.size() - 1) &&
+                       !LZCodec::decompress(packed.data(), n, &out[0], out.size() + 1);
+        const char zero_offset[] = {0x10, 'a', 0x00, 0x00, 0x00};          // offset 0
+        const char far_offset[] = {0x10, 'a', 0x05, 0x00, 0x00};           // back past the start
+        const char open_length[] = {static_cast<char>(0xF0), static_cast<char>(0xFF)};   // length bytes never end
+        rejects = rejects && !LZCodec::decompress(zero_offset, sizeof(zero_offset), &out[0], 5) &&
+                  !LZCodec::decompress(far_offset, sizeof(far_offset), &out[0], 5) &&
+                  !LZCodec::decompress(open_length, sizeof(open_length), &out[0], out.size());
+        for (int k = 0; k < 200; ++k) {
+            vector<char> bad(packed.begin(), packed.begin() + n);
+            bad[rng() % n] ^= static_cast<char>(1 + rng() % 255);
+            LZCodec::decompress(bad.data(), bad.size(), &out[0], out.size());
+        }
+        status = expect(rejects);
+        print_test("LZ decompress rejects corrupt input", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 13: Config Loading
+    // ------------------------------------------------------------------------
+    {
+        const int invalid = static_cast<int>(OFSErrorCodes::ERROR_INVALID_CONFIG);
+        OFSConfig config;
+        status = load_config_text("", &config);
+        if (status == 0)
+            status = expect(config.block_size == DEFAULT_BLOCK_SIZE && config.max_files == DEFAULT_MAX_FILES &&
+                            config.port == DEFAULT_PORT && config.delayed_alloc && config.hash.size() == CONFIG_HASH_LEN);
+        print_test("Config defaults for an empty file", status);
+
+        string text = "[filesystem]\n"
+                      "  block_size\t= 8192   # comment\n"
+                      "max_files=42\n"
+                      "compression = true\n"
+                      "unknown_key = whatever\n"
+                      "not a key line\n"
+                      "[security]\n"
+                      "admin_username = \"root#1\"   # quoted value keeps the '#'\n"
+                      "[server]\n"
+                      "port = 9000\n";
+        config = OFSConfig();
+        status = load_config_text(text, &config);
+        string hash = config.hash;
+        if (status == 0)
+            status = expect(config.block_size == 8192 && config.max_files == 42 && config.compression &&
+                            config.admin_username == "root#1" && config.port == 9000 &&
+                            config.total_size == DEFAULT_TOTAL_SIZE);
+        print_test("Config sections, comments and quotes", status);
+
+        OFSConfig again;
+        load_config_text(text, &again);
+        OFSConfig changed;
+        load_config_text(text + "port = 9001\n", &changed);
+        status = expect(again.hash == hash && changed.hash != hash && changed.port == 9001);
+        print_test("Config hash follows file contents", status);
+
+        const char* bad[] = {
+            "block_size = 256\n",              // below the minimum
+            "block_size = 3000\n",             // not a power of two
+            "block_size = 2097152\n",          // above the maximum
+            "max_users = 0\n",
+            "port = 70000\n",
+            "max_files = 12abc\n",
+            "max_files = -5\n",
+            "total_size = 99999999999999999999999\n",
+            "dedup = maybe\n",
+            "admin_username = \"\"\n",
+            "admin_username = this_name_is_far_too_long_for_a_user_slot\n",
+        };
+        status = 0;
+        for (const char* line : bad) {
+            OFSConfig rejected;
+            if (load_config_text(line, &rejected) != invalid) {
+                cout << "  accepted: " << line;
+                status = invalid;
+            }
+        }
+        print_test("Config rejects malformed or out-of-range keys", status);
+
+        OFSConfig missing;
+        missing.port = 1234;
+        status = expect(config_load("no_such_config.uconf", &missing) == static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR) &&
+                        missing.port == 1234);
+        print_test("Config load of a missing file", status);
+
+        // Format-time keys shape the container and the hash is recorded
+        load_config_text("block_size = 8192\nmax_files = 64\n", &config);
+        status = fs_format("config_test.omni", "config_test.uconf");
+        FSInstance* cfs = nullptr;
+        if (status == 0) status = fs_init((void**)&cfs, "config_test.omni", "config_test.uconf");
+        if (status == 0) {
+            status = expect(cfs->header.block_size == 8192 && layout_of(cfs->header)->max_files == 64 &&
+                            memcmp(cfs->header.config_hash, config.hash.data(), CONFIG_HASH_LEN) == 0);
+            fs_shutdown(cfs);
+        }
+        print_test("Format from config records its hash", status);
+
+        load_config_text("block_size = 1000\n", &config);
+        status = expect(fs_format("config_bad.omni", "config_test.uconf") == invalid);
+        print_test("Format refuses an invalid config", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 14: Free Space Search
+    // ------------------------------------------------------------------------
+    {
+        const uint64_t group = SUMMARY_GROUP_BLOCKS;
+        FreeSpaceManager words(200);
+        for (uint64_t i = 0; i < 200; ++i) words.markUsed(i);
+        words.free(60, 11);                 // crosses the word boundary at 64
+        status = expect(words.findFreeBlocks(11) == 60 && words.findFreeBlocks(12) == -1 && words.freeCount() == 11);
+        print_test("Free run across a bitmap word", status);
+
+        const uint64_t total = 3 * group + 100;
+        FreeSpaceManager groups(total);
+        for (uint64_t i = 0; i < total; ++i) groups.markUsed(i);
+        groups.free(100, 10);
+        groups.free(group - 6, 16);         // crosses the first group boundary
+        status = expect(groups.findFreeBlocks(16) == static_cast<int64_t>(group - 6) &&
+                        groups.findFreeBlocks(10) == 100 && groups.findFreeBlocks(17) == -1);
+        print_test("Free run across a summary group", status);
+
+        groups.free(group + 20, 2 * group);  // spans a whole group into the last one
+        uint64_t largest = 0;
+        uint64_t runs = groups.freeRuns(&largest);
+        status = expect(groups.findFreeBlocks(group + 100) == static_cast<int64_t>(group + 20) &&
+                        runs == 3 && largest == 2 * group);
+        print_test("Free run spanning several groups", status);
+
+        // Blocks past the end of the last group never count as free
+        FreeSpaceManager tail(group + 4);
+        status = expect(tail.findFreeBlocks(group + 4) == 0 && tail.findFreeBlocks(group + 5) == -1);
+        print_test("Free search stops at the last block", status);
+
+        FreeSpaceManager alloc(10000);
+        int64_t a = alloc.allocate(group);
+        int64_t b = alloc.allocate(10);
+        alloc.free(0, group);
+        status = expect(a == 0 && b == static_cast<int64_t>(group) &&
+                        alloc.findFreeBlocks(group + 1) == static_cast<int64_t>(group + 10) &&
+                        alloc.findFreeBlocks(group) == 0 && alloc.allocate(10000) == -1);
+        print_test("Free search follows allocate and free", status);
+
+        FreeSpaceManager grown(5000);
+        for (uint64_t i = 0; i < 5000; ++i) grown.markUsed(i);
+        grown.grow(9000);
+        status = expect(grown.findFreeBlocks(4000) == 5000 && grown.findFreeBlocks(4001) == -1 && grown.freeCount() == 4000);
+        print_test("Free search after grow", status);
+
+        vector<uint8_t> image(grown.data(), grown.data() + grown.byteSize());
+        image[0] = 0;                       // blocks 0..7 free again
+        grown.setBitmap(image);
+        status = expect(grown.findFreeBlocks(8) == 0 && grown.findFreeBlocks(9) == 5000);
+        print_test("Free search after setBitmap", status);
+
+        // Random allocations and frees against a plain scan
+        mt19937 rng(25);
+        const uint64_t blocks = 5 * group + 321;
+        FreeSpaceManager fsm(blocks);
+        vector<pair<int64_t, uint64_t>> held;
+        status = 0;
+        for (int op = 0; status == 0 && op < 4000; ++op) {
+            uint64_t n = 1 + (rng() % 8 == 0 ? rng() % 3000 : rng() % 40);
+            if (held.empty() || rng() % 3 != 0) {
+                int64_t expected = naive_find(fsm, blocks, n);
+                int64_t start = fsm.allocate(n);
+                if (start != expected) status = static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+                if (start >= 0) held.push_back({start, n});
+            } else {
+                size_t k = rng() % held.size();
+                fsm.free(held[k].first, held[k].second);
+                held.erase(held.begin() + k);
+            }
+        }
+        print_test("Free search matches a plain scan", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 15: Deduplication
+    // ------------------------------------------------------------------------
+    {
+        OFSConfig dcfg;
+        load_config_text("dedup = 1\n", &dcfg);
+        fs_format("dedup_test.omni", "config_test.uconf");
+        FSInstance* dfs = nullptr;
+        status = fs_init((void**)&dfs, "dedup_test.omni", "config_test.uconf");
+        user_manager dusers(dfs);
+        file_manager dfiles(dfs, &dusers);
+        void* s = nullptr;
+        dusers.user_login(&s, "admin", "admin123");
+        const uint64_t bs = dfs->header.block_size;
+        string content;
+        for (uint32_t k = 0; k < 8; ++k) content += string(bs, char('A' + k));
+        if (status == 0) status = dfiles.file_create(s, "/a.bin", content.data(), content.size());
+        if (status == 0) status = dfiles.file_create(s, "/b.bin", content.data(), content.size());
+        if (status == 0) status = dfs->log->commit();       // places the delayed blocks
+        DedupStats st = dfs->store->dedup_stats();
+        if (status == 0) status = expect(st.logical == 16 && st.physical == 8);
+        print_test("Dedup stores identical files once", status);
+
+        string patch(100, 'z');
+        string model = content;
+        model.replace(3 * bs + 10, patch.size(), patch);
+        if (status == 0) status = dfiles.file_edit(s, "/b.bin", patch.data(), patch.size(), 3 * bs + 10);
+        st = dfs->store->dedup_stats();
+        if (status == 0)
+            status = expect(read_file(dfiles, "/a.bin") == content && read_file(dfiles, "/b.bin") == model &&
+                            st.logical == 16 && st.physical == 9);
+        print_test("Dedup copies a shared block on write", status);
+
+        if (status == 0) status = dfiles.file_delete(s, "/a.bin");
+        if (status == 0) status = dfs->log->commit();
+        st = dfs->store->dedup_stats();
+        if (status == 0) status = expect(read_file(dfiles, "/b.bin") == model && st.logical == 8 && st.physical == 8);
+        print_test("Dedup delete keeps blocks another file maps", status);
+
+        if (status == 0) status = dfiles.file_create(s, "/c.bin", model.data(), model.size());
+        dusers.user_logout(s);
+        fs_shutdown(dfs);
+
+        // Turning dedup off must not make shared blocks look private
+        load_config_text("dedup = 0\n", &dcfg);
+        FSInstance* ofs = nullptr;
+        if (status == 0) status = fs_init((void**)&ofs, "dedup_test.omni", "config_test.uconf");
+        if (status == 0) {
+            user_manager ousers(ofs);
+            file_manager ofiles(ofs, &ousers);
+            ousers.user_login(&s, "admin", "admin123");
+            string other(bs, 'q');
+            status = expect(ofs->dedup && (layout_of(ofs->header)->features & CONTAINER_DEDUP) &&
+                            ofs->store->dedup_stats().physical == 8);
+            if (status == 0) status = ofiles.file_edit(s, "/c.bin", other.data(), other.size(), 0);
+            if (status == 0) status = ofiles.file_delete(s, "/c.bin");
+            if (status == 0) status = ofs->log->commit();
+            string fill(8 * bs, 'r');
+            if (status == 0) status = ofiles.file_create(s, "/d.bin", fill.data(), fill.size());
+            if (status == 0) status = ofs->log->commit();
+            if (status == 0) status = expect(read_file(ofiles, "/b.bin") == model && read_file(ofiles, "/d.bin") == fill);
+            ousers.user_logout(s);
+            fs_shutdown(ofs);
+        }
+        print_test("Dedup stays on for a deduped container", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 16: Delayed Allocation
+    // ------------------------------------------------------------------------
+    // Free space is cut into single blocks; the delayed write still fits,
+    // just not in one run, and nothing else may take its blocks first.
+    {
+        fs_format("delay_test.omni", "default_config.txt");
+        FSInstance* afs = nullptr;
+        status = fs_init((void**)&afs, "delay_test.omni", "default_config.txt");
+        if (status == 0 && !afs->delayed_alloc) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        user_manager ausers(afs);
+        file_manager afiles(afs, &ausers);
+        void* s = nullptr;
+        ausers.user_login(&s, "admin", "admin123");
+        const uint64_t bs = afs->header.block_size;
+        if (status == 0) status = afiles.file_create(s, "/late.bin", "", 0);
+        if (status == 0) status = afs->log->commit();
+
+        vector<int64_t> taken;
+        for (int64_t b; (b = afs->fsm->allocate(1)) >= 0;) taken.push_back(b);
+        for (size_t k = taken.size() - 128; k < taken.size(); k += 2) afs->fsm->free(taken[k], 1);
+        string model;
+        for (uint32_t k = 0; k < 40; ++k) model += string(bs, char('a' + k % 26));
+        if (status == 0) status = afiles.file_edit(s, "/late.bin", model.data(), model.size(), 0);
+        if (status == 0) status = expect(afs->store->has_delayed(afs->root->getChild("late.bin")));
+        // 64 blocks are free and 40 of them held: only 24 are left to take
+        size_t before = taken.size();
+        for (int64_t b; (b = afs->fsm->allocate(1)) >= 0;) taken.push_back(b);
+        if (status == 0) status = expect(taken.size() - before == 24);
+        for (size_t k = before; k < taken.size(); ++k) afs->fsm->free(taken[k], 1);
+        print_test("Delayed blocks are held until placement", status);
+
+        if (status == 0) status = afs->log->commit();
+        FSNode* late = status == 0 ? afs->root->getChild("late.bin") : nullptr;
+        if (status == 0)
+            status = expect(!afs->store->has_delayed(late) && late->extents->size() > 1 &&
+                            read_file(afiles, "/late.bin") == model);
+        print_test("Delayed placement over fragmented space", status);
+
+        // Crash: the committed placement is all that is left
+        FSInstance* rfs = nullptr;
+        if (status == 0) status = fs_init((void**)&rfs, "delay_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager rusers(rfs);
+            file_manager rfiles(rfs, &rusers);
+            status = expect(read_file(rfiles, "/late.bin") == model);
+            fs_shutdown(rfs);
+        }
+        print_test("Delayed placement survives a crash", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 17: Lazy Loading
+    // ------------------------------------------------------------------------
+    // Stats, reference counts and replay read what they need from the
+    // metadata index: directories nobody looked up stay on disk.
+    {
+        OFSConfig lcfg;
+        load_config_text("lazy_load = 1\ncompression = 1\ndedup = 1\n", &lcfg);
+        fs_format("lazy_test.omni", "config_test.uconf");
+        FSInstance* lfs = nullptr;
+        status = fs_init((void**)&lfs, "lazy_test.omni", "config_test.uconf");
+        CompressionStats packed = {0, 0};
+        FragmentationStats frag = {0, 0};
+        string text(32 * 4096, 'x');
+        if (status == 0) {
+            user_manager lusers(lfs);
+            file_manager lfiles(lfs, &lusers);
+            dir_manager ldirs(lfs, &lusers);
+            void* s = nullptr;
+            lusers.user_login(&s, "admin", "admin123");
+            const char* paths[] = {"/cold/a.txt", "/cold/deep/b.txt", "/warm/c.txt"};
+            status = ldirs.dir_create(s, "/cold");
+            if (status == 0) status = ldirs.dir_create(s, "/cold/deep");
+            if (status == 0) status = ldirs.dir_create(s, "/warm");
+            for (const char* path : paths)
+                if (status == 0) status = lfiles.file_create(s, path, text.data(), text.size());
+            if (status == 0) status = lfs->log->commit();
+            packed = lfs->store->compression_stats();
+            frag = lfs->store->fragmentation_stats();
+            if (status == 0) status = expect(packed.logical == 96 && packed.stored < packed.logical);
+            lusers.user_logout(s);
+            fs_shutdown(lfs);
+        }
+
+        if (status == 0) status = fs_init((void**)&lfs, "lazy_test.omni", "config_test.uconf");
+        if (status == 0) {
+            user_manager lusers(lfs);
+            metadata lmeta(lfs);
+            FSStats lstats;
+            status = lmeta.get_stats(nullptr, &lstats);
+            CompressionStats p2 = lfs->store->compression_stats();
+            FragmentationStats f2 = lfs->store->fragmentation_stats();
+            FSNode* cold = lfs->root->getChild("cold");
+            if (status == 0)
+                status = expect(lstats.total_files == 3 && lstats.total_directories == 4 && cold &&
+                                !cold->childrenLoaded() && !lfs->root->getChild("warm")->childrenLoaded() &&
+                                p2.logical == packed.logical && p2.stored == packed.stored &&
+                                f2.files == frag.files && f2.fragments == frag.fragments &&
+                                lfs->store->dedup_stats().logical == packed.stored);
+            print_test("Lazy stats leave directories unloaded", status);
+
+            // Crash after an edit: replay loads the path it touches
+            file_manager lfiles(lfs, &lusers);
+            void* s = nullptr;
+            lusers.user_login(&s, "admin", "admin123");
+            string patch(100, 'y');
+            if (status == 0) status = lfiles.file_edit(s, "/warm/c.txt", patch.data(), patch.size(), 4096);
+            if (status == 0) status = lfs->log->commit();
+        }
+        FSInstance* rfs = nullptr;
+        if (status == 0) status = fs_init((void**)&rfs, "lazy_test.omni", "config_test.uconf");
+        if (status == 0) {
+            FSNode* cold = rfs->root->getChild("cold");
+            FSNode* warm = rfs->root->getChild("warm");
+            FSNode* c = warm && warm->childrenLoaded() ? warm->getChild("c.txt") : nullptr;
+            status = expect(cold && !cold->childrenLoaded() && c && c->entry->size == text.size());
+            if (status == 0) {
+                user_manager rusers(rfs);
+                file_manager rfiles(rfs, &rusers);
+                string model = text;
+                model.replace(4096, 100, string(100, 'y'));
+                status = expect(read_file(rfiles, "/warm/c.txt") == model && !cold->childrenLoaded() &&
+                                rfs->store->compression_stats().logical == packed.logical);
+            }
+            fs_shutdown(rfs);
+        }
+        print_test("Lazy replay loads only the paths it touches", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 18: Snapshots
+    // ------------------------------------------------------------------------
+    // A write moves the live file off the frozen blocks; the snapshot reads
+    // the old bytes, also after a reopen, until it is dropped.
+    {
+        fs_format("snap_test.omni", "default_config.txt");
+        FSInstance* sfs = nullptr;
+        status = fs_init((void**)&sfs, "snap_test.omni", "default_config.txt");
+        if (status == 0 && !sfs->snapshots) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        void* s = nullptr;
+        const uint64_t bs = status == 0 ? sfs->header.block_size : 0;
+        string before(4 * bs, 'o'), after(4 * bs, 'n');
+        uint32_t id = 0;
+        auto read_snapshot = [](FSInstance* fs, uint32_t snap, const char* path) {
+            string out(64 * 1024, '\0');
+            size_t got = 0;
+            if (fs->snapshots->read(snap, path, 0, &out[0], out.size(), &got) != 0) return string("<error>");
+            out.resize(got);
+            return out;
+        };
+        if (status == 0) {
+            user_manager susers(sfs);
+            file_manager sfiles(sfs, &susers);
+            susers.user_login(&s, "admin", "admin123");
+            status = sfiles.file_create(s, "/keep.bin", before.data(), before.size());
+            if (status == 0) status = sfs->log->commit();
+            if (status == 0) status = sfs->snapshots->create("before", &id);
+            uint64_t free_before = sfs->fsm->freeCount();
+            if (status == 0) status = sfiles.file_edit(s, "/keep.bin", after.data(), after.size(), 0);
+            if (status == 0) status = sfs->log->commit();
+            if (status == 0)
+                status = expect(read_file(sfiles, "/keep.bin") == after && read_snapshot(sfs, id, "/keep.bin") == before &&
+                                sfs->fsm->freeCount() + 4 <= free_before);
+            susers.user_logout(s);
+            fs_shutdown(sfs);
+        }
+        print_test("Snapshot keeps frozen blocks on write", status);
+
+        if (status == 0) status = fs_init((void**)&sfs, "snap_test.omni", "default_config.txt");
+        uint64_t free_held = 0, tree_blocks = 0;
+        if (status == 0) {
+            user_manager susers(sfs);
+            file_manager sfiles(sfs, &susers);
+            status = expect(sfs->snapshots->list().size() == 1 && read_snapshot(sfs, id, "/keep.bin") == before &&
+                            read_file(sfiles, "/keep.bin") == after);
+            if (status == 0) {
+                free_held = sfs->fsm->freeCount();
+                tree_blocks = sfs->snapshots->list()[0].tree_blocks;
+                status = sfs->snapshots->remove(id);
+            }
+            if (status == 0)
+                status = expect(sfs->snapshots->list().empty() && sfs->fsm->freeCount() == free_held + 4 + tree_blocks &&
+                                sfs->snapshots->remove(id) == static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND));
+            fs_shutdown(sfs);
+        }
+        print_test("Snapshot reads after reopen, delete frees its blocks", status);
+
+        if (status == 0) status = fs_init((void**)&sfs, "snap_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager susers(sfs);
+            file_manager sfiles(sfs, &susers);
+            status = expect(sfs->snapshots->list().empty() && sfs->fsm->freeCount() == free_held + 4 + tree_blocks &&
+                            read_file(sfiles, "/keep.bin") == after);
+            for (uint32_t k = 0; status == 0 && k < MAX_SNAPSHOTS; ++k) status = sfs->snapshots->create("", &id);
+            if (status == 0)
+                status = expect(sfs->snapshots->create("", &id) == static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE));
+            fs_shutdown(sfs);
+        }
+        print_test("Snapshot delete is durable and creation is capped", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 19: Mapped Checkpoints
+    // ------------------------------------------------------------------------
+    // A background checkpoint copies into the mapping under the lock and
+    // syncs what it copied; a crash right after it loses nothing.
+    {
+        fs_format("map_test.omni", "default_config.txt");
+        FSInstance* mfs = nullptr;
+        status = fs_init_mapped((void**)&mfs, "map_test.omni", "default_config.txt");
+        if (status == 0 && !mfs->log) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        string small(100, 's'), large(3 * 4096 + 7, 'l');
+        if (status == 0) {
+            user_manager musers(mfs);
+            file_manager mfiles(mfs, &musers);
+            dir_manager mdirs(mfs, &musers);
+            void* s = nullptr;
+            musers.user_login(&s, "admin", "admin123");
+            status = mdirs.dir_create(s, "/m");
+            if (status == 0) status = mfiles.file_create(s, "/m/small.txt", small.data(), small.size());
+            if (status == 0) status = mfiles.file_create(s, "/m/large.bin", large.data(), large.size());
+            if (status == 0) status = mfs->log->checkpoint(true);
+        }
+        FSInstance* rfs = nullptr;
+        if (status == 0) status = fs_init_mapped((void**)&rfs, "map_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager rusers(rfs);
+            file_manager rfiles(rfs, &rusers);
+            status = expect(disk_log_tail("map_test.omni") != 0 && read_file(rfiles, "/m/small.txt") == small &&
+                            read_file(rfiles, "/m/large.bin") == large);
+            fs_shutdown(rfs);
+        }
+        print_test("Mapped checkpoint survives a crash", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 20: Sparse Files
+    // ------------------------------------------------------------------------
+    // Writing past the end leaves a hole: it reads as zeros and takes no
+    // blocks, before and after a reopen.
+    {
+        fs_format("sparse_test.omni", "default_config.txt");
+        FSInstance* pfs = nullptr;
+        status = fs_init((void**)&pfs, "sparse_test.omni", "default_config.txt");
+        const uint64_t bs = status == 0 ? pfs->header.block_size : 0;
+        string tail_data(bs, 't');
+        string model = "head" + string(10 * bs - 4, '\0') + tail_data;
+        if (status == 0) {
+            user_manager pusers(pfs);
+            file_manager pfiles(pfs, &pusers);
+            metadata pmeta(pfs);
+            void* s = nullptr;
+            pusers.user_login(&s, "admin", "admin123");
+            status = pfiles.file_create(s, "/sparse.bin", "head", 4);
+            uint64_t free_before = pfs->fsm->freeCount();
+            if (status == 0) status = pfiles.file_edit(s, "/sparse.bin", tail_data.data(), tail_data.size(), 10 * bs);
+            if (status == 0) status = pfs->log->checkpoint();
+            FileMetadata info;
+            if (status == 0) status = pmeta.get_metadata(s, "/sparse.bin", &info);
+            if (status == 0)
+                status = expect(read_file(pfiles, "/sparse.bin") == model && info.blocks_used == 2 &&
+                                free_before - pfs->fsm->freeCount() == 2);
+
+            // A ranged read that lies inside the hole
+            string hole(2 * bs, 'x');
+            size_t got = 0;
+            if (status == 0) status = pfiles.file_read_at(s, "/sparse.bin", 3 * bs, &hole[0], hole.size(), &got);
+            if (status == 0) status = expect(got == hole.size() && hole == string(2 * bs, '\0'));
+            pusers.user_logout(s);
+            fs_shutdown(pfs);
+        }
+        print_test("Sparse hole reads as zeros and takes no blocks", status);
+
+        if (status == 0) status = fs_init((void**)&pfs, "sparse_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager pusers(pfs);
+            file_manager pfiles(pfs, &pusers);
+            metadata pmeta(pfs);
+            void* s = nullptr;
+            pusers.user_login(&s, "admin", "admin123");
+            FileMetadata info;
+            status = pmeta.get_metadata(s, "/sparse.bin", &info);
+            if (status == 0)
+                status = expect(read_file(pfiles, "/sparse.bin") == model && info.blocks_used == 2 &&
+                                info.entry.size == 11 * bs);
+            pusers.user_logout(s);
+            fs_shutdown(pfs);
+        }
+        print_test("Sparse file keeps its holes after reopen", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 21: Inline Files
+    // ------------------------------------------------------------------------
+    // A tiny file takes an inline slot and no block; growing it past the
+    // slot moves it to blocks and the next tiny file gets the slot back.
+    {
+        fs_format("inline_test.omni", "default_config.txt");
+        FSInstance* ifs = nullptr;
+        status = fs_init((void**)&ifs, "inline_test.omni", "default_config.txt");
+        if (status == 0 && !ifs->inline_slots) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        string tiny(100, 'i'), grown(INLINE_SLOT_SIZE + 300, 'g'), other(50, 'o');
+        if (status == 0) {
+            user_manager iusers(ifs);
+            file_manager ifiles(ifs, &iusers);
+            void* s = nullptr;
+            iusers.user_login(&s, "admin", "admin123");
+            uint64_t blocks_free = ifs->fsm->freeCount(), slots_free = ifs->inline_slots->freeCount();
+            status = ifiles.file_create(s, "/tiny.txt", tiny.data(), tiny.size());
+            if (status == 0) status = ifs->log->checkpoint();
+            const FileEntry* entry = status == 0 ? ifs->root->getChild("tiny.txt")->entry : nullptr;
+            uint32_t slot = entry ? block_store::content_ref(entry).overflow_block : 0;
+            if (status == 0)
+                status = expect(block_store::is_inline(entry) && ifs->fsm->freeCount() == blocks_free &&
+                                ifs->inline_slots->freeCount() == slots_free - 1 && read_file(ifiles, "/tiny.txt") == tiny);
+            print_test("Inline file takes a slot and no block", status);
+
+            if (status == 0) status = ifiles.file_edit(s, "/tiny.txt", grown.data(), grown.size(), 0);
+            if (status == 0) status = ifs->log->checkpoint();
+            if (status == 0)
+                status = expect(!block_store::is_inline(entry) && ifs->fsm->freeCount() < blocks_free &&
+                                ifs->inline_slots->freeCount() == slots_free && read_file(ifiles, "/tiny.txt") == grown);
+            if (status == 0) status = ifiles.file_create(s, "/other.txt", other.data(), other.size());
+            if (status == 0) status = ifs->log->checkpoint();
+            const FileEntry* second = status == 0 ? ifs->root->getChild("other.txt")->entry : nullptr;
+            if (status == 0)
+                status = expect(block_store::is_inline(second) && block_store::content_ref(second).overflow_block == slot &&
+                                read_file(ifiles, "/other.txt") == other);
+            print_test("Inline promotion frees the slot for reuse", status);
+            iusers.user_logout(s);
+            fs_shutdown(ifs);
+        }
+
+        if (status == 0) status = fs_init((void**)&ifs, "inline_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager iusers(ifs);
+            file_manager ifiles(ifs, &iusers);
+            status = expect(read_file(ifiles, "/tiny.txt") == grown && read_file(ifiles, "/other.txt") == other &&
+                            ifs->inline_slots->freeCount() == layout_of(ifs->header)->max_files - 1);
+            fs_shutdown(ifs);
+        }
+        print_test("Inline files after reopen", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 22: Compression
+    // ------------------------------------------------------------------------
+    // Text packs into fewer blocks than it spans; partial and whole-cluster
+    // overwrites read back exactly, packed or not.
+    {
+        OFSConfig ccfg;
+        load_config_text("compression = 1\n", &ccfg);
+        fs_format("lz_test.omni", "config_test.uconf");
+        FSInstance* cfs = nullptr;
+        status = fs_init((void**)&cfs, "lz_test.omni", "config_test.uconf");
+        if (status == 0 && !cfs->compression) status = static_cast<int>(OFSErrorCodes::ERROR_NOT_IMPLEMENTED);
+        const uint64_t bs = status == 0 ? cfs->header.block_size : 0;
+        const uint64_t span = 2 * CLUSTER_BLOCKS * bs;
+        string model;
+        for (uint32_t k = 0; model.size() < span; ++k) model += "line " + to_string(k % 97) + " of a compressible file\n";
+        model.resize(span);
+        std::mt19937 rng(7);
+        string noise(CLUSTER_BLOCKS * bs, '\0');
+        for (char& c : noise) c = char(rng());
+        if (status == 0) {
+            user_manager cusers(cfs);
+            file_manager cfiles(cfs, &cusers);
+            void* s = nullptr;
+            cusers.user_login(&s, "admin", "admin123");
+            uint64_t free_before = cfs->fsm->freeCount();
+            status = cfiles.file_create(s, "/text.log", model.data(), model.size());
+            if (status == 0) status = cfs->log->checkpoint();
+            CompressionStats st = cfs->store->compression_stats();
+            if (status == 0)
+                status = expect(read_file(cfiles, "/text.log") == model && st.logical == 2 * CLUSTER_BLOCKS &&
+                                st.stored < CLUSTER_BLOCKS && free_before - cfs->fsm->freeCount() < 2 * CLUSTER_BLOCKS);
+            print_test("Compressed write packs clusters", status);
+
+            // A short patch inside the first cluster, then noise over the second
+            if (status == 0) status = cfiles.file_edit(s, "/text.log", noise.data(), 100, bs + 10);
+            model.replace(bs + 10, 100, noise.substr(0, 100));
+            if (status == 0) status = cfiles.file_edit(s, "/text.log", noise.data(), noise.size(), CLUSTER_BLOCKS * bs);
+            model.replace(CLUSTER_BLOCKS * bs, noise.size(), noise);
+            if (status == 0) status = cfs->log->checkpoint();
+            st = cfs->store->compression_stats();
+            if (status == 0)
+                status = expect(read_file(cfiles, "/text.log") == model && st.logical == CLUSTER_BLOCKS);
+            print_test("Compressed overwrite repacks clusters", status);
+            cusers.user_logout(s);
+            fs_shutdown(cfs);
+        }
+
+        if (status == 0) status = fs_init((void**)&cfs, "lz_test.omni", "config_test.uconf");
+        if (status == 0) {
+            user_manager cusers(cfs);
+            file_manager cfiles(cfs, &cusers);
+            status = expect(read_file(cfiles, "/text.log") == model &&
+                            cfs->store->compression_stats().logical == CLUSTER_BLOCKS);
+            fs_shutdown(cfs);
+        }
+        print_test("Compressed file after reopen", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 23: Defragmentation
+    // ------------------------------------------------------------------------
+    // Two files appended a block at a time interleave on disk; merging the
+    // pieces of one keeps its bytes, also across a crash once committed.
+    {
+        OFSConfig gcfg;
+        load_config_text("delayed_alloc = 0\n", &gcfg);
+        fs_format("defrag_test.omni", "config_test.uconf");
+        FSInstance* gfs = nullptr;
+        status = fs_init((void**)&gfs, "defrag_test.omni", "config_test.uconf");
+        const uint64_t bs = status == 0 ? gfs->header.block_size : 0;
+        string a, b;
+        if (status == 0) {
+            user_manager gusers(gfs);
+            file_manager gfiles(gfs, &gusers);
+            metadata gmeta(gfs);
+            void* s = nullptr;
+            gusers.user_login(&s, "admin", "admin123");
+            status = gfiles.file_create(s, "/a.bin", "", 0);
+            if (status == 0) status = gfiles.file_create(s, "/b.bin", "", 0);
+            for (uint32_t k = 0; status == 0 && k < 12; ++k) {
+                string block_a(bs, char('a' + k)), block_b(bs, char('A' + k));
+                status = gfiles.file_edit(s, "/a.bin", block_a.data(), bs, a.size());
+                if (status == 0) status = gfiles.file_edit(s, "/b.bin", block_b.data(), bs, b.size());
+                a += block_a;
+                b += block_b;
+            }
+            if (status == 0) status = gfs->log->commit();
+            FSNode* node = status == 0 ? gfs->root->getChild("a.bin") : nullptr;
+            FSStats before, after;
+            if (status == 0) status = gmeta.get_stats(s, &before);
+            if (status == 0) status = expect(gfs->store->fragments(node) > 1 && before.fragmentation > 0);
+
+            bool moved = true;
+            while (status == 0 && moved) {
+                status = gfs->store->defragment(node, &moved);
+                if (status == 0 && moved) {
+                    fs_log_entry(gfs, node);
+                    status = gfs->log->commit();
+                }
+            }
+            if (status == 0) status = gmeta.get_stats(s, &after);
+            if (status == 0)
+                status = expect(gfs->store->fragments(node) == 1 && after.fragmentation < before.fragmentation &&
+                                read_file(gfiles, "/a.bin") == a && read_file(gfiles, "/b.bin") == b);
+            gusers.user_logout(s);
+        }
+        print_test("Defragment merges a file's pieces", status);
+
+        // Crash: the merged map is what the log replays
+        FSInstance* rfs = nullptr;
+        if (status == 0) status = fs_init((void**)&rfs, "defrag_test.omni", "config_test.uconf");
+        if (status == 0) {
+            user_manager rusers(rfs);
+            file_manager rfiles(rfs, &rusers);
+            status = expect(rfs->store->fragments(rfs->root->getChild("a.bin")) == 1 &&
+                            read_file(rfiles, "/a.bin") == a && read_file(rfiles, "/b.bin") == b);
+            fs_shutdown(rfs);
+        }
+        print_test("Defragmented file survives a crash", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 24: Preallocation
+    // ------------------------------------------------------------------------
+    // A reservation is one run the file's writes fill front to back, while
+    // another file written in between has to go elsewhere.
+    {
+        fs_format("falloc_test.omni", "default_config.txt");
+        FSInstance* rfs = nullptr;
+        status = fs_init((void**)&rfs, "falloc_test.omni", "default_config.txt");
+        const uint64_t bs = status == 0 ? rfs->header.block_size : 0;
+        string upload, other;
+        if (status == 0) {
+            user_manager rusers(rfs);
+            file_manager rfiles(rfs, &rusers);
+            metadata rmeta(rfs);
+            void* s = nullptr;
+            rusers.user_login(&s, "admin", "admin123");
+            status = rfiles.file_create(s, "/upload.bin", "", 0);
+            if (status == 0) status = rfiles.file_create(s, "/other.bin", "", 0);
+            if (status == 0) status = rfs->log->checkpoint();
+            uint64_t free_before = rfs->fsm->freeCount();
+            if (status == 0) status = rfiles.file_fallocate(s, "/upload.bin", 8 * bs);
+            FileMetadata info;
+            if (status == 0) status = rmeta.get_metadata(s, "/upload.bin", &info);
+            if (status == 0)
+                status = expect(info.entry.size == 0 && info.blocks_used == 8 && free_before - rfs->fsm->freeCount() == 8);
+            print_test("Fallocate reserves one run", status);
+
+            for (uint32_t k = 0; status == 0 && k < 8; ++k) {
+                string block_u(bs, char('0' + k)), block_o(bs, char('a' + k));
+                status = rfiles.file_edit(s, "/upload.bin", block_u.data(), bs, upload.size());
+                if (status == 0) status = rfiles.file_edit(s, "/other.bin", block_o.data(), bs, other.size());
+                if (status == 0) status = rfs->log->commit();
+                upload += block_u;
+                other += block_o;
+            }
+            if (status == 0) status = rfs->log->checkpoint();
+            if (status == 0) status = rmeta.get_metadata(s, "/upload.bin", &info);
+            FSNode* node = status == 0 ? rfs->root->getChild("upload.bin") : nullptr;
+            if (status == 0)
+                status = expect(info.blocks_used == 8 && rfs->store->fragments(node) == 1 &&
+                                free_before - rfs->fsm->freeCount() == 16 &&
+                                read_file(rfiles, "/upload.bin") == upload && read_file(rfiles, "/other.bin") == other);
+            rusers.user_logout(s);
+            fs_shutdown(rfs);
+        }
+        print_test("Writes fill the reservation front to back", status);
+
+        if (status == 0) status = fs_init((void**)&rfs, "falloc_test.omni", "default_config.txt");
+        if (status == 0) {
+            user_manager rusers(rfs);
+            file_manager rfiles(rfs, &rusers);
+            status = expect(rfs->store->fragments(rfs->root->getChild("upload.bin")) == 1 &&
+                            read_file(rfiles, "/upload.bin") == upload && read_file(rfiles, "/other.bin") == other);
+            fs_shutdown(rfs);
+        }
+        print_test("Filled reservation after reopen", status);
+    }
+
+    // ------------------------------------------------------------------------
+    // Step 25: Online Growth
+    // ------------------------------------------------------------------------
+    // A full container grows up to its formatted max_size, keeps what it
+    // held and takes the write it refused, also after a reopen.
+    {
+        OFSConfig wcfg;
+        load_config_text("total_size = 8388608\nmax_size = 16777216\n", &wcfg);
+        fs_format("grow_test.omni", "config_test.uconf");
+        FSInstance* gfs = nullptr;
+        status = fs_init((void**)&gfs, "grow_test.omni", "config_test.uconf");
+        const uint64_t bs = status == 0 ? gfs->header.block_size : 0;
+        string fill, late;
+        if (status == 0) {
+            user_manager gusers(gfs);
+            file_manager gfiles(gfs, &gusers);
+            void* s = nullptr;
+            gusers.user_login(&s, "admin", "admin123");
+            fill.assign(gfs->fsm->freeCount() * bs / 2, 'f');
+            late.assign(fill.size() + bs, 'l');
+            status = gfiles.file_create(s, "/fill.bin", fill.data(), fill.size());
+            if (status == 0) status = gfs->log->checkpoint();
+            // The refused write's partial blocks come back once its frees are durable
+            uint64_t free_before = gfs->fsm->freeCount();
+            int refused = gfiles.file_create(s, "/late.bin", late.data(), late.size());
+            if (refused == 0) refused = gfs->log->checkpoint();
+            if (status == 0) status = expect(refused == static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE));
+            if (status == 0) status = expect(fs_grow(gfs, 33554432) != 0 && fs_grow(gfs, 4194304) != 0);
+            if (status == 0) status = fs_grow(gfs, 16777216);
+            if (status == 0)
+                status = expect(gfs->header.total_size == 16777216 && gfs->fsm->freeCount() == free_before + 8388608 / bs);
+            if (status == 0 && gfiles.file_exists(s, "/late.bin") == 0) status = gfiles.file_delete(s, "/late.bin");
+            if (status == 0) status = gfiles.file_create(s, "/late.bin", late.data(), late.size());
+            if (status == 0) status = gfs->log->checkpoint();
+            if (status == 0)
+                status = expect(read_file(gfiles, "/fill.bin") == fill && read_file(gfiles, "/late.bin") == late);
+            gusers.user_logout(s);
+            fs_shutdown(gfs);
+        }
+        print_test("Grow a full container online", status);
+
+        if (status == 0) status = fs_init((void**)&gfs, "grow_test.omni", "config_test.uconf");
+        if (status == 0) {
+            user_manager gusers(gfs);
+            file_manager gfiles(gfs, &gusers);
+            status = expect(gfs->header.total_size == 16777216 && read_file(gfiles, "/fill.bin") == fill &&
+                            read_file(gfiles, "/late.bin") == late);
+            fs_shutdown(gfs);
+        }
+        print_test("Grown container after reopen", status);
+    }
+
     cout << "\n✅ OFS test complete.\n";
     return 0;
 }